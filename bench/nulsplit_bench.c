@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compares NUL search used to split command arguments with a plain memchr
+ * loop on payloads that look like MACRO and MAIL commands
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "nulsplit.h"
+
+#define MAX_NULS 1024
+
+typedef gsize (*find_nul_func) (const guchar *p, gsize len, guint32 *pos,
+		gsize maxpos);
+
+static gsize
+find_nul_memchr (const guchar *p, gsize len, guint32 *pos, gsize maxpos)
+{
+	const guchar *c, *cur = p, *end = p + len;
+	gsize n = 0;
+
+	while (cur < end && n < maxpos) {
+		c = memchr (cur, '\0', end - cur);
+
+		if (c == NULL) {
+			break;
+		}
+
+		pos[n++] = c - p;
+		cur = c + 1;
+	}
+
+	return n;
+}
+
+static gdouble
+get_ticks (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Generates NUL separated strings of random length in [minlen, maxlen] */
+static gsize
+gen_payload (guchar *buf, gsize len, gsize minlen, gsize maxlen)
+{
+	gsize i = 0, slen, j;
+
+	while (i < len) {
+		slen = minlen + rand () % (maxlen - minlen + 1);
+
+		for (j = 0; j < slen && i < len - 1; j ++) {
+			buf[i++] = 'a' + rand () % 26;
+		}
+
+		buf[i++] = '\0';
+	}
+
+	return i;
+}
+
+static void
+bench_one (const gchar *name, find_nul_func f, const guchar *buf, gsize len,
+		guint iters, gsize expected)
+{
+	guint32 pos[MAX_NULS];
+	gsize off, n, total = 0, found;
+	guint i;
+	gdouble t1, t2;
+
+	t1 = get_ticks ();
+
+	for (i = 0; i < iters; i ++) {
+		off = 0;
+		found = 0;
+
+		/* Resume after the last position found as the dispatcher does */
+		while (off < len) {
+			n = f (buf + off, len - off, pos, G_N_ELEMENTS (pos));
+
+			if (n == 0) {
+				break;
+			}
+
+			found += n;
+			off += pos[n - 1] + 1;
+		}
+
+		total += found;
+	}
+
+	t2 = get_ticks ();
+
+	if (total != expected * iters) {
+		fprintf (stderr, "%s: found %zu NULs, expected %zu\n", name,
+				total / iters, expected);
+		exit (EXIT_FAILURE);
+	}
+
+	printf ("%-8s %10.2f MB/s %10.1f ns/op\n", name,
+			(gdouble)len * iters / (t2 - t1) / (1024.0 * 1024.0),
+			(t2 - t1) * 1e9 / iters);
+}
+
+int
+main (int argc, char **argv)
+{
+	static const struct {
+		const gchar *name;
+		gsize len, minlen, maxlen;
+	} payloads[] = {
+		{"mail", 128, 4, 32},
+		{"macro", 4096, 1, 24},
+		{"header", 16384, 8, 512},
+		{"large", 65535, 2, 64},
+	};
+	guchar *buf;
+	guint32 pos[MAX_NULS];
+	gsize len, expected, off, n, i;
+	guint iters;
+
+	buf = g_malloc (65536);
+	srand (42);
+
+	for (i = 0; i < G_N_ELEMENTS (payloads); i ++) {
+		len = gen_payload (buf, payloads[i].len, payloads[i].minlen,
+				payloads[i].maxlen);
+		iters = (64 * 1024 * 1024) / len;
+		expected = 0;
+		off = 0;
+
+		while ((n = find_nul_memchr (buf + off, len - off, pos,
+				G_N_ELEMENTS (pos))) > 0) {
+			expected += n;
+			off += pos[n - 1] + 1;
+		}
+
+		printf ("%s: %zu bytes, %zu strings\n", payloads[i].name, len,
+				expected);
+		bench_one ("memchr", find_nul_memchr, buf, len, iters, expected);
+		bench_one ("scalar", rmilter_find_nul_scalar, buf, len, iters, expected);
+#ifdef RMILTER_HAS_X86_SIMD
+		bench_one ("sse2", rmilter_find_nul_sse2, buf, len, iters, expected);
+
+		if (__builtin_cpu_supports ("avx2")) {
+			bench_one ("avx2", rmilter_find_nul_avx2, buf, len, iters, expected);
+		}
+#endif
+		bench_one ("auto", rmilter_find_nul, buf, len, iters, expected);
+	}
+
+	g_free (buf);
+
+	return 0;
+}
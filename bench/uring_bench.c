@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compares io_uring, epoll and libev backends on many sessions that exchange
+ * small frames: every round the MTA thread sends a HELO command to each
+ * session and then waits for all replies
+ */
+
+#include <sys/socket.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "librmilter.h"
+#include "librmilter_uring.h"
+#include "librmilter_epoll.h"
+#ifdef HAVE_LIBEV
+#include "libmilter_ev.h"
+#endif
+
+#define DEFAULT_SESSIONS 256
+#define DEFAULT_ROUNDS 2000
+
+struct bench_ctx {
+	int *mta;
+	unsigned int nsessions;
+	unsigned int rounds;
+	unsigned int helos;
+	double elapsed;
+	void (*stop) (struct bench_ctx *ctx);
+	void *loop;
+};
+
+static double
+get_ticks (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+put_frame (unsigned char *buf, char cmd, const void *data, size_t len)
+{
+	uint32_t nlen = htonl (len + 1);
+
+	memcpy (buf, &nlen, sizeof (nlen));
+	buf[4] = cmd;
+	memcpy (buf + 5, data, len);
+
+	return len + 5;
+}
+
+static void
+write_all (int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write (fd, buf, len);
+
+		if (r <= 0) {
+			perror ("write");
+			exit (EXIT_FAILURE);
+		}
+
+		buf += r;
+		len -= r;
+	}
+}
+
+static void
+read_all (int fd, unsigned char *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = read (fd, buf, len);
+
+		if (r <= 0) {
+			perror ("read");
+			exit (EXIT_FAILURE);
+		}
+
+		buf += r;
+		len -= r;
+	}
+}
+
+/* Reads one reply frame and returns its code */
+static char
+read_reply (int fd)
+{
+	unsigned char buf[256];
+	uint32_t len;
+
+	read_all (fd, buf, 4);
+	memcpy (&len, buf, sizeof (len));
+	len = ntohl (len);
+
+	if (len == 0 || len > sizeof (buf)) {
+		fprintf (stderr, "bad reply length: %u\n", len);
+		exit (EXIT_FAILURE);
+	}
+
+	read_all (fd, buf, len);
+
+	return buf[0];
+}
+
+static void *
+mta_thread (void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	unsigned char optneg[32], helo[32];
+	uint32_t opts[3];
+	size_t optneg_len, helo_len;
+	unsigned int i, r;
+	double t1;
+
+	opts[0] = htonl (6);
+	opts[1] = htonl (0);
+	opts[2] = htonl (0);
+	optneg_len = put_frame (optneg, 'O', opts, sizeof (opts));
+	helo_len = put_frame (helo, 'H', "bench.example", sizeof ("bench.example"));
+
+	for (i = 0; i < ctx->nsessions; i ++) {
+		write_all (ctx->mta[i], optneg, optneg_len);
+		read_reply (ctx->mta[i]);
+	}
+
+	t1 = get_ticks ();
+
+	for (r = 0; r < ctx->rounds; r ++) {
+		for (i = 0; i < ctx->nsessions; i ++) {
+			write_all (ctx->mta[i], helo, helo_len);
+		}
+
+		for (i = 0; i < ctx->nsessions; i ++) {
+			if (read_reply (ctx->mta[i]) != 'c') {
+				fprintf (stderr, "unexpected reply\n");
+				exit (EXIT_FAILURE);
+			}
+		}
+	}
+
+	ctx->elapsed = get_ticks () - t1;
+
+	return NULL;
+}
+
+static enum librmilter_reply
+bench_helo (struct rmilter_session *s, void *priv, const char *helo)
+{
+	struct bench_ctx *ctx = priv;
+
+	if (++ctx->helos == ctx->nsessions * ctx->rounds) {
+		ctx->stop (ctx);
+	}
+
+	return RMILTER_REPLY_CONTINUE;
+}
+
+/* Logging would dominate the event path */
+static void
+bench_log (void *log_data, enum rmilter_log_level level, const char *module,
+		const char *id, const char *function, const char *format, va_list args)
+{
+}
+
+static struct rmilter_callbacks bench_cb = {
+	.hello = bench_helo
+};
+
+static void
+bench_stop_uring (struct bench_ctx *ctx)
+{
+	rmilter_uring_break (ctx->loop);
+}
+
+static void
+bench_stop_epoll (struct bench_ctx *ctx)
+{
+	rmilter_epoll_break (ctx->loop);
+}
+
+#ifdef HAVE_LIBEV
+static void
+bench_stop_libev (struct bench_ctx *ctx)
+{
+	ev_break ((struct ev_loop *)ctx->loop, EVBREAK_ALL);
+}
+#endif
+
+static void
+bench_one (const char *name, unsigned int nsessions, unsigned int rounds)
+{
+	struct bench_ctx ctx;
+	struct rmilter_async_context *async;
+	struct rmilter_milter *m;
+	struct rmilter_uring *u = NULL;
+	struct rmilter_epoll *ep = NULL;
+	pthread_t th;
+	int sv[2];
+	unsigned int i;
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.nsessions = nsessions;
+	ctx.rounds = rounds;
+	ctx.mta = malloc (sizeof (int) * nsessions);
+
+	if (strcmp (name, "uring") == 0) {
+		u = rmilter_uring_new (nsessions * 4);
+
+		if (u == NULL) {
+			perror ("io_uring_setup");
+			exit (EXIT_FAILURE);
+		}
+
+		ctx.loop = u;
+		ctx.stop = bench_stop_uring;
+		async = rmilter_gen_uring (u);
+	}
+	else if (strcmp (name, "epoll") == 0) {
+		ep = rmilter_epoll_new ();
+
+		if (ep == NULL) {
+			perror ("epoll_create");
+			exit (EXIT_FAILURE);
+		}
+
+		ctx.loop = ep;
+		ctx.stop = bench_stop_epoll;
+		async = rmilter_gen_epoll (ep);
+	}
+#ifdef HAVE_LIBEV
+	else {
+		ctx.loop = ev_loop_new (EVFLAG_AUTO);
+		ctx.stop = bench_stop_libev;
+		async = rmilter_gen_libev (NULL, ctx.loop);
+	}
+#else
+	else {
+		free (ctx.mta);
+
+		return;
+	}
+#endif
+
+	m = rmilter_create (&bench_cb, async, bench_log, NULL);
+
+	for (i = 0; i < nsessions; i ++) {
+		if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+			perror ("socketpair");
+			exit (EXIT_FAILURE);
+		}
+
+		ctx.mta[i] = sv[0];
+		rmilter_consume_socket (m, sv[1], "bench", "bench", &ctx);
+	}
+
+	pthread_create (&th, NULL, mta_thread, &ctx);
+
+	if (u != NULL) {
+		rmilter_uring_run (u);
+	}
+	else if (ep != NULL) {
+		rmilter_epoll_run (ep);
+	}
+#ifdef HAVE_LIBEV
+	else {
+		ev_run ((struct ev_loop *)ctx.loop, 0);
+	}
+#endif
+
+	pthread_join (th, NULL);
+
+	printf ("%-6s %6u sessions %10.0f commands/s %8.2f us/round\n", name,
+			nsessions, (double)nsessions * rounds / ctx.elapsed,
+			ctx.elapsed * 1e6 / rounds);
+
+	rmilter_destroy (m);
+
+	for (i = 0; i < nsessions; i ++) {
+		close (ctx.mta[i]);
+	}
+
+	if (u != NULL) {
+		while (u->nevents > 0) {
+			rmilter_uring_run_once (u);
+		}
+
+		rmilter_uring_free (u);
+	}
+	else if (ep != NULL) {
+		rmilter_epoll_free (ep);
+	}
+#ifdef HAVE_LIBEV
+	else {
+		ev_loop_destroy ((struct ev_loop *)ctx.loop);
+	}
+#endif
+
+	if (async->cleanup != NULL) {
+		async->cleanup (async->data);
+	}
+
+	free (async);
+	free (ctx.mta);
+}
+
+int
+main (int argc, char **argv)
+{
+	unsigned int nsessions = DEFAULT_SESSIONS, rounds = DEFAULT_ROUNDS;
+
+	if (argc > 1) {
+		nsessions = strtoul (argv[1], NULL, 10);
+	}
+
+	if (argc > 2) {
+		rounds = strtoul (argv[2], NULL, 10);
+	}
+
+	bench_one ("uring", nsessions, rounds);
+	bench_one ("epoll", nsessions, rounds);
+#ifdef HAVE_LIBEV
+	bench_one ("libev", nsessions, rounds);
+#endif
+
+	return 0;
+}
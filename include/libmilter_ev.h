@@ -28,7 +28,6 @@
 #include <ev.h>
 #include <stdlib.h>
 #include <string.h>
-#include <glib.h>
 #include "librmilter.h"
 
 #ifdef  __cplusplus
@@ -49,13 +48,53 @@ static void rmilter_libev_repeat_timer (void *priv_data, void *ev_data);
 static void rmilter_libev_del_timer (void *priv_data, void *ev_data);
 static void rmilter_libev_stop_event (void *priv_data, void *ev_data);
 static void rmilter_libev_start_event (void *priv_data, void *ev_data);
+static void rmilter_libev_cleanup (void *priv_data);
 
-struct rmilter_ev_periodic_cbdata {
-	ev_timer *ev;
+/* Number of watchers allocated at once */
+#define RMILTER_LIBEV_SLAB_SIZE 64
+
+enum rmilter_libev_kind {
+	RMILTER_LIBEV_READ = 0,
+	RMILTER_LIBEV_WRITE,
+	RMILTER_LIBEV_TIMER,
+	RMILTER_LIBEV_PERIODIC
+};
+
+struct rmilter_libev_event {
+	/* Must be the first member, watchers are cast to events */
+	union {
+		ev_io io;
+		ev_timer timer;
+	} w;
+	enum rmilter_libev_kind kind;
+	void *user_data;
 	rmilter_periodic_callback cb;
-	void *cbdata;
+	struct rmilter_libev_event *next_free;
 };
 
+struct rmilter_libev_slab {
+	struct rmilter_libev_slab *next;
+	struct rmilter_libev_event events[RMILTER_LIBEV_SLAB_SIZE];
+};
+
+/*
+ * Watchers are taken from slabs owned by the context and are never returned
+ * to the heap until cleanup, so sessions cost no allocations for events
+ */
+struct rmilter_libev_data {
+	struct ev_loop *loop;
+	struct rmilter_libev_event *free_events;
+	struct rmilter_libev_slab *slabs;
+};
+
+/**
+ * Creates async context for libev loop. Context might be shared by milters
+ * running in the same loop and is not freed by them: once all of them are
+ * destroyed, call `cleanup (ctx->data)` to release the watchers and then
+ * `free ()` the context itself. Note that `ctx->data` is a private structure
+ * rather than the loop, the loop is its `loop` member. Returns NULL if memory is
+ * exhausted.
+ */
 static struct rmilter_async_context*
 rmilter_gen_libev (struct rmilter_resolver *resolver, struct ev_loop *loop)
 {
@@ -70,185 +109,260 @@ rmilter_gen_libev (struct rmilter_resolver *resolver, struct ev_loop *loop)
 			.del_timer = rmilter_libev_del_timer,
 			.add_periodic = rmilter_libev_add_periodic,
 			.del_periodic = rmilter_libev_del_periodic,
-			.cleanup = NULL,
+			.cleanup = rmilter_libev_cleanup,
 			.stop_event = rmilter_libev_stop_event,
 			.start_event = rmilter_libev_start_event
 	};
 	struct rmilter_async_context *nctx;
-	void *ptr;
-	
-	ptr = g_slice_alloc (sizeof (struct rmilter_async_context));
-	if (ptr != NULL) {
-		nctx = (struct rmilter_async_context *) ptr;
-		memcpy (ptr, (void *) &ev_ctx, sizeof (struct rmilter_async_context));
-		nctx->data = (void *) loop;
+	struct rmilter_libev_data *data;
+
+	nctx = malloc (sizeof (struct rmilter_async_context));
+	data = calloc (1, sizeof (*data));
+
+	if (nctx == NULL || data == NULL) {
+		free (nctx);
+		free (data);
+
+		return NULL;
 	}
 
+	memcpy (nctx, &ev_ctx, sizeof (struct rmilter_async_context));
+	data->loop = loop;
+	nctx->data = data;
+
 	return nctx;
 }
 
-static void
-rmilter_libev_read_event (struct ev_loop *loop, ev_io *ev, int revents)
+static struct rmilter_libev_event *
+rmilter_libev_event_alloc (struct rmilter_libev_data *data,
+		enum rmilter_libev_kind kind, void *user_data)
 {
-	rmilter_process_read (ev->fd, ev->data);
+	struct rmilter_libev_slab *slab;
+	struct rmilter_libev_event *ev;
+	unsigned int i;
+
+	if (data->free_events == NULL) {
+		slab = malloc (sizeof (*slab));
+
+		if (slab == NULL) {
+			return NULL;
+		}
+
+		slab->next = data->slabs;
+		data->slabs = slab;
+
+		for (i = 0; i < RMILTER_LIBEV_SLAB_SIZE; i ++) {
+			slab->events[i].next_free = data->free_events;
+			data->free_events = &slab->events[i];
+		}
+	}
+
+	ev = data->free_events;
+	data->free_events = ev->next_free;
+	ev->kind = kind;
+	ev->user_data = user_data;
+	ev->cb = NULL;
+
+	return ev;
 }
 
 static void
-rmilter_libev_write_event (struct ev_loop *loop, ev_io *ev, int revents)
+rmilter_libev_event_free (struct rmilter_libev_data *data,
+		struct rmilter_libev_event *ev)
 {
-	rmilter_process_write (ev->fd, ev->data);
+	switch (ev->kind) {
+	case RMILTER_LIBEV_READ:
+	case RMILTER_LIBEV_WRITE:
+		ev_io_stop (data->loop, &ev->w.io);
+		break;
+	default:
+		ev_timer_stop (data->loop, &ev->w.timer);
+		break;
+	}
+
+	ev->next_free = data->free_events;
+	data->free_events = ev;
 }
 
 static void
-rmilter_libev_timer_event (struct ev_loop *loop, ev_timer *ev, int revents)
+rmilter_libev_io_event (struct ev_loop *loop, ev_io *w, int revents)
 {
-	rmilter_process_timer (ev->data);
+	struct rmilter_libev_event *ev = (struct rmilter_libev_event *) w;
+
+	if (ev->kind == RMILTER_LIBEV_READ) {
+		rmilter_process_read (w->fd, ev->user_data);
+	}
+	else {
+		rmilter_process_write (w->fd, ev->user_data);
+	}
 }
 
 static void
-rmilter_libev_periodic_event (struct ev_loop *loop, ev_timer *ev, int revents)
+rmilter_libev_timer_event (struct ev_loop *loop, ev_timer *w, int revents)
+{
+	struct rmilter_libev_event *ev = (struct rmilter_libev_event *) w;
+
+	if (ev->kind == RMILTER_LIBEV_PERIODIC) {
+		ev->cb (ev->user_data);
+	}
+	else {
+		rmilter_process_timer (ev->user_data);
+	}
+}
+
+static void *
+rmilter_libev_add_io (struct rmilter_libev_data *data, int fd,
+		enum rmilter_libev_kind kind, void *user_data)
 {
-	struct rmilter_ev_periodic_cbdata *cbdata = (struct rmilter_ev_periodic_cbdata *)
-			ev->data;
-	cbdata->cb (cbdata->cbdata);
+	struct rmilter_libev_event *ev;
+
+	ev = rmilter_libev_event_alloc (data, kind, user_data);
+
+	if (ev == NULL) {
+		return NULL;
+	}
+
+	ev_io_init (&ev->w.io, rmilter_libev_io_event, fd,
+			kind == RMILTER_LIBEV_READ ? EV_READ : EV_WRITE);
+	ev_io_start (data->loop, &ev->w.io);
+
+	return ev;
 }
 
 static void *
 rmilter_libev_add_read (void *priv_data, int fd, void *user_data)
 {
-	ev_io *ev;
-	void *ptr;
-
-	ptr = g_slice_alloc (sizeof (ev_io));
-	if (ptr != NULL) {
-		ev = (ev_io *) ptr;
-		ev_io_init (ev, rmilter_libev_read_event, fd, EV_READ);
-		ev->data = user_data;
-		ev_io_start ((struct ev_loop *) priv_data, ev);
-	}
-	return ptr;
+	return rmilter_libev_add_io (priv_data, fd, RMILTER_LIBEV_READ, user_data);
 }
 
 static void
 rmilter_libev_del_read (void *priv_data, void *ev_data)
 {
-	ev_io *ev = (ev_io *) ev_data;
-	if (ev != NULL) {
-		ev_io_stop ((struct ev_loop *) priv_data, ev);
-		g_slice_free1 (sizeof (*ev), (void *) ev);
+	if (ev_data != NULL) {
+		rmilter_libev_event_free (priv_data, ev_data);
 	}
 }
+
 static void *
 rmilter_libev_add_write (void *priv_data, int fd, void *user_data)
 {
-	ev_io *ev;
-
-	ev = (ev_io *) g_slice_alloc (sizeof (ev_io));
-	if (ev != NULL) {
-		ev_io_init (ev, rmilter_libev_write_event, fd, EV_WRITE);
-		ev->data = user_data;
-		ev_io_start ((struct ev_loop *) priv_data, ev);
-	}
-	return (void *) ev;
+	return rmilter_libev_add_io (priv_data, fd, RMILTER_LIBEV_WRITE, user_data);
 }
 
 static void
 rmilter_libev_del_write (void *priv_data, void *ev_data)
 {
-	ev_io *ev = (ev_io *) ev_data;
-	if (ev != NULL) {
-		ev_io_stop ((struct ev_loop *) priv_data, ev);
-		g_slice_free1 (sizeof (*ev), (void *) ev);
+	if (ev_data != NULL) {
+		rmilter_libev_event_free (priv_data, ev_data);
 	}
 }
 
 static void *
-rmilter_libev_add_timer (void *priv_data, double after, void *user_data)
+rmilter_libev_add_periodic (void *priv_data, double after,
+		rmilter_periodic_callback cb, void *user_data)
 {
-	ev_timer *ev;
-	ev = (ev_timer *) g_slice_alloc (sizeof (ev_timer));
-	if (ev != NULL) {
-		ev_timer_init (ev, rmilter_libev_timer_event, after, after);
-		ev->data = user_data;
-		ev_timer_start ((struct ev_loop *) priv_data, ev);
+	struct rmilter_libev_data *data = priv_data;
+	struct rmilter_libev_event *ev;
+
+	ev = rmilter_libev_event_alloc (data,
+			cb ? RMILTER_LIBEV_PERIODIC : RMILTER_LIBEV_TIMER, user_data);
+
+	if (ev == NULL) {
+		return NULL;
 	}
-	return (void *) ev;
+
+	ev->cb = cb;
+	ev_timer_init (&ev->w.timer, rmilter_libev_timer_event, after, after);
+	ev_timer_start (data->loop, &ev->w.timer);
+
+	return ev;
 }
 
 static void *
-rmilter_libev_add_periodic (void *priv_data, double after,
-		rmilter_periodic_callback cb, void *user_data)
+rmilter_libev_add_timer (void *priv_data, double after, void *user_data)
 {
-	ev_timer *ev;
-	struct rmilter_ev_periodic_cbdata *cbdata = NULL;
-
-	ev = (ev_timer *) g_slice_alloc (sizeof (ev_timer));
-	if (ev != NULL) {
-		cbdata = (struct rmilter_ev_periodic_cbdata *)
-				g_slice_alloc (sizeof (struct rmilter_ev_periodic_cbdata));
-		if (cbdata != NULL) {
-			cbdata->cb = cb;
-			cbdata->cbdata = user_data;
-			cbdata->ev = ev;
-			ev_timer_init (ev, rmilter_libev_periodic_event, after, after);
-			ev->data = cbdata;
-			ev_timer_start ((struct ev_loop *) priv_data, ev);
-		}
-		else {
-			g_slice_free1 (sizeof (*ev), (void *) ev);
-			return NULL;
-		}
-	}
-	return (void *) cbdata;
+	return rmilter_libev_add_periodic (priv_data, after, NULL, user_data);
 }
 
 static void
 rmilter_libev_del_periodic (void *priv_data, void *ev_data)
 {
-	struct rmilter_ev_periodic_cbdata *cbdata = (struct rmilter_ev_periodic_cbdata *)
-			ev_data;
-	if (cbdata != NULL) {
-		ev_timer_stop ((struct ev_loop *) priv_data, (ev_timer *) cbdata->ev);
-		g_slice_free1 (sizeof (*cbdata->ev), (void *) cbdata->ev);
-		g_slice_free1 (sizeof (*cbdata), (void *) cbdata);
+	if (ev_data != NULL) {
+		rmilter_libev_event_free (priv_data, ev_data);
 	}
 }
 
 static void
 rmilter_libev_repeat_timer (void *priv_data, void *ev_data)
 {
-	ev_timer *ev = (ev_timer *) ev_data;
+	struct rmilter_libev_data *data = priv_data;
+	struct rmilter_libev_event *ev = ev_data;
+
 	if (ev != NULL) {
-		ev_timer_again ((struct ev_loop *) priv_data, ev);
+		ev_timer_again (data->loop, &ev->w.timer);
 	}
 }
 
 static void
 rmilter_libev_del_timer (void *priv_data, void *ev_data)
 {
-	ev_timer *ev = (ev_timer *) ev_data;
-	if (ev != NULL) {
-		ev_timer_stop ((struct ev_loop *) priv_data, ev);
-		g_slice_free1 (sizeof (*ev), (void *) ev);
+	if (ev_data != NULL) {
+		rmilter_libev_event_free (priv_data, ev_data);
 	}
 }
 
 static void
 rmilter_libev_start_event (void *priv_data, void *ev_data)
 {
-	ev_io *ev = (ev_io *) ev_data;
-	if (ev != NULL) {
-		ev_io_start ((struct ev_loop *) priv_data, ev);
+	struct rmilter_libev_data *data = priv_data;
+	struct rmilter_libev_event *ev = ev_data;
+
+	if (ev == NULL) {
+		return;
+	}
+
+	if (ev->kind == RMILTER_LIBEV_READ || ev->kind == RMILTER_LIBEV_WRITE) {
+		ev_io_start (data->loop, &ev->w.io);
+	}
+	else {
+		/* Timer starts counting from now */
+		ev_timer_again (data->loop, &ev->w.timer);
 	}
 }
 
 static void
 rmilter_libev_stop_event (void *priv_data, void *ev_data)
 {
-	ev_io *ev = (ev_io *) ev_data;
-	if (ev != NULL) {
-		ev_io_stop ((struct ev_loop *) priv_data, ev);
+	struct rmilter_libev_data *data = priv_data;
+	struct rmilter_libev_event *ev = ev_data;
+
+	if (ev == NULL) {
+		return;
+	}
+
+	if (ev->kind == RMILTER_LIBEV_READ || ev->kind == RMILTER_LIBEV_WRITE) {
+		ev_io_stop (data->loop, &ev->w.io);
 	}
+	else {
+		ev_timer_stop (data->loop, &ev->w.timer);
+	}
+}
+
+/*
+ * Frees watchers, all events must be deleted before
+ */
+static void
+rmilter_libev_cleanup (void *priv_data)
+{
+	struct rmilter_libev_data *data = priv_data;
+	struct rmilter_libev_slab *slab;
+
+	while ((slab = data->slabs) != NULL) {
+		data->slabs = slab->next;
+		free (slab);
+	}
+
+	free (data);
 }
 
 #ifdef  __cplusplus
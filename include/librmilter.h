@@ -31,8 +31,6 @@
 #include <stdbool.h>
 #include <stdarg.h>
 
-#include <glib.h>
-
 #ifdef  __cplusplus
 extern "C" {
 #endif
@@ -47,6 +45,14 @@ struct rmilter_session;
  */
 struct rmilter_milter;
 
+/*
+ * Preencoded SMTP reply
+ */
+struct rmilter_reply_code;
+struct rmilter_pending;
+struct rmilter_shard_group;
+struct rmilter_pool;
+
 /*
  * Reply codes
  */
@@ -55,11 +61,90 @@ enum librmilter_reply {
 	RMILTER_REPLY_REJECT = 1,
 	RMILTER_REPLY_DISCARD = 2,
 	RMILTER_REPLY_ACCEPT = 3,
-	RMILTER_REPLY_TEMPFAIL = 4
+	RMILTER_REPLY_TEMPFAIL = 4,
+	/* Skip the rest of body, valid for the body callback only */
+	RMILTER_REPLY_SKIP = 5,
+	/* Verdict is deferred, see `rmilter_session_defer` */
+	RMILTER_REPLY_PENDING = 6
+};
+
+/*
+ * Maximum size of data in a single command
+ */
+enum rmilter_max_data_size {
+	RMILTER_MDS_64K = 0,
+	RMILTER_MDS_256K,
+	RMILTER_MDS_1M
+};
+
+/*
+ * Protocol stages
+ */
+enum rmilter_stage {
+	RMILTER_STAGE_CONNECT = (1 << 0),
+	RMILTER_STAGE_HELO = (1 << 1),
+	RMILTER_STAGE_MAIL = (1 << 2),
+	RMILTER_STAGE_RCPT = (1 << 3),
+	RMILTER_STAGE_DATA = (1 << 4),
+	RMILTER_STAGE_HEADER = (1 << 5),
+	RMILTER_STAGE_EOH = (1 << 6),
+	RMILTER_STAGE_BODY = (1 << 7),
+	RMILTER_STAGE_UNKNOWN = (1 << 8),
+	RMILTER_STAGE_EOM = (1 << 9)
+};
+
+/*
+ * Work running in a thread pool, it must not access the session
+ */
+typedef enum librmilter_reply (*rmilter_work_func) (void *arg);
+/*
+ * Called in the loop thread when work is done, session is NULL if the verdict
+ * is not needed anymore (the session is closed or the message is aborted)
+ */
+typedef enum librmilter_reply (*rmilter_work_finish) (
+		struct rmilter_session *s, enum librmilter_reply verdict, void *arg);
+
+/*
+ * Consumer of the message body, see `rmilter_session_stream_body`
+ */
+struct rmilter_stream_funcs {
+	/* Called in a pool thread for each body chunk in order */
+	void (*chunk) (void *arg, const unsigned char *data, size_t len);
+	/* Called in a pool thread after the last chunk, returns body verdict */
+	rmilter_work_func end;
+	/* Called in the loop thread once the stream is over, might be NULL */
+	rmilter_work_finish finish;
+};
+
+/*
+ * How sockets are distributed between milters of a shard group
+ */
+enum rmilter_shard_policy {
+	RMILTER_SHARD_ROUND_ROBIN = 0,
+	/* Milter with the least number of sessions */
+	RMILTER_SHARD_LEAST_LOADED
 };
 
 /*
- * This structure is used to
+ * Reasons of pending verdict cancellation
+ */
+enum rmilter_cancel_reason {
+	/* MTA has aborted the message */
+	RMILTER_CANCEL_ABORT = 0,
+	/* Session is closed */
+	RMILTER_CANCEL_CLOSE,
+	/* Stage time budget is over */
+	RMILTER_CANCEL_TIMEOUT
+};
+
+typedef void (*rmilter_cancel_callback) (struct rmilter_pending *p,
+		enum rmilter_cancel_reason reason, void *ud);
+
+/*
+ * This structure is used to pass the address of the SMTP client to the
+ * `connect` callback. IP addresses are stored in network byte order, unix
+ * path points to the data received from the MTA and is valid merely during the
+ * callback invocation.
  */
 struct rmilter_addr {
 	enum {
@@ -69,15 +154,31 @@ struct rmilter_addr {
 		RMILTER_ADDR_UNKNOWN
 	} type;
 
+	uint16_t port;
+
 	union {
 		uint32_t ip4;
-		uint32_t ip6[16];
-		char *path;
+		uint8_t ip6[16];
+		const char *path;
 	} addr;
 };
 
+/*
+ * Arguments of a command, such as the address and ESMTP parameters of
+ * MAIL FROM and RCPT TO
+ */
+struct rmilter_args {
+	const char *const *argv;
+	unsigned int argc;
+};
+
 /*
  * Milter callbacks
+ *
+ * All strings and buffers passed to callbacks point to the command received
+ * from the MTA, so they are valid merely during the callback invocation and
+ * must be copied if a milter needs them afterwards. Callbacks that are NULL
+ * are treated as if they return `RMILTER_REPLY_CONTINUE`.
  */
 struct rmilter_callbacks {
 	/* connection info filter */
@@ -92,11 +193,11 @@ struct rmilter_callbacks {
 
 	/* envelope sender filter */
 	enum librmilter_reply (*envfrom) (struct rmilter_session *ctx,
-			void *priv, GPtrArray *from);
+			void *priv, const struct rmilter_args *from);
 
 	/* envelope recipient filter */
 	enum librmilter_reply (*envrcpt) (struct rmilter_session *ctx,
-			void *priv, GPtrArray *rcpt);
+			void *priv, const struct rmilter_args *rcpt);
 
 	/* header filter */
 	enum librmilter_reply (*header) (struct rmilter_session *ctx,
@@ -125,6 +226,10 @@ struct rmilter_callbacks {
 	/* SMTP DATA command filter */
 	enum librmilter_reply (*data) (struct rmilter_session *ctx,
 			void *priv);
+
+	/* unknown or unimplemented SMTP command filter */
+	enum librmilter_reply (*unknown) (struct rmilter_session *ctx,
+			void *priv, const char *cmd);
 };
 
 /*
@@ -146,6 +251,7 @@ struct rmilter_async_context {
 	void (*del_periodic) (void *priv_data, void *ev_data);
 	void (*stop_event) (void *priv_data, void *ev_data);
 	void (*start_event) (void *priv_data, void *ev_data);
+	/* Might be NULL, called by the owner of the context rather than milters */
 	void (*cleanup) (void *priv_data);
 };
 
@@ -174,7 +280,8 @@ typedef void (*rmilter_log_function) (
 /**
  * Creates new milter and returns pointer to the opaque structure
  * @param callbacks callback functions
- * @param async asynchronous bindings
+ * @param async asynchronous bindings, still owned by the caller and must
+ * outlive the milter
  * @param log log function callback
  * @param log_data opaque logging structure data
  */
@@ -183,6 +290,91 @@ struct rmilter_milter *rmilter_create (struct rmilter_callbacks *callbacks,
 		rmilter_log_function log,
 		void *log_data);
 
+/**
+ * Enables storing of message body, so it could be accessed as a whole from
+ * the `eom` callback. Body is kept in memory until it grows over the
+ * threshold, after that it is moved to an anonymous file.
+ * @param milter milter structure
+ * @param enable enable or disable body storing
+ * @param spill_threshold size of body kept in memory (0 means default 1Mb)
+ */
+void rmilter_set_body_store (struct rmilter_milter *milter, bool enable,
+		size_t spill_threshold);
+
+/**
+ * Sets the maximum size of command data that milter asks the MTA to use
+ * (protocol version 6 only). Larger body chunks mean fewer commands, callback
+ * invocations and replies per message; the MTA may still refuse it, so the
+ * classic 64K limit is used in this case.
+ * @param milter milter structure
+ * @param mds maximum data size
+ */
+void rmilter_set_max_data_size (struct rmilter_milter *milter,
+		enum rmilter_max_data_size mds);
+
+/**
+ * Sets interval of progress notifications sent to the MTA while a verdict is
+ * pending, so the MTA does not time out the milter
+ * @param milter milter structure
+ * @param interval interval in seconds (0 disables notifications)
+ */
+void rmilter_set_progress_interval (struct rmilter_milter *milter,
+		double interval);
+
+/**
+ * Sets time budget for processing of the specified stages. Budget starts when
+ * the command is received; if a deferred verdict is not resumed within it,
+ * pending work is cancelled and the stage is tempfailed.
+ * @param milter milter structure
+ * @param stages bitmask of `enum rmilter_stage` values
+ * @param timeout budget in seconds (0 means no limit)
+ */
+void rmilter_set_stage_timeout (struct rmilter_milter *milter,
+		unsigned int stages, double timeout);
+
+/**
+ * Declares macros that milter reads at the specified stages. The lists are
+ * sent during negotiation, so the MTA sends only these macros instead of its
+ * default set. MTA must support symbol lists, otherwise it sends the default
+ * set as usual.
+ * @param milter milter structure
+ * @param stages bitmask of connect, helo, mail, rcpt, data, eoh and eom
+ * stages
+ * @param macros space separated macro names, e.g. "i {auth_authen}", or NULL
+ * to restore the default set
+ * @return false if lists are not supported for some of the stages
+ */
+bool rmilter_set_macro_list (struct rmilter_milter *milter,
+		unsigned int stages, const char *macros);
+
+/**
+ * Limits the amount of body passed to the `body` callback (and to the body
+ * store). Once the limit is reached the MTA is told to skip the rest of
+ * body, if it supports that, so large messages are not transferred in full.
+ * @param milter milter structure
+ * @param sample number of body bytes to process (0 means no limit)
+ */
+void rmilter_set_body_sample (struct rmilter_milter *milter, size_t sample);
+
+/**
+ * Limits the amount of body queued to a stream consumer, reading from the MTA
+ * is paused when the consumer falls behind
+ * @param milter milter structure
+ * @param size number of bytes (1 MiB by default)
+ */
+void rmilter_set_stream_buffer (struct rmilter_milter *milter, size_t size);
+
+/**
+ * Declares stages whose callbacks always return `RMILTER_REPLY_CONTINUE`, so
+ * the MTA is asked not to wait for replies to these commands. Stages with no
+ * callback defined are not sent by the MTA at all, there is no need to
+ * declare them. Any other verdict returned from a declared stage is ignored.
+ * @param milter milter structure
+ * @param stages bitmask of `enum rmilter_stage` values
+ */
+void rmilter_set_noreply_stages (struct rmilter_milter *milter,
+		unsigned int stages);
+
 /**
  * Consumes socket, creating new context using the specified milter and file
  * descriptor. File descriptor is **transferred** meaning, that you cannot
@@ -193,15 +385,321 @@ struct rmilter_milter *rmilter_create (struct rmilter_callbacks *callbacks,
  * @param module module description (for logging)
  * @param id session id
  * @param ud opaque user data
+ * @return false if session cannot be created, descriptor is not consumed then
  */
 bool rmilter_consume_socket (struct rmilter_milter *milter, int fd,
 		const char *module, const char *id, void *ud);
 
 /**
- * Destroys milter and all its sessions
+ * Destroys milter and all its sessions. Shard groups the milter has been added
+ * to must be destroyed before, and so must be the thread pool it uses: results
+ * of the work that are not delivered yet are delivered here.
  */
 void rmilter_destroy (struct rmilter_milter *milter);
 
+/**
+ * Creates group of milters running in different threads with their own event
+ * loops, so sockets could be accepted by one thread and processed by others
+ * @param policy how to select milter for a new socket
+ * @return new group or NULL if atomic operations are not supported
+ */
+struct rmilter_shard_group *rmilter_shard_group_create (
+		enum rmilter_shard_policy policy);
+
+/**
+ * Adds milter to the group. Must be called from the thread running the
+ * milter's event loop and before any socket is dispatched to the group.
+ * @param g group
+ * @param milter milter structure
+ */
+bool rmilter_shard_group_add (struct rmilter_shard_group *g,
+		struct rmilter_milter *milter);
+
+/**
+ * Passes socket to one of the milters of the group, might be called from any
+ * thread. Session is created in the milter's thread as if
+ * `rmilter_consume_socket` has been called there; module and id are copied.
+ * @param g group
+ * @param fd file descriptor to be used for the session
+ * @param module module description (for logging)
+ * @param id session id
+ * @param ud opaque user data
+ */
+bool rmilter_shard_group_dispatch (struct rmilter_shard_group *g, int fd,
+		const char *module, const char *id, void *ud);
+
+/**
+ * Creates pool of threads that could run heavy work off the event loops
+ * @param nthreads number of threads (0 means one per online CPU)
+ * @return new pool or NULL if atomic operations are not supported
+ */
+struct rmilter_pool *rmilter_pool_create (unsigned int nthreads);
+
+/**
+ * Waits for the queued work and destroys pool. Results of the work are
+ * delivered to milters by the next iteration of their loops or, if a milter
+ * is destroyed before that, by `rmilter_destroy`. Results posted after
+ * `rmilter_destroy` are never delivered, so pool must be destroyed first.
+ */
+void rmilter_pool_destroy (struct rmilter_pool *pool);
+
+/**
+ * Sets thread pool used by `rmilter_session_offload`, must be called from the
+ * thread running the milter's event loop. Pool could be shared by milters.
+ * @param milter milter structure
+ * @param pool thread pool or NULL to run work in place
+ */
+bool rmilter_set_thread_pool (struct rmilter_milter *milter,
+		struct rmilter_pool *pool);
+
+/**
+ * Runs work in the thread pool and defers the verdict until it is done; the
+ * result is returned from the callback as is. Body returned by
+ * `rmilter_session_body_map` stays valid for work until it is finished.
+ * Without a pool work is done in place.
+ * @param s session
+ * @param work function called in a pool thread
+ * @param finish function called in the loop thread with the result or NULL
+ * @param arg opaque argument for both functions
+ * @return `RMILTER_REPLY_PENDING` or verdict if work has been done in place
+ */
+enum librmilter_reply rmilter_session_offload (struct rmilter_session *s,
+		rmilter_work_func work, rmilter_work_finish finish, void *arg);
+
+/**
+ * Passes body of the current message to a consumer running in the thread
+ * pool while the body is still being received. Chunks are copied to a bounded
+ * queue, so the `body` callback could return as soon as the chunk is queued.
+ * End of message callback is called after `end` with the verdict of `finish`
+ * (or `end` if `finish` is NULL), unless the verdict is not `CONTINUE`.
+ * If the message is aborted, `end` is not called and `finish` is called
+ * with NULL session. Without a pool the consumer runs in place. Body is
+ * sent by the MTA only if there is a `body` callback or the body store.
+ * @param s session
+ * @param funcs consumer callbacks, copied
+ * @param arg opaque argument for callbacks
+ * @return false if the body is already streamed or no body is expected
+ */
+bool rmilter_session_stream_body (struct rmilter_session *s,
+		const struct rmilter_stream_funcs *funcs, void *arg);
+
+/**
+ * Releases group, must be called when no more sockets are dispatched and
+ * before any milter of the group is destroyed: a milter is then always freed
+ * by the thread running its event loop. Sockets that have not been consumed
+ * yet are closed when their milter is destroyed.
+ */
+void rmilter_shard_group_destroy (struct rmilter_shard_group *g);
+
+/**
+ * Returns the value of the macro sent by the MTA. Both `{name}` and `name`
+ * forms are accepted for long macro names. Macros sent for the commands of a
+ * message are forgotten when the message ends or is aborted.
+ * @param s session
+ * @param name macro name
+ * @return macro value or NULL if the macro has not been defined
+ */
+const char *rmilter_session_get_macro (struct rmilter_session *s,
+		const char *name);
+
+/**
+ * Returns identifier of the macro name that is stable for the milter's
+ * lifetime, so callbacks may look macros up without hashing their names.
+ * Should be called before sockets are consumed or from the loop thread.
+ * @param milter milter structure
+ * @param name macro name, in either `{name}` or `name` form
+ * @return identifier or -1 if milter knows too many macro names
+ */
+int rmilter_macro_id (struct rmilter_milter *milter, const char *name);
+
+/**
+ * Returns the value of the macro by its identifier
+ * @param s session
+ * @param id identifier returned by `rmilter_macro_id`
+ * @return macro value or NULL if the macro has not been defined
+ */
+const char *rmilter_session_get_macro_id (struct rmilter_session *s, int id);
+
+/**
+ * Defers the verdict of the current callback. Callback must return
+ * `RMILTER_REPLY_PENDING` after this call, session stops reading commands
+ * until `rmilter_session_resume` is called with the handle returned.
+ * @param s session
+ * @return handle of the deferred verdict
+ */
+struct rmilter_pending *rmilter_session_defer (struct rmilter_session *s);
+
+/**
+ * Sets callback that is called when the deferred verdict is no longer needed:
+ * the message is aborted, the session is closed or the stage budget is over.
+ * Handle must still be resumed to be freed, the verdict is ignored then.
+ * @param p handle
+ * @param cb callback
+ * @param ud opaque user data for the callback
+ */
+void rmilter_pending_set_cancel (struct rmilter_pending *p,
+		rmilter_cancel_callback cb, void *ud);
+
+/**
+ * Returns time left from the budget of the current stage
+ * @param s session
+ * @return seconds left or -1 if the stage has no budget
+ */
+double rmilter_session_time_left (struct rmilter_session *s);
+
+/**
+ * Returns session of the deferred verdict
+ * @param p handle
+ * @return session or NULL if session has been closed
+ */
+struct rmilter_session *rmilter_pending_session (struct rmilter_pending *p);
+
+/**
+ * Delivers deferred verdict and continues processing of the session. Must be
+ * called exactly once for each handle, even if the session has been closed
+ * meanwhile; the handle is freed by this call.
+ * @param p handle returned by `rmilter_session_defer`
+ * @param verdict verdict of the deferred callback
+ */
+void rmilter_session_resume (struct rmilter_pending *p,
+		enum librmilter_reply verdict);
+
+/**
+ * Returns length of the stored body
+ */
+size_t rmilter_session_body_len (struct rmilter_session *s);
+
+/**
+ * Returns contiguous read-only view of the stored body, valid until the end
+ * of the `eom` callback (or until its deferred verdict is resumed)
+ * @param s session
+ * @param len output length of the body
+ * @return pointer to the body or NULL if there is no body or on error
+ */
+const unsigned char *rmilter_session_body_map (struct rmilter_session *s,
+		size_t *len);
+
+/**
+ * Returns file descriptor of the anonymous file with the message body, which
+ * could be passed to another process (e.g. using SCM_RIGHTS). Descriptor is
+ * owned by the session and is closed after the `eom` callback, no more body
+ * chunks could be stored after this call.
+ * @param s session
+ * @param len output length of the body
+ * @return file descriptor or -1 on error
+ */
+int rmilter_session_body_fd (struct rmilter_session *s, size_t *len);
+
+/*
+ * Message modification functions. They could be called from the `eom`
+ * callback merely (or before its deferred verdict is resumed) and return false
+ * when called at any other stage or if the corresponding action has not been
+ * allowed by the MTA. Modifications are sent to the MTA before the reply
+ * returned from the callback.
+ */
+
+/**
+ * Appends a header to the message
+ * @param s session
+ * @param name header name
+ * @param value header value
+ */
+bool rmilter_session_add_header (struct rmilter_session *s, const char *name,
+		const char *value);
+
+/**
+ * Inserts a header at the specified position of the message headers
+ * @param s session
+ * @param idx position (0 means the first header)
+ * @param name header name
+ * @param value header value
+ */
+bool rmilter_session_insert_header (struct rmilter_session *s, unsigned int idx,
+		const char *name, const char *value);
+
+/**
+ * Changes the value of the header
+ * @param s session
+ * @param name header name
+ * @param idx index of the header with this name (starting from 1)
+ * @param value new value, NULL removes the header
+ */
+bool rmilter_session_change_header (struct rmilter_session *s, const char *name,
+		unsigned int idx, const char *value);
+
+/**
+ * Adds recipient to the envelope
+ * @param s session
+ * @param rcpt recipient address
+ * @param args ESMTP arguments or NULL
+ */
+bool rmilter_session_add_rcpt (struct rmilter_session *s, const char *rcpt,
+		const char *args);
+
+/**
+ * Removes recipient from the envelope
+ * @param s session
+ * @param rcpt recipient address as it has been passed to `envrcpt`
+ */
+bool rmilter_session_del_rcpt (struct rmilter_session *s, const char *rcpt);
+
+/**
+ * Changes envelope sender
+ * @param s session
+ * @param from new sender address
+ * @param args ESMTP arguments or NULL
+ */
+bool rmilter_session_change_from (struct rmilter_session *s, const char *from,
+		const char *args);
+
+/**
+ * Quarantines the message
+ * @param s session
+ * @param reason quarantine reason
+ */
+bool rmilter_session_quarantine (struct rmilter_session *s, const char *reason);
+
+/**
+ * Replaces message body, could be called several times to send the new body
+ * by parts
+ * @param s session
+ * @param data body data
+ * @param len length of data
+ */
+bool rmilter_session_replace_body (struct rmilter_session *s,
+		const unsigned char *data, size_t len);
+
+/**
+ * Registers SMTP reply that is encoded once and could be used by all sessions
+ * of the milter with no allocations. Reply codes are freed with the milter.
+ * @param m milter
+ * @param rcode SMTP code (4xx or 5xx)
+ * @param xcode extended code (e.g. "5.7.1") or NULL
+ * @param message reply text or NULL
+ * @return reply code or NULL if arguments are invalid
+ */
+struct rmilter_reply_code *rmilter_register_reply (struct rmilter_milter *m,
+		const char *rcode, const char *xcode, const char *message);
+
+/**
+ * Sets SMTP reply that is sent instead of the next `RMILTER_REPLY_REJECT`
+ * (for 5xx codes) or `RMILTER_REPLY_TEMPFAIL` (for 4xx codes) verdict
+ * @param s session
+ * @param rcode SMTP code (4xx or 5xx)
+ * @param xcode extended code (e.g. "5.7.1") or NULL
+ * @param message reply text or NULL
+ */
+bool rmilter_session_set_reply (struct rmilter_session *s, const char *rcode,
+		const char *xcode, const char *message);
+
+/**
+ * The same as `rmilter_session_set_reply` but uses preencoded reply
+ * @param s session
+ * @param code reply code registered by `rmilter_register_reply`
+ */
+bool rmilter_session_set_cached_reply (struct rmilter_session *s,
+		struct rmilter_reply_code *code);
+
 /* Private functions used by async callbacks */
 void rmilter_process_read (int fd, void *arg);
 void rmilter_process_timer (void *arg);
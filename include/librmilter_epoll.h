@@ -0,0 +1,776 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBRMILTER_EPOLL_H
+#define LIBRMILTER_EPOLL_H
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "librmilter.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Event loop on bare epoll and timerfd. Each descriptor is registered once,
+ * edge triggered, for both reading and writing; adding, deleting, stopping and
+ * starting events of the library only changes the loop's own state.
+ *
+ * Edge triggered events are reported once, so an event started after it has
+ * been stopped is dispatched once unconditionally: the library might have
+ * left data in the socket or missed an edge while the event was stopped.
+ *
+ * All timers share one timerfd that is armed for the earliest deadline.
+ * `repeat_timer` only moves the deadline of the timer, the timer is put back
+ * to the heap when its previous deadline comes, so refreshing IO timeouts
+ * costs no syscalls.
+ */
+
+#define RMILTER_EPOLL_MAX_EVENTS 256
+#define RMILTER_EPOLL_MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+enum rmilter_epoll_ev_kind {
+	RMILTER_EPOLL_READ = 0,
+	RMILTER_EPOLL_WRITE,
+	RMILTER_EPOLL_TIMER
+};
+
+struct rmilter_epoll_fd;
+
+struct rmilter_epoll_io {
+	enum rmilter_epoll_ev_kind kind;
+	struct rmilter_epoll_fd *f;
+	void *user_data;
+	int used;
+	int active;
+	/* Event is in the list of events to dispatch without readiness */
+	int queued;
+	struct rmilter_epoll_io *next_pending;
+};
+
+struct rmilter_epoll_fd {
+	int fd;
+	/* Descriptor is unregistered, events that are already read are ignored */
+	int dead;
+	struct rmilter_epoll_io io[2];
+	struct rmilter_epoll_fd *next_garbage;
+};
+
+struct rmilter_epoll_timer {
+	enum rmilter_epoll_ev_kind kind;
+	/* NULL for the session timers */
+	rmilter_periodic_callback cb;
+	void *user_data;
+	int64_t after;
+	/* Monotonic deadline in nanoseconds */
+	int64_t deadline;
+	/* Deadline the timer is ordered by in the heap, might be earlier */
+	int64_t key;
+	/* Position in the heap or -1 */
+	int heap_idx;
+	int active;
+	int deleted;
+	/* Timer is being dispatched */
+	int hold;
+};
+
+struct rmilter_epoll {
+	int epfd;
+	int tfd;
+	/* Registered descriptors indexed by fd */
+	struct rmilter_epoll_fd **fds;
+	unsigned int nfds;
+	struct rmilter_epoll_timer **heap;
+	unsigned int heap_len;
+	unsigned int heap_size;
+	/* Deadline timerfd is armed for, 0 if it is disarmed */
+	int64_t armed;
+	struct rmilter_epoll_io *pending;
+	/* Descriptors unregistered in the current iteration */
+	struct rmilter_epoll_fd *garbage;
+	int stop;
+};
+
+static void *rmilter_epoll_add_read (void *priv_data, int fd, void *user_data);
+static void rmilter_epoll_del_read (void *priv_data, void *ev_data);
+static void *rmilter_epoll_add_write (void *priv_data, int fd, void *user_data);
+static void rmilter_epoll_del_write (void *priv_data, void *ev_data);
+static void *rmilter_epoll_add_timer (void *priv_data,
+		double after,
+		void *user_data);
+static void *rmilter_epoll_add_periodic (void *priv_data, double after,
+		rmilter_periodic_callback cb, void *user_data);
+static void rmilter_epoll_del_periodic (void *priv_data, void *ev_data);
+static void rmilter_epoll_repeat_timer (void *priv_data, void *ev_data);
+static void rmilter_epoll_del_timer (void *priv_data, void *ev_data);
+static void rmilter_epoll_stop_event (void *priv_data, void *ev_data);
+static void rmilter_epoll_start_event (void *priv_data, void *ev_data);
+
+static struct rmilter_async_context *
+rmilter_gen_epoll (struct rmilter_epoll *loop)
+{
+	static const struct rmilter_async_context epoll_ctx = {
+			.data = NULL,
+			.add_read = rmilter_epoll_add_read,
+			.del_read = rmilter_epoll_del_read,
+			.add_write = rmilter_epoll_add_write,
+			.del_write = rmilter_epoll_del_write,
+			.add_timer = rmilter_epoll_add_timer,
+			.repeat_timer = rmilter_epoll_repeat_timer,
+			.del_timer = rmilter_epoll_del_timer,
+			.add_periodic = rmilter_epoll_add_periodic,
+			.del_periodic = rmilter_epoll_del_periodic,
+			.cleanup = NULL,
+			.stop_event = rmilter_epoll_stop_event,
+			.start_event = rmilter_epoll_start_event
+	};
+	struct rmilter_async_context *nctx;
+
+	nctx = malloc (sizeof (struct rmilter_async_context));
+
+	if (nctx == NULL) {
+		return NULL;
+	}
+
+	memcpy (nctx, &epoll_ctx, sizeof (struct rmilter_async_context));
+	nctx->data = (void *) loop;
+
+	return nctx;
+}
+
+static int64_t
+rmilter_epoll_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * INT64_C (1000000000) + ts.tv_nsec;
+}
+
+/**
+ * Creates epoll event loop
+ * @return new loop or NULL, errno is set in this case
+ */
+static struct rmilter_epoll *
+rmilter_epoll_new (void)
+{
+	struct rmilter_epoll *loop;
+	struct epoll_event ev;
+	int epfd, tfd, saved_errno;
+
+	epfd = epoll_create1 (EPOLL_CLOEXEC);
+
+	if (epfd == -1) {
+		return NULL;
+	}
+
+	tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (tfd == -1) {
+		goto err;
+	}
+
+	memset (&ev, 0, sizeof (ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+
+	if (epoll_ctl (epfd, EPOLL_CTL_ADD, tfd, &ev) == -1) {
+		close (tfd);
+		goto err;
+	}
+
+	loop = calloc (1, sizeof (*loop));
+
+	if (loop == NULL) {
+		close (tfd);
+		goto err;
+	}
+
+	loop->epfd = epfd;
+	loop->tfd = tfd;
+
+	return loop;
+
+err:
+	saved_errno = errno;
+	close (epfd);
+	errno = saved_errno;
+
+	return NULL;
+}
+
+/**
+ * Destroys loop, all events must be deleted before
+ */
+static void
+rmilter_epoll_free (struct rmilter_epoll *loop)
+{
+	struct rmilter_epoll_fd *f;
+
+	while ((f = loop->garbage) != NULL) {
+		loop->garbage = f->next_garbage;
+		free (f);
+	}
+
+	close (loop->tfd);
+	close (loop->epfd);
+	free (loop->fds);
+	free (loop->heap);
+	free (loop);
+}
+
+static void
+rmilter_epoll_heap_swap (struct rmilter_epoll *loop, unsigned int a,
+		unsigned int b)
+{
+	struct rmilter_epoll_timer *t = loop->heap[a];
+
+	loop->heap[a] = loop->heap[b];
+	loop->heap[b] = t;
+	loop->heap[a]->heap_idx = a;
+	loop->heap[b]->heap_idx = b;
+}
+
+static void
+rmilter_epoll_heap_up (struct rmilter_epoll *loop, unsigned int i)
+{
+	while (i > 0 && loop->heap[(i - 1) / 2]->key > loop->heap[i]->key) {
+		rmilter_epoll_heap_swap (loop, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void
+rmilter_epoll_heap_down (struct rmilter_epoll *loop, unsigned int i)
+{
+	unsigned int l, min;
+
+	for (;;) {
+		l = i * 2 + 1;
+		min = i;
+
+		if (l < loop->heap_len && loop->heap[l]->key < loop->heap[min]->key) {
+			min = l;
+		}
+
+		if (l + 1 < loop->heap_len &&
+				loop->heap[l + 1]->key < loop->heap[min]->key) {
+			min = l + 1;
+		}
+
+		if (min == i) {
+			break;
+		}
+
+		rmilter_epoll_heap_swap (loop, i, min);
+		i = min;
+	}
+}
+
+static void
+rmilter_epoll_heap_insert (struct rmilter_epoll *loop,
+		struct rmilter_epoll_timer *t)
+{
+	if (loop->heap_len == loop->heap_size) {
+		loop->heap_size = RMILTER_EPOLL_MAX (loop->heap_size * 2, 64);
+		loop->heap = realloc (loop->heap,
+				loop->heap_size * sizeof (*loop->heap));
+
+		if (loop->heap == NULL) {
+			/* Timers cannot be dropped silently */
+			abort ();
+		}
+	}
+
+	t->key = t->deadline;
+	t->heap_idx = loop->heap_len;
+	loop->heap[loop->heap_len++] = t;
+	rmilter_epoll_heap_up (loop, t->heap_idx);
+}
+
+static void
+rmilter_epoll_heap_remove (struct rmilter_epoll *loop,
+		struct rmilter_epoll_timer *t)
+{
+	unsigned int i = t->heap_idx;
+
+	t->heap_idx = -1;
+	loop->heap_len --;
+
+	if (i != loop->heap_len) {
+		loop->heap[i] = loop->heap[loop->heap_len];
+		loop->heap[i]->heap_idx = i;
+		rmilter_epoll_heap_up (loop, i);
+		rmilter_epoll_heap_down (loop, loop->heap[i]->heap_idx);
+	}
+}
+
+/*
+ * Arms timerfd for the earliest deadline if it has changed
+ */
+static void
+rmilter_epoll_arm_timer (struct rmilter_epoll *loop)
+{
+	struct itimerspec its;
+	int64_t want = loop->heap_len > 0 ? loop->heap[0]->key : 0;
+
+	if (want == loop->armed) {
+		return;
+	}
+
+	memset (&its, 0, sizeof (its));
+	its.it_value.tv_sec = want / 1000000000;
+	its.it_value.tv_nsec = want % 1000000000;
+
+	if (want != 0 && its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+		/* Zero value disarms timer */
+		its.it_value.tv_nsec = 1;
+	}
+
+	timerfd_settime (loop->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+	loop->armed = want;
+}
+
+static void
+rmilter_epoll_run_timers (struct rmilter_epoll *loop)
+{
+	struct rmilter_epoll_timer *t;
+	int64_t now;
+
+	now = rmilter_epoll_now ();
+
+	while (loop->heap_len > 0 && loop->heap[0]->key <= now) {
+		t = loop->heap[0];
+
+		if (t->deadline > now) {
+			/* Timer has been repeated since it was ordered */
+			t->key = t->deadline;
+			rmilter_epoll_heap_down (loop, 0);
+			continue;
+		}
+
+		rmilter_epoll_heap_remove (loop, t);
+		t->hold = 1;
+
+		if (t->cb) {
+			t->cb (t->user_data);
+		}
+		else {
+			rmilter_process_timer (t->user_data);
+		}
+
+		t->hold = 0;
+
+		if (t->deleted) {
+			free (t);
+		}
+		else if (t->active && t->heap_idx == -1) {
+			/* Timers repeat like libev ones do */
+			t->deadline = RMILTER_EPOLL_MAX (t->deadline,
+					now + RMILTER_EPOLL_MAX (t->after, 1));
+			rmilter_epoll_heap_insert (loop, t);
+		}
+	}
+}
+
+static void
+rmilter_epoll_queue (struct rmilter_epoll *loop, struct rmilter_epoll_io *io)
+{
+	if (!io->queued) {
+		io->queued = 1;
+		io->next_pending = loop->pending;
+		loop->pending = io;
+	}
+}
+
+static void
+rmilter_epoll_dispatch (struct rmilter_epoll_fd *f, uint32_t events)
+{
+	if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+			!f->dead && f->io[RMILTER_EPOLL_READ].active) {
+		rmilter_process_read (f->fd, f->io[RMILTER_EPOLL_READ].user_data);
+	}
+
+	/* Reading might have closed the session */
+	if ((events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) &&
+			!f->dead && f->io[RMILTER_EPOLL_WRITE].active) {
+		rmilter_process_write (f->fd, f->io[RMILTER_EPOLL_WRITE].user_data);
+	}
+}
+
+/**
+ * Waits for events and dispatches all of them
+ * @return number of events processed or -1 on error
+ */
+static int
+rmilter_epoll_run_once (struct rmilter_epoll *loop)
+{
+	struct epoll_event events[RMILTER_EPOLL_MAX_EVENTS];
+	struct rmilter_epoll_io *io, *pending;
+	struct rmilter_epoll_fd *f, *garbage;
+	uint64_t expirations;
+	int n, i;
+
+	rmilter_epoll_arm_timer (loop);
+	n = epoll_wait (loop->epfd, events, RMILTER_EPOLL_MAX_EVENTS,
+			loop->pending ? 0 : -1);
+
+	if (n == -1) {
+		if (errno != EINTR) {
+			return -1;
+		}
+
+		n = 0;
+	}
+
+	for (i = 0; i < n; i ++) {
+		f = events[i].data.ptr;
+
+		if (f == NULL) {
+			/* Timerfd is one shot, it is armed again before waiting */
+			while (read (loop->tfd, &expirations, sizeof (expirations)) > 0);
+			loop->armed = 0;
+			continue;
+		}
+
+		rmilter_epoll_dispatch (f, events[i].events);
+	}
+
+	/* Events started again might have data that is reported already */
+	pending = loop->pending;
+	loop->pending = NULL;
+
+	while ((io = pending) != NULL) {
+		pending = io->next_pending;
+		io->queued = 0;
+
+		if (io->kind == RMILTER_EPOLL_READ) {
+			rmilter_epoll_dispatch (io->f, EPOLLIN);
+		}
+		else {
+			rmilter_epoll_dispatch (io->f, EPOLLOUT);
+		}
+
+		n ++;
+	}
+
+	rmilter_epoll_run_timers (loop);
+
+	garbage = loop->garbage;
+	loop->garbage = NULL;
+
+	while ((f = garbage) != NULL) {
+		garbage = f->next_garbage;
+
+		if (f->io[RMILTER_EPOLL_READ].queued ||
+				f->io[RMILTER_EPOLL_WRITE].queued) {
+			/* Pending list of the next iteration still refers it */
+			f->next_garbage = loop->garbage;
+			loop->garbage = f;
+		}
+		else {
+			free (f);
+		}
+	}
+
+	return n;
+}
+
+/**
+ * Runs loop until `rmilter_epoll_break` is called
+ */
+static int
+rmilter_epoll_run (struct rmilter_epoll *loop)
+{
+	loop->stop = 0;
+
+	while (!loop->stop) {
+		if (rmilter_epoll_run_once (loop) == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+rmilter_epoll_break (struct rmilter_epoll *loop)
+{
+	loop->stop = 1;
+}
+
+static void *
+rmilter_epoll_add_io (struct rmilter_epoll *loop, int fd,
+		enum rmilter_epoll_ev_kind kind, void *user_data)
+{
+	struct rmilter_epoll_fd *f;
+	struct rmilter_epoll_io *io;
+	struct epoll_event ev;
+	struct rmilter_epoll_fd **fds;
+	unsigned int nfds;
+
+	if ((unsigned int)fd >= loop->nfds) {
+		nfds = RMILTER_EPOLL_MAX (loop->nfds * 2, (unsigned int)fd + 1);
+		nfds = RMILTER_EPOLL_MAX (nfds, 64);
+		fds = realloc (loop->fds, nfds * sizeof (*loop->fds));
+
+		if (fds == NULL) {
+			return NULL;
+		}
+
+		loop->fds = fds;
+		memset (loop->fds + loop->nfds, 0,
+				(nfds - loop->nfds) * sizeof (*loop->fds));
+		loop->nfds = nfds;
+	}
+
+	f = loop->fds[fd];
+
+	if (f == NULL) {
+		f = calloc (1, sizeof (*f));
+
+		if (f == NULL) {
+			return NULL;
+		}
+
+		f->fd = fd;
+		f->io[RMILTER_EPOLL_READ].kind = RMILTER_EPOLL_READ;
+		f->io[RMILTER_EPOLL_READ].f = f;
+		f->io[RMILTER_EPOLL_WRITE].kind = RMILTER_EPOLL_WRITE;
+		f->io[RMILTER_EPOLL_WRITE].f = f;
+
+		memset (&ev, 0, sizeof (ev));
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = f;
+
+		if (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			free (f);
+
+			return NULL;
+		}
+
+		loop->fds[fd] = f;
+	}
+	else if (kind == RMILTER_EPOLL_READ) {
+		/* Readiness might have been reported before reading was wanted */
+		rmilter_epoll_queue (loop, &f->io[kind]);
+	}
+
+	io = &f->io[kind];
+	io->user_data = user_data;
+	io->used = 1;
+	io->active = 1;
+
+	return io;
+}
+
+static void
+rmilter_epoll_del_io (struct rmilter_epoll *loop, struct rmilter_epoll_io *io)
+{
+	struct rmilter_epoll_fd *f;
+
+	if (io == NULL) {
+		return;
+	}
+
+	f = io->f;
+	io->used = 0;
+	io->active = 0;
+
+	if (!f->io[RMILTER_EPOLL_READ].used && !f->io[RMILTER_EPOLL_WRITE].used) {
+		/* Descriptor might be closed and reused right after that */
+		epoll_ctl (loop->epfd, EPOLL_CTL_DEL, f->fd, NULL);
+		loop->fds[f->fd] = NULL;
+		f->dead = 1;
+		f->next_garbage = loop->garbage;
+		loop->garbage = f;
+	}
+}
+
+static void *
+rmilter_epoll_add_read (void *priv_data, int fd, void *user_data)
+{
+	return rmilter_epoll_add_io ((struct rmilter_epoll *) priv_data, fd,
+			RMILTER_EPOLL_READ, user_data);
+}
+
+static void
+rmilter_epoll_del_read (void *priv_data, void *ev_data)
+{
+	rmilter_epoll_del_io ((struct rmilter_epoll *) priv_data,
+			(struct rmilter_epoll_io *) ev_data);
+}
+
+static void *
+rmilter_epoll_add_write (void *priv_data, int fd, void *user_data)
+{
+	return rmilter_epoll_add_io ((struct rmilter_epoll *) priv_data, fd,
+			RMILTER_EPOLL_WRITE, user_data);
+}
+
+static void
+rmilter_epoll_del_write (void *priv_data, void *ev_data)
+{
+	rmilter_epoll_del_io ((struct rmilter_epoll *) priv_data,
+			(struct rmilter_epoll_io *) ev_data);
+}
+
+static void *
+rmilter_epoll_add_periodic (void *priv_data, double after,
+		rmilter_periodic_callback cb, void *user_data)
+{
+	struct rmilter_epoll *loop = (struct rmilter_epoll *) priv_data;
+	struct rmilter_epoll_timer *t;
+
+	t = calloc (1, sizeof (*t));
+
+	if (t == NULL) {
+		return NULL;
+	}
+
+	t->kind = RMILTER_EPOLL_TIMER;
+	t->cb = cb;
+	t->user_data = user_data;
+	t->after = (int64_t)(after * 1e9);
+	t->deadline = rmilter_epoll_now () + t->after;
+	t->active = 1;
+	rmilter_epoll_heap_insert (loop, t);
+
+	return t;
+}
+
+static void *
+rmilter_epoll_add_timer (void *priv_data, double after, void *user_data)
+{
+	return rmilter_epoll_add_periodic (priv_data, after, NULL, user_data);
+}
+
+static void
+rmilter_epoll_del_periodic (void *priv_data, void *ev_data)
+{
+	struct rmilter_epoll *loop = (struct rmilter_epoll *) priv_data;
+	struct rmilter_epoll_timer *t = (struct rmilter_epoll_timer *) ev_data;
+
+	if (t != NULL) {
+		if (t->heap_idx != -1) {
+			rmilter_epoll_heap_remove (loop, t);
+		}
+
+		if (t->hold) {
+			/* Freed when its callback returns */
+			t->deleted = 1;
+		}
+		else {
+			free (t);
+		}
+	}
+}
+
+static void
+rmilter_epoll_del_timer (void *priv_data, void *ev_data)
+{
+	rmilter_epoll_del_periodic (priv_data, ev_data);
+}
+
+static void
+rmilter_epoll_repeat_timer (void *priv_data, void *ev_data)
+{
+	struct rmilter_epoll *loop = (struct rmilter_epoll *) priv_data;
+	struct rmilter_epoll_timer *t = (struct rmilter_epoll_timer *) ev_data;
+
+	if (t != NULL) {
+		t->active = 1;
+		t->deadline = rmilter_epoll_now () + t->after;
+
+		if (t->heap_idx == -1 && !t->hold) {
+			rmilter_epoll_heap_insert (loop, t);
+		}
+	}
+}
+
+static void
+rmilter_epoll_start_event (void *priv_data, void *ev_data)
+{
+	struct rmilter_epoll *loop = (struct rmilter_epoll *) priv_data;
+	struct rmilter_epoll_io *io = (struct rmilter_epoll_io *) ev_data;
+	struct rmilter_epoll_timer *t;
+
+	if (io == NULL) {
+		return;
+	}
+
+	if (io->kind == RMILTER_EPOLL_TIMER) {
+		t = (struct rmilter_epoll_timer *) ev_data;
+
+		if (!t->active) {
+			t->active = 1;
+			t->deadline = rmilter_epoll_now () + t->after;
+
+			if (t->heap_idx == -1 && !t->hold) {
+				rmilter_epoll_heap_insert (loop, t);
+			}
+		}
+	}
+	else if (!io->active && io->used) {
+		io->active = 1;
+		rmilter_epoll_queue (loop, io);
+	}
+}
+
+static void
+rmilter_epoll_stop_event (void *priv_data, void *ev_data)
+{
+	struct rmilter_epoll *loop = (struct rmilter_epoll *) priv_data;
+	struct rmilter_epoll_io *io = (struct rmilter_epoll_io *) ev_data;
+	struct rmilter_epoll_timer *t;
+
+	if (io == NULL) {
+		return;
+	}
+
+	if (io->kind == RMILTER_EPOLL_TIMER) {
+		t = (struct rmilter_epoll_timer *) ev_data;
+		t->active = 0;
+
+		if (t->heap_idx != -1) {
+			rmilter_epoll_heap_remove (loop, t);
+		}
+	}
+	else {
+		io->active = 0;
+	}
+}
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
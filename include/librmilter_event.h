@@ -26,10 +26,10 @@
 #define LIBRDNS_LIBRMILTER_EVENT_H
 
 
-#include <event.h>
+#include <event2/event.h>
+#include <event2/event_struct.h>
 #include <stdlib.h>
 #include <string.h>
-#include <glib.h>
 #include "librmilter.h"
 
 #ifdef  __cplusplus
@@ -54,13 +54,44 @@ static void rmilter_libevent_repeat_timer (void *priv_data, void *ev_data);
 static void rmilter_libevent_del_timer (void *priv_data, void *ev_data);
 static void rmilter_libevent_stop_event (void *priv_data, void *ev_data);
 static void rmilter_libevent_start_event (void *priv_data, void *ev_data);
+static void rmilter_libevent_cleanup (void *priv_data);
 
-struct rmilter_event_periodic_cbdata {
-	struct event *ev;
+/* Number of events allocated at once */
+#define RMILTER_LIBEVENT_SLAB_SIZE 64
+
+struct rmilter_libevent_event {
+	struct event ev;
+	/* Timeout of timers, persistent events are re-added with it */
+	struct timeval tv;
+	bool timer;
+	void *user_data;
 	rmilter_periodic_callback cb;
-	void *cbdata;
+	struct rmilter_libevent_event *next_free;
+};
+
+struct rmilter_libevent_slab {
+	struct rmilter_libevent_slab *next;
+	struct rmilter_libevent_event events[RMILTER_LIBEVENT_SLAB_SIZE];
 };
 
+/*
+ * Events are taken from slabs owned by the context and are never returned
+ * to the heap until cleanup, so sessions cost no allocations for events
+ */
+struct rmilter_libevent_data {
+	struct event_base *base;
+	struct rmilter_libevent_event *free_events;
+	struct rmilter_libevent_slab *slabs;
+};
+
+/**
+ * Creates async context for libevent2 base. Context might be shared by milters
+ * running in the same loop and is not freed by them: once all of them are
+ * destroyed, call `cleanup (ctx->data)` to release the events and then
+ * `free ()` the context itself. Note that `ctx->data` is a private structure
+ * rather than the base, the base is its `base` member. Returns NULL if memory is
+ * exhausted.
+ */
 static struct rmilter_async_context *
 rmilter_gen_libevent (struct rmilter_resolver *resolver,
 		struct event_base *ev_base)
@@ -75,94 +106,151 @@ rmilter_gen_libevent (struct rmilter_resolver *resolver,
 			.del_periodic = rmilter_libevent_del_periodic,
 			.repeat_timer = rmilter_libevent_repeat_timer,
 			.del_timer = rmilter_libevent_del_timer,
-			.cleanup = NULL,
+			.cleanup = rmilter_libevent_cleanup,
 			.stop_event = rmilter_libevent_stop_event,
 			.start_event = rmilter_libevent_start_event
 	};
 	struct rmilter_async_context *nctx;
+	struct rmilter_libevent_data *data;
+
+	nctx = malloc (sizeof (struct rmilter_async_context));
+	data = calloc (1, sizeof (*data));
+
+	if (nctx == NULL || data == NULL) {
+		free (nctx);
+		free (data);
 
-	nctx = g_slice_alloc (sizeof (struct rmilter_async_context));
-	if (nctx != NULL) {
-		memcpy (nctx, &ev_ctx, sizeof (struct rmilter_async_context));
-		nctx->data = ev_base;
+		return NULL;
 	}
 
+	memcpy (nctx, &ev_ctx, sizeof (struct rmilter_async_context));
+	data->base = ev_base;
+	nctx->data = data;
+
 	return nctx;
 }
 
+static struct rmilter_libevent_event *
+rmilter_libevent_event_alloc (struct rmilter_libevent_data *data,
+		void *user_data)
+{
+	struct rmilter_libevent_slab *slab;
+	struct rmilter_libevent_event *ev;
+	unsigned int i;
+
+	if (data->free_events == NULL) {
+		slab = malloc (sizeof (*slab));
+
+		if (slab == NULL) {
+			return NULL;
+		}
+
+		slab->next = data->slabs;
+		data->slabs = slab;
+
+		for (i = 0; i < RMILTER_LIBEVENT_SLAB_SIZE; i ++) {
+			slab->events[i].next_free = data->free_events;
+			data->free_events = &slab->events[i];
+		}
+	}
+
+	ev = data->free_events;
+	data->free_events = ev->next_free;
+	ev->timer = false;
+	ev->user_data = user_data;
+	ev->cb = NULL;
+
+	return ev;
+}
+
 static void
-rmilter_libevent_read_event (int fd, short what, void *ud)
+rmilter_libevent_event_free (struct rmilter_libevent_data *data,
+		struct rmilter_libevent_event *ev)
 {
-	rmilter_process_read (fd, ud);
+	if (ev != NULL) {
+		event_del (&ev->ev);
+		ev->next_free = data->free_events;
+		data->free_events = ev;
+	}
 }
 
 static void
-rmilter_libevent_write_event (int fd, short what, void *ud)
+rmilter_libevent_read_event (evutil_socket_t fd, short what, void *ud)
 {
-	rmilter_process_write (fd, ud);
+	struct rmilter_libevent_event *ev = ud;
+
+	rmilter_process_read (fd, ev->user_data);
 }
 
 static void
-rmilter_libevent_timer_event (int fd, short what, void *ud)
+rmilter_libevent_write_event (evutil_socket_t fd, short what, void *ud)
 {
-	rmilter_process_timer (ud);
+	struct rmilter_libevent_event *ev = ud;
+
+	rmilter_process_write (fd, ev->user_data);
 }
 
 static void
-rmilter_libevent_periodic_event (int fd, short what, void *ud)
+rmilter_libevent_timer_event (evutil_socket_t fd, short what, void *ud)
 {
-	struct rmilter_event_periodic_cbdata *cbdata = ud;
-	cbdata->cb (cbdata->cbdata);
+	struct rmilter_libevent_event *ev = ud;
+
+	if (ev->cb) {
+		ev->cb (ev->user_data);
+	}
+	else {
+		rmilter_process_timer (ev->user_data);
+	}
 }
 
 static void *
 rmilter_libevent_add_read (void *priv_data, int fd, void *user_data)
 {
-	struct event *ev;
-	ev = g_slice_alloc (sizeof (struct event));
-	if (ev != NULL) {
-		event_set (ev,
-				fd,
-				EV_READ | EV_PERSIST,
-				rmilter_libevent_read_event,
-				user_data);
-		event_base_set (priv_data, ev);
-		event_add (ev, NULL);
+	struct rmilter_libevent_data *data = priv_data;
+	struct rmilter_libevent_event *ev;
+
+	ev = rmilter_libevent_event_alloc (data, user_data);
+
+	if (ev == NULL) {
+		return NULL;
 	}
+
+	event_assign (&ev->ev, data->base, fd, EV_READ | EV_PERSIST,
+			rmilter_libevent_read_event, ev);
+	event_add (&ev->ev, NULL);
+
 	return ev;
 }
 
 static void
 rmilter_libevent_del_read (void *priv_data, void *ev_data)
 {
-	struct event *ev = ev_data;
-	if (ev != NULL) {
-		event_del (ev);
-		g_slice_free1 (sizeof (*ev), ev);
-	}
+	rmilter_libevent_event_free (priv_data, ev_data);
 }
+
 static void *
 rmilter_libevent_add_write (void *priv_data, int fd, void *user_data)
 {
-	struct event *ev;
-	ev = g_slice_alloc (sizeof (struct event));
-	if (ev != NULL) {
-		event_set (ev, fd, EV_WRITE | EV_PERSIST,
-				rmilter_libevent_write_event, user_data);
-		event_base_set (priv_data, ev);
-		event_add (ev, NULL);
+	struct rmilter_libevent_data *data = priv_data;
+	struct rmilter_libevent_event *ev;
+
+	ev = rmilter_libevent_event_alloc (data, user_data);
+
+	if (ev == NULL) {
+		return NULL;
 	}
+
+	event_assign (&ev->ev, data->base, fd, EV_WRITE | EV_PERSIST,
+			rmilter_libevent_write_event, ev);
+	event_add (&ev->ev, NULL);
+
 	return ev;
 }
 
 static void
 rmilter_libevent_del_write (void *priv_data, void *ev_data)
 {
-	struct event *ev = ev_data;
-	if (ev != NULL) {
-		event_del (ev);
-		g_slice_free1 (sizeof (*ev), ev);
-	}
+	rmilter_libevent_event_free (priv_data, ev_data);
 }
 
 #define rmilter_event_double_to_tv(dbl, tv) do {                            \
@@ -171,103 +259,96 @@ rmilter_libevent_del_write (void *priv_data, void *ev_data)
 } while(0)
 
 static void *
-rmilter_libevent_add_timer (void *priv_data, double after, void *user_data)
+rmilter_libevent_add_periodic (void *priv_data, double after,
+		rmilter_periodic_callback cb, void *user_data)
 {
-	struct event *ev;
-	struct timeval tv;
-	ev = g_slice_alloc (sizeof (struct event));
-	if (ev != NULL) {
-		rmilter_event_double_to_tv (after, &tv);
-		event_set (ev,
-				-1,
-				EV_TIMEOUT | EV_PERSIST,
-				rmilter_libevent_timer_event,
-				user_data);
-		event_base_set (priv_data, ev);
-		event_add (ev, &tv);
+	struct rmilter_libevent_data *data = priv_data;
+	struct rmilter_libevent_event *ev;
+
+	ev = rmilter_libevent_event_alloc (data, user_data);
+
+	if (ev == NULL) {
+		return NULL;
 	}
+
+	ev->timer = true;
+	ev->cb = cb;
+	rmilter_event_double_to_tv (after, &ev->tv);
+	event_assign (&ev->ev, data->base, -1, EV_PERSIST,
+			rmilter_libevent_timer_event, ev);
+	event_add (&ev->ev, &ev->tv);
+
 	return ev;
 }
 
+#undef rmilter_event_double_to_tv
+
 static void *
-rmilter_libevent_add_periodic (void *priv_data, double after,
-		rmilter_periodic_callback cb, void *user_data)
+rmilter_libevent_add_timer (void *priv_data, double after, void *user_data)
 {
-	struct event *ev;
-	struct timeval tv;
-	struct rmilter_event_periodic_cbdata *cbdata = NULL;
-
-	ev = g_slice_alloc (sizeof (struct event));
-	if (ev != NULL) {
-		cbdata = g_slice_alloc (sizeof (struct rmilter_event_periodic_cbdata));
-		if (cbdata != NULL) {
-			rmilter_event_double_to_tv (after, &tv);
-			cbdata->cb = cb;
-			cbdata->cbdata = user_data;
-			cbdata->ev = ev;
-			event_set (ev,
-					-1,
-					EV_TIMEOUT | EV_PERSIST,
-					rmilter_libevent_periodic_event,
-					cbdata);
-			event_base_set (priv_data, ev);
-			event_add (ev, &tv);
-		}
-		else {
-			g_slice_free1 (sizeof (*ev), ev);
-			return NULL;
-		}
-	}
-	return cbdata;
+	return rmilter_libevent_add_periodic (priv_data, after, NULL, user_data);
 }
 
 static void
 rmilter_libevent_del_periodic (void *priv_data, void *ev_data)
 {
-	struct rmilter_event_periodic_cbdata *cbdata = ev_data;
-	if (cbdata != NULL) {
-		event_del (cbdata->ev);
-		g_slice_free1 (sizeof (*cbdata->ev), (void *) cbdata->ev);
-		g_slice_free1 (sizeof (*cbdata), (void *) cbdata);
-	}
+	rmilter_libevent_event_free (priv_data, ev_data);
 }
 
 static void
 rmilter_libevent_repeat_timer (void *priv_data, void *ev_data)
 {
-	/* XXX: libevent hides timeval, so timeouts are persistent here */
-}
+	struct rmilter_libevent_event *ev = ev_data;
 
-#undef rmilter_event_double_to_tv
+	if (ev != NULL) {
+		/* Adding pending event again reschedules its timeout */
+		event_add (&ev->ev, &ev->tv);
+	}
+}
 
 static void
 rmilter_libevent_del_timer (void *priv_data, void *ev_data)
 {
-	struct event *ev = ev_data;
-	if (ev != NULL) {
-		event_del (ev);
-		g_slice_free1 (sizeof (*ev), ev);
-	}
+	rmilter_libevent_event_free (priv_data, ev_data);
 }
 
 static void
 rmilter_libevent_stop_event (void *priv_data, void *ev_data)
 {
-	struct event *ev = ev_data;
+	struct rmilter_libevent_event *ev = ev_data;
+
 	if (ev != NULL) {
-		event_del (ev);
+		event_del (&ev->ev);
 	}
 }
 
 static void
 rmilter_libevent_start_event (void *priv_data, void *ev_data)
 {
-	struct event *ev = ev_data;
+	struct rmilter_libevent_event *ev = ev_data;
+
 	if (ev != NULL) {
-		event_add (ev, NULL);
+		event_add (&ev->ev, ev->timer ? &ev->tv : NULL);
 	}
 }
 
+/*
+ * Frees events, all of them must be deleted before
+ */
+static void
+rmilter_libevent_cleanup (void *priv_data)
+{
+	struct rmilter_libevent_data *data = priv_data;
+	struct rmilter_libevent_slab *slab;
+
+	while ((slab = data->slabs) != NULL) {
+		data->slabs = slab->next;
+		free (slab);
+	}
+
+	free (data);
+}
+
 #ifdef  __cplusplus
 }
 #endif
@@ -0,0 +1,862 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBRMILTER_URING_H
+#define LIBRMILTER_URING_H
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "librmilter.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Event loop on io_uring without liburing. Polls, timers and their
+ * cancellations are queued to the submission ring and submitted together with
+ * waiting for completions in one `io_uring_enter` call per loop iteration.
+ *
+ * This is a plain port of the readiness based async context: sockets are
+ * still read and written by the library, so the backend uses one shot polls
+ * instead of multishot receive with provided buffer rings, and timers are
+ * standalone rather than linked timeouts. It is not expected to be faster
+ * than the epoll backend, which is as fast on the bundled benchmark.
+ *
+ * Polls are one shot, so they have the same level triggered semantic as the
+ * other backends: the library might leave unread data in the socket. They are
+ * re-armed after dispatching, which costs no syscalls as well.
+ *
+ * Timers are armed with absolute monotonic deadlines. `repeat_timer` only
+ * moves the deadline of the event, the kernel timeout is re-armed for the new
+ * deadline when it expires. Requires Linux 5.5 or later.
+ *
+ * When the submission ring is full and the kernel refuses to take requests
+ * because completions are not reaped (EBUSY), completions are moved to a
+ * backlog that is dispatched by the next loop iteration. Events that still
+ * cannot be re-armed or cancelled are retried by the next iteration as well,
+ * whilst `add_*` functions return NULL then.
+ */
+
+#define RMILTER_URING_MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define RMILTER_URING_MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+enum rmilter_uring_ev_kind {
+	RMILTER_URING_READ = 0,
+	RMILTER_URING_WRITE,
+	RMILTER_URING_TIMER,
+	RMILTER_URING_PERIODIC
+};
+
+struct rmilter_uring_ev {
+	enum rmilter_uring_ev_kind kind;
+	int fd;
+	void *user_data;
+	rmilter_periodic_callback cb;
+	double after;
+	/* Monotonic deadline of timers in nanoseconds */
+	int64_t deadline;
+	/* Deadline of the armed timeout, read by the kernel on submission */
+	struct __kernel_timespec ts;
+	/* Event is wanted by the library */
+	int active;
+	/* Request for event is in the kernel */
+	int armed;
+	/* Event has been deleted, it is freed when the request is completed */
+	int deleted;
+	/* Event is being dispatched */
+	int hold;
+	/* Event is in the retry list: arming or cancellation has failed */
+	int retry;
+	struct rmilter_uring_ev *retry_next;
+};
+
+struct rmilter_uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+	/* Queued and not yet submitted requests */
+	unsigned to_submit;
+	/* Events allocated, including deleted ones with requests in flight */
+	unsigned nevents;
+	/* Completions reaped while the ring was busy, not dispatched yet */
+	struct io_uring_cqe *backlog;
+	unsigned nbacklog;
+	unsigned backlog_size;
+	struct rmilter_uring_ev *retry;
+	int stop;
+};
+
+static void *rmilter_uring_add_read (void *priv_data, int fd, void *user_data);
+static void rmilter_uring_del_read (void *priv_data, void *ev_data);
+static void *rmilter_uring_add_write (void *priv_data, int fd, void *user_data);
+static void rmilter_uring_del_write (void *priv_data, void *ev_data);
+static void *rmilter_uring_add_timer (void *priv_data,
+		double after,
+		void *user_data);
+static void *rmilter_uring_add_periodic (void *priv_data, double after,
+		rmilter_periodic_callback cb, void *user_data);
+static void rmilter_uring_del_periodic (void *priv_data, void *ev_data);
+static void rmilter_uring_repeat_timer (void *priv_data, void *ev_data);
+static void rmilter_uring_del_timer (void *priv_data, void *ev_data);
+static void rmilter_uring_stop_event (void *priv_data, void *ev_data);
+static void rmilter_uring_start_event (void *priv_data, void *ev_data);
+
+static struct rmilter_async_context *
+rmilter_gen_uring (struct rmilter_uring *u)
+{
+	static const struct rmilter_async_context uring_ctx = {
+			.data = NULL,
+			.add_read = rmilter_uring_add_read,
+			.del_read = rmilter_uring_del_read,
+			.add_write = rmilter_uring_add_write,
+			.del_write = rmilter_uring_del_write,
+			.add_timer = rmilter_uring_add_timer,
+			.repeat_timer = rmilter_uring_repeat_timer,
+			.del_timer = rmilter_uring_del_timer,
+			.add_periodic = rmilter_uring_add_periodic,
+			.del_periodic = rmilter_uring_del_periodic,
+			.cleanup = NULL,
+			.stop_event = rmilter_uring_stop_event,
+			.start_event = rmilter_uring_start_event
+	};
+	struct rmilter_async_context *nctx;
+
+	nctx = malloc (sizeof (struct rmilter_async_context));
+
+	if (nctx == NULL) {
+		return NULL;
+	}
+
+	memcpy (nctx, &uring_ctx, sizeof (struct rmilter_async_context));
+	nctx->data = (void *) u;
+
+	return nctx;
+}
+
+static int64_t
+rmilter_uring_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * INT64_C (1000000000) + ts.tv_nsec;
+}
+
+static int
+rmilter_uring_enter (struct rmilter_uring *u, unsigned to_submit,
+		unsigned min_complete, unsigned flags)
+{
+	return (int)syscall (__NR_io_uring_enter, u->fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+/**
+ * Creates io_uring event loop
+ * @param entries size of the submission ring
+ * @return new loop or NULL, errno is set in this case
+ */
+static struct rmilter_uring *
+rmilter_uring_new (unsigned entries)
+{
+	struct rmilter_uring *u;
+	struct io_uring_params p;
+	void *sq_ring, *cq_ring, *sqes;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+	int fd, saved_errno;
+
+	memset (&p, 0, sizeof (p));
+	fd = (int)syscall (__NR_io_uring_setup, entries, &p);
+
+	if (fd == -1) {
+		return NULL;
+	}
+
+	u = calloc (1, sizeof (*u));
+
+	if (u == NULL) {
+		errno = ENOMEM;
+		goto err;
+	}
+
+	sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	sqes_sz = p.sq_entries * sizeof (struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		sq_ring_sz = RMILTER_URING_MAX (sq_ring_sz, cq_ring_sz);
+		cq_ring_sz = sq_ring_sz;
+	}
+
+	sq_ring = mmap (NULL, sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+	if (sq_ring == MAP_FAILED) {
+		goto err;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ring = sq_ring;
+	}
+	else {
+		cq_ring = mmap (NULL, cq_ring_sz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+
+		if (cq_ring == MAP_FAILED) {
+			munmap (sq_ring, sq_ring_sz);
+			goto err;
+		}
+	}
+
+	sqes = mmap (NULL, sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+	if (sqes == MAP_FAILED) {
+		if (cq_ring != sq_ring) {
+			munmap (cq_ring, cq_ring_sz);
+		}
+
+		munmap (sq_ring, sq_ring_sz);
+		goto err;
+	}
+
+	u->fd = fd;
+	u->sq_ring = sq_ring;
+	u->sq_ring_sz = sq_ring_sz;
+	u->cq_ring = cq_ring;
+	u->cq_ring_sz = cq_ring_sz;
+	u->sqes = sqes;
+	u->sqes_sz = sqes_sz;
+	u->sq_entries = p.sq_entries;
+	u->sq_head = (unsigned *)((char *)sq_ring + p.sq_off.head);
+	u->sq_tail = (unsigned *)((char *)sq_ring + p.sq_off.tail);
+	u->sq_mask = (unsigned *)((char *)sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)((char *)sq_ring + p.sq_off.array);
+	u->cq_head = (unsigned *)((char *)cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned *)((char *)cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)cq_ring + p.cq_off.cqes);
+
+	return u;
+
+err:
+	saved_errno = errno;
+	free (u);
+	close (fd);
+	errno = saved_errno;
+
+	return NULL;
+}
+
+/**
+ * Destroys loop. All events must be deleted and the loop must be run until
+ * `nevents` drops to zero, so that cancelled requests are completed.
+ */
+static void
+rmilter_uring_free (struct rmilter_uring *u)
+{
+	munmap (u->sqes, u->sqes_sz);
+
+	if (u->cq_ring != u->sq_ring) {
+		munmap (u->cq_ring, u->cq_ring_sz);
+	}
+
+	munmap (u->sq_ring, u->sq_ring_sz);
+	close (u->fd);
+	free (u->backlog);
+	free (u);
+}
+
+static int
+rmilter_uring_submit (struct rmilter_uring *u, unsigned min_complete)
+{
+	int r;
+
+	for (;;) {
+		r = rmilter_uring_enter (u, u->to_submit, min_complete,
+				min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+
+		if (r >= 0) {
+			u->to_submit -= RMILTER_URING_MIN ((unsigned)r, u->to_submit);
+
+			return r;
+		}
+
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+/*
+ * Moves completions to the backlog without dispatching them, so the kernel
+ * could post more
+ * @return number of completions moved
+ */
+static unsigned
+rmilter_uring_reap (struct rmilter_uring *u)
+{
+	struct io_uring_cqe *backlog;
+	unsigned head, tail, n = 0;
+
+	head = *u->cq_head;
+	tail = __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head ++, n ++) {
+		if (u->nbacklog == u->backlog_size) {
+			backlog = realloc (u->backlog,
+					RMILTER_URING_MAX (u->backlog_size * 2, 64) *
+					sizeof (*u->backlog));
+
+			if (backlog == NULL) {
+				/* The rest stays in the completion ring */
+				break;
+			}
+
+			u->backlog = backlog;
+			u->backlog_size = RMILTER_URING_MAX (u->backlog_size * 2, 64);
+		}
+
+		u->backlog[u->nbacklog ++] = u->cqes[head & *u->cq_mask];
+	}
+
+	__atomic_store_n (u->cq_head, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+/*
+ * Returns free submission entry or NULL if the ring is full and requests
+ * cannot be submitted
+ */
+static struct io_uring_sqe *
+rmilter_uring_get_sqe (struct rmilter_uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *u->sq_tail, idx;
+	int reaped = 0;
+
+	while (tail - __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE) >=
+			u->sq_entries) {
+		/* Ring is full, so submit requests queued so far */
+		if (rmilter_uring_submit (u, 0) != -1) {
+			continue;
+		}
+
+		if (errno != EBUSY || reaped) {
+			return NULL;
+		}
+
+		/* Completion ring is full: reap it and flush overflowed entries */
+		rmilter_uring_reap (u);
+		(void)rmilter_uring_enter (u, 0, 0, IORING_ENTER_GETEVENTS);
+		rmilter_uring_reap (u);
+		reaped = 1;
+	}
+
+	idx = tail & *u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset (sqe, 0, sizeof (*sqe));
+	u->sq_array[idx] = idx;
+
+	return sqe;
+}
+
+static void
+rmilter_uring_queue_sqe (struct rmilter_uring *u)
+{
+	__atomic_store_n (u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+	u->to_submit ++;
+}
+
+static int
+rmilter_uring_arm (struct rmilter_uring *u, struct rmilter_uring_ev *ev)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = rmilter_uring_get_sqe (u);
+
+	if (sqe == NULL) {
+		return -1;
+	}
+
+	switch (ev->kind) {
+	case RMILTER_URING_READ:
+	case RMILTER_URING_WRITE:
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = ev->fd;
+		sqe->poll32_events = ev->kind == RMILTER_URING_READ ? POLLIN : POLLOUT;
+		break;
+	case RMILTER_URING_TIMER:
+	case RMILTER_URING_PERIODIC:
+		ev->ts.tv_sec = ev->deadline / 1000000000;
+		ev->ts.tv_nsec = ev->deadline % 1000000000;
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (__u64)(uintptr_t)&ev->ts;
+		sqe->len = 1;
+		sqe->timeout_flags = IORING_TIMEOUT_ABS;
+		break;
+	}
+
+	sqe->user_data = (__u64)(uintptr_t)ev;
+	rmilter_uring_queue_sqe (u);
+	ev->armed = 1;
+
+	return 0;
+}
+
+/*
+ * Event is armed or cancelled by the next loop iteration
+ */
+static void
+rmilter_uring_retry_later (struct rmilter_uring *u, struct rmilter_uring_ev *ev)
+{
+	if (!ev->retry) {
+		ev->retry = 1;
+		ev->retry_next = u->retry;
+		u->retry = ev;
+	}
+}
+
+static void
+rmilter_uring_rearm (struct rmilter_uring *u, struct rmilter_uring_ev *ev)
+{
+	if (rmilter_uring_arm (u, ev) == -1) {
+		rmilter_uring_retry_later (u, ev);
+	}
+}
+
+static void
+rmilter_uring_cancel (struct rmilter_uring *u, struct rmilter_uring_ev *ev)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = rmilter_uring_get_sqe (u);
+
+	if (sqe == NULL) {
+		/* Request in flight must not outlive the deleted event */
+		rmilter_uring_retry_later (u, ev);
+
+		return;
+	}
+
+	sqe->opcode = (ev->kind == RMILTER_URING_READ ||
+			ev->kind == RMILTER_URING_WRITE) ?
+			IORING_OP_POLL_REMOVE : IORING_OP_TIMEOUT_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = (__u64)(uintptr_t)ev;
+	/* Result of cancellation itself is not interesting */
+	sqe->user_data = 0;
+	rmilter_uring_queue_sqe (u);
+}
+
+static void
+rmilter_uring_maybe_free (struct rmilter_uring *u, struct rmilter_uring_ev *ev)
+{
+	if (ev->deleted && !ev->armed && !ev->hold && !ev->retry) {
+		free (ev);
+		u->nevents --;
+	}
+}
+
+static struct rmilter_uring_ev *
+rmilter_uring_ev_new (struct rmilter_uring *u, enum rmilter_uring_ev_kind kind,
+		int fd, double after, rmilter_periodic_callback cb, void *user_data)
+{
+	struct rmilter_uring_ev *ev;
+
+	ev = calloc (1, sizeof (*ev));
+
+	if (ev == NULL) {
+		return NULL;
+	}
+
+	ev->kind = kind;
+	ev->fd = fd;
+	ev->after = after;
+	ev->cb = cb;
+	ev->user_data = user_data;
+	ev->active = 1;
+	u->nevents ++;
+
+	if (kind == RMILTER_URING_TIMER || kind == RMILTER_URING_PERIODIC) {
+		ev->deadline = rmilter_uring_now () + (int64_t)(after * 1e9);
+	}
+
+	if (rmilter_uring_arm (u, ev) == -1) {
+		free (ev);
+		u->nevents --;
+
+		return NULL;
+	}
+
+	return ev;
+}
+
+static void
+rmilter_uring_ev_del (struct rmilter_uring *u, struct rmilter_uring_ev *ev)
+{
+	if (ev == NULL) {
+		return;
+	}
+
+	ev->active = 0;
+	ev->deleted = 1;
+
+	if (ev->armed) {
+		rmilter_uring_cancel (u, ev);
+	}
+
+	rmilter_uring_maybe_free (u, ev);
+}
+
+static void
+rmilter_uring_dispatch (struct rmilter_uring *u, struct rmilter_uring_ev *ev)
+{
+	int64_t now;
+
+	/* Event might be deleted by its own callback */
+	ev->hold = 1;
+
+	switch (ev->kind) {
+	case RMILTER_URING_READ:
+		rmilter_process_read (ev->fd, ev->user_data);
+		break;
+	case RMILTER_URING_WRITE:
+		rmilter_process_write (ev->fd, ev->user_data);
+		break;
+	case RMILTER_URING_TIMER:
+		rmilter_process_timer (ev->user_data);
+		break;
+	case RMILTER_URING_PERIODIC:
+		ev->cb (ev->user_data);
+		break;
+	}
+
+	ev->hold = 0;
+
+	if (ev->active && !ev->armed) {
+		if (ev->kind == RMILTER_URING_TIMER ||
+				ev->kind == RMILTER_URING_PERIODIC) {
+			now = rmilter_uring_now ();
+			/* Timers repeat like libev ones do */
+			ev->deadline = RMILTER_URING_MAX (ev->deadline, now) + (int64_t)(ev->after * 1e9);
+		}
+
+		rmilter_uring_rearm (u, ev);
+	}
+
+	rmilter_uring_maybe_free (u, ev);
+}
+
+static void
+rmilter_uring_complete (struct rmilter_uring *u, struct io_uring_cqe *cqe)
+{
+	struct rmilter_uring_ev *ev;
+
+	ev = (struct rmilter_uring_ev *)(uintptr_t)cqe->user_data;
+
+	if (ev == NULL) {
+		return;
+	}
+
+	ev->armed = 0;
+
+	if (ev->deleted) {
+		rmilter_uring_maybe_free (u, ev);
+
+		return;
+	}
+
+	if (!ev->active) {
+		/* Stopped event, it is re-armed when started */
+		return;
+	}
+
+	switch (ev->kind) {
+	case RMILTER_URING_READ:
+	case RMILTER_URING_WRITE:
+		if (cqe->res == -ECANCELED) {
+			/* Stopped and started again while cancellation was in flight */
+			rmilter_uring_rearm (u, ev);
+		}
+		else {
+			rmilter_uring_dispatch (u, ev);
+		}
+		break;
+	case RMILTER_URING_TIMER:
+	case RMILTER_URING_PERIODIC:
+		if (rmilter_uring_now () < ev->deadline) {
+			/* Deadline has been moved since the timeout was armed */
+			rmilter_uring_rearm (u, ev);
+		}
+		else {
+			rmilter_uring_dispatch (u, ev);
+		}
+		break;
+	}
+}
+
+/*
+ * Arms and cancels events that could not be queued before
+ */
+static void
+rmilter_uring_process_retry (struct rmilter_uring *u)
+{
+	struct rmilter_uring_ev *ev, *next;
+
+	ev = u->retry;
+	u->retry = NULL;
+
+	for (; ev != NULL; ev = next) {
+		next = ev->retry_next;
+		ev->retry = 0;
+
+		if (ev->armed && (ev->deleted || (!ev->active &&
+				(ev->kind == RMILTER_URING_READ ||
+				ev->kind == RMILTER_URING_WRITE)))) {
+			rmilter_uring_cancel (u, ev);
+		}
+		else if (ev->active && !ev->armed && !ev->hold) {
+			rmilter_uring_rearm (u, ev);
+		}
+
+		rmilter_uring_maybe_free (u, ev);
+	}
+}
+
+/**
+ * Submits queued requests, waits for at least one event and dispatches all
+ * events ready
+ * @return number of events processed or -1 on error
+ */
+static int
+rmilter_uring_run_once (struct rmilter_uring *u)
+{
+	struct io_uring_cqe saved;
+	unsigned head, tail, i;
+	int n = 0;
+
+	rmilter_uring_process_retry (u);
+
+	/* Backlog might grow while it is dispatched */
+	for (i = 0; i < u->nbacklog; i ++) {
+		saved = u->backlog[i];
+		rmilter_uring_complete (u, &saved);
+		n ++;
+	}
+
+	u->nbacklog = 0;
+
+	head = *u->cq_head;
+	tail = __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail && rmilter_uring_submit (u, n > 0 ? 0 : 1) == -1) {
+		if (errno != EBUSY) {
+			return n > 0 ? n : -1;
+		}
+
+		/* Completions have overflowed, flush them to the ring */
+		(void)rmilter_uring_enter (u, 0, 0, IORING_ENTER_GETEVENTS);
+	}
+
+	for (;;) {
+		/* Callbacks might reap completions to the backlog, moving the head */
+		head = *u->cq_head;
+		tail = __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head == tail) {
+			break;
+		}
+
+		saved = u->cqes[head & *u->cq_mask];
+		__atomic_store_n (u->cq_head, head + 1, __ATOMIC_RELEASE);
+		rmilter_uring_complete (u, &saved);
+		n ++;
+	}
+
+	return n;
+}
+
+/**
+ * Runs loop until `rmilter_uring_break` is called
+ */
+static int
+rmilter_uring_run (struct rmilter_uring *u)
+{
+	u->stop = 0;
+
+	while (!u->stop) {
+		if (rmilter_uring_run_once (u) == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+rmilter_uring_break (struct rmilter_uring *u)
+{
+	u->stop = 1;
+}
+
+static void *
+rmilter_uring_add_read (void *priv_data, int fd, void *user_data)
+{
+	return rmilter_uring_ev_new ((struct rmilter_uring *) priv_data,
+			RMILTER_URING_READ, fd, 0, NULL, user_data);
+}
+
+static void
+rmilter_uring_del_read (void *priv_data, void *ev_data)
+{
+	rmilter_uring_ev_del ((struct rmilter_uring *) priv_data,
+			(struct rmilter_uring_ev *) ev_data);
+}
+
+static void *
+rmilter_uring_add_write (void *priv_data, int fd, void *user_data)
+{
+	return rmilter_uring_ev_new ((struct rmilter_uring *) priv_data,
+			RMILTER_URING_WRITE, fd, 0, NULL, user_data);
+}
+
+static void
+rmilter_uring_del_write (void *priv_data, void *ev_data)
+{
+	rmilter_uring_ev_del ((struct rmilter_uring *) priv_data,
+			(struct rmilter_uring_ev *) ev_data);
+}
+
+static void *
+rmilter_uring_add_timer (void *priv_data, double after, void *user_data)
+{
+	return rmilter_uring_ev_new ((struct rmilter_uring *) priv_data,
+			RMILTER_URING_TIMER, -1, after, NULL, user_data);
+}
+
+static void *
+rmilter_uring_add_periodic (void *priv_data, double after,
+		rmilter_periodic_callback cb, void *user_data)
+{
+	return rmilter_uring_ev_new ((struct rmilter_uring *) priv_data,
+			RMILTER_URING_PERIODIC, -1, after, cb, user_data);
+}
+
+static void
+rmilter_uring_del_periodic (void *priv_data, void *ev_data)
+{
+	rmilter_uring_ev_del ((struct rmilter_uring *) priv_data,
+			(struct rmilter_uring_ev *) ev_data);
+}
+
+static void
+rmilter_uring_repeat_timer (void *priv_data, void *ev_data)
+{
+	struct rmilter_uring *u = (struct rmilter_uring *) priv_data;
+	struct rmilter_uring_ev *ev = (struct rmilter_uring_ev *) ev_data;
+
+	if (ev != NULL) {
+		ev->active = 1;
+		ev->deadline = rmilter_uring_now () + (int64_t)(ev->after * 1e9);
+
+		if (!ev->armed && !ev->hold) {
+			rmilter_uring_rearm (u, ev);
+		}
+	}
+}
+
+static void
+rmilter_uring_del_timer (void *priv_data, void *ev_data)
+{
+	rmilter_uring_ev_del ((struct rmilter_uring *) priv_data,
+			(struct rmilter_uring_ev *) ev_data);
+}
+
+static void
+rmilter_uring_start_event (void *priv_data, void *ev_data)
+{
+	struct rmilter_uring *u = (struct rmilter_uring *) priv_data;
+	struct rmilter_uring_ev *ev = (struct rmilter_uring_ev *) ev_data;
+
+	if (ev != NULL && !ev->active) {
+		ev->active = 1;
+
+		if (ev->kind == RMILTER_URING_TIMER ||
+				ev->kind == RMILTER_URING_PERIODIC) {
+			ev->deadline = rmilter_uring_now () + (int64_t)(ev->after * 1e9);
+		}
+
+		/* Event being dispatched is re-armed when its callback returns */
+		if (!ev->armed && !ev->hold) {
+			rmilter_uring_rearm (u, ev);
+		}
+	}
+}
+
+static void
+rmilter_uring_stop_event (void *priv_data, void *ev_data)
+{
+	struct rmilter_uring *u = (struct rmilter_uring *) priv_data;
+	struct rmilter_uring_ev *ev = (struct rmilter_uring_ev *) ev_data;
+
+	if (ev != NULL && ev->active) {
+		ev->active = 0;
+
+		/* Expired timeout of a stopped timer is just ignored */
+		if (ev->armed && (ev->kind == RMILTER_URING_READ ||
+				ev->kind == RMILTER_URING_WRITE)) {
+			rmilter_uring_cancel (u, ev);
+		}
+	}
+}
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
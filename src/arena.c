@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "arena.h"
+
+void
+rmilter_arena_init (struct rmilter_arena *a, gsize chunk_size)
+{
+	a->chunks = NULL;
+	a->pos = a->end = NULL;
+	a->chunk_size = chunk_size;
+}
+
+gpointer
+rmilter_arena_alloc_chunk (struct rmilter_arena *a, gsize size)
+{
+	struct rmilter_arena_chunk *c;
+	gsize csize = MAX (a->chunk_size, size);
+
+	c = g_malloc (sizeof (*c) + csize);
+	c->size = csize;
+	c->next = a->chunks;
+	a->chunks = c;
+	a->pos = c->data + size;
+	a->end = c->data + csize;
+
+	return c->data;
+}
+
+void
+rmilter_arena_reset (struct rmilter_arena *a)
+{
+	struct rmilter_arena_chunk *c, *next;
+
+	if (a->chunks == NULL) {
+		return;
+	}
+
+	/* Usually there is a single chunk, so reset just moves the pointer */
+	for (c = a->chunks->next; c != NULL; c = next) {
+		next = c->next;
+		g_free (c);
+	}
+
+	c = a->chunks;
+	c->next = NULL;
+	a->pos = c->data;
+	a->end = c->data + c->size;
+}
+
+void
+rmilter_arena_destroy (struct rmilter_arena *a)
+{
+	struct rmilter_arena_chunk *c, *next;
+
+	for (c = a->chunks; c != NULL; c = next) {
+		next = c->next;
+		g_free (c);
+	}
+
+	rmilter_arena_init (a, a->chunk_size);
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBRMILTER_ARENA_H
+#define LIBRMILTER_ARENA_H
+
+#include <string.h>
+#include "librmilter_compat.h"
+
+#define RMILTER_ARENA_ALIGN 8
+
+struct rmilter_arena_chunk {
+	struct rmilter_arena_chunk *next;
+	gsize size;
+	guchar data[];
+};
+
+/*
+ * Bump pointer allocator: objects are never freed one by one, the whole
+ * arena is reset when their common lifetime is over
+ */
+struct rmilter_arena {
+	/* The current chunk is the first one */
+	struct rmilter_arena_chunk *chunks;
+	guchar *pos;
+	guchar *end;
+	gsize chunk_size;
+};
+
+/**
+ * Initializes arena, memory is not allocated until it is needed
+ * @param a arena
+ * @param chunk_size size of chunks allocated from the heap
+ */
+void rmilter_arena_init (struct rmilter_arena *a, gsize chunk_size);
+
+/**
+ * Releases all memory of arena
+ */
+void rmilter_arena_destroy (struct rmilter_arena *a);
+
+/**
+ * Forgets all objects allocated, the current chunk is kept for reuse
+ */
+void rmilter_arena_reset (struct rmilter_arena *a);
+
+/* Slow path of allocation, adds a new chunk */
+gpointer rmilter_arena_alloc_chunk (struct rmilter_arena *a, gsize size);
+
+/**
+ * Allocates memory aligned to `RMILTER_ARENA_ALIGN` bytes
+ */
+static inline gpointer
+rmilter_arena_alloc (struct rmilter_arena *a, gsize size)
+{
+	guchar *p = a->pos;
+
+	size = (size + RMILTER_ARENA_ALIGN - 1) & ~(gsize)(RMILTER_ARENA_ALIGN - 1);
+
+	if ((gsize)(a->end - p) < size) {
+		return rmilter_arena_alloc_chunk (a, size);
+	}
+
+	a->pos = p + size;
+
+	return p;
+}
+
+/**
+ * Copies `len` bytes to the arena and terminates them with NUL
+ */
+static inline gchar *
+rmilter_arena_strndup (struct rmilter_arena *a, const gchar *str, gsize len)
+{
+	gchar *p = rmilter_arena_alloc (a, len + 1);
+
+	memcpy (p, str, len);
+	p[len] = '\0';
+
+	return p;
+}
+
+#endif
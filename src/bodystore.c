@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bodystore.h"
+#include "utlist.h"
+
+void
+rmilter_body_store_init (struct rmilter_body_store *bs, gsize spill_threshold)
+{
+	memset (bs, 0, sizeof (*bs));
+	bs->spill_threshold = spill_threshold;
+	bs->fd = -1;
+}
+
+static gint
+rmilter_body_store_open_file (void)
+{
+	gchar tmpl[] = "/tmp/rmilter-body-XXXXXX";
+	gint fd;
+
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create ("rmilter-body", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+	if (fd != -1) {
+		return fd;
+	}
+#endif
+
+	fd = mkstemp (tmpl);
+
+	if (fd != -1) {
+		unlink (tmpl);
+	}
+
+	return fd;
+}
+
+static gboolean
+rmilter_body_store_write (gint fd, const guchar *data, gsize len)
+{
+	gssize r;
+
+	while (len > 0) {
+		r = write (fd, data, len);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return FALSE;
+		}
+
+		data += r;
+		len -= r;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Moves all in-memory blocks to the file, blocks are freed only when all of
+ * them are written, so the store is left in memory if spilling fails
+ */
+static gboolean
+rmilter_body_store_spill (struct rmilter_body_store *bs)
+{
+	struct rmilter_body_block *blk, *tmp;
+	gint fd;
+
+	if (bs->fd != -1) {
+		return TRUE;
+	}
+
+	fd = rmilter_body_store_open_file ();
+
+	if (fd == -1) {
+		return FALSE;
+	}
+
+	LL_FOREACH (bs->head, blk) {
+		if (!rmilter_body_store_write (fd, blk->data, blk->len)) {
+			close (fd);
+
+			return FALSE;
+		}
+	}
+
+	LL_FOREACH_SAFE (bs->head, blk, tmp) {
+		g_free (blk);
+	}
+
+	bs->head = bs->tail = NULL;
+	bs->fd = fd;
+
+	return TRUE;
+}
+
+gboolean
+rmilter_body_store_append (struct rmilter_body_store *bs,
+		const guchar *data, gsize len)
+{
+	struct rmilter_body_block *blk;
+	gsize to_copy;
+
+	if (bs->sealed) {
+		return FALSE;
+	}
+
+	if (bs->fd == -1 && bs->spill_threshold > 0 &&
+			bs->len + len > bs->spill_threshold) {
+		if (!rmilter_body_store_spill (bs)) {
+			return FALSE;
+		}
+	}
+
+	if (bs->fd != -1) {
+		if (!rmilter_body_store_write (bs->fd, data, len)) {
+			/* Drop the partial write, so the file still matches `len` */
+			if (ftruncate (bs->fd, bs->len) == 0) {
+				(void)lseek (bs->fd, bs->len, SEEK_SET);
+			}
+
+			return FALSE;
+		}
+
+		bs->len += len;
+
+		return TRUE;
+	}
+
+	while (len > 0) {
+		blk = bs->tail;
+
+		if (blk == NULL || blk->len == sizeof (blk->data)) {
+			blk = g_malloc (sizeof (*blk));
+			blk->len = 0;
+			blk->next = NULL;
+
+			if (bs->tail) {
+				bs->tail->next = blk;
+			}
+			else {
+				bs->head = blk;
+			}
+
+			bs->tail = blk;
+		}
+
+		to_copy = MIN (len, sizeof (blk->data) - blk->len);
+		memcpy (blk->data + blk->len, data, to_copy);
+		blk->len += to_copy;
+		bs->len += to_copy;
+		data += to_copy;
+		len -= to_copy;
+	}
+
+	return TRUE;
+}
+
+const guchar *
+rmilter_body_store_map (struct rmilter_body_store *bs)
+{
+	if (bs->len == 0) {
+		return NULL;
+	}
+
+	if (bs->fd == -1 && bs->head == bs->tail) {
+		/* Body fits in a single block */
+		return bs->head->data;
+	}
+
+	if (bs->map != NULL && bs->map_len == bs->len) {
+		return bs->map;
+	}
+
+	if (!rmilter_body_store_spill (bs)) {
+		return NULL;
+	}
+
+	if (bs->map != NULL) {
+		munmap (bs->map, bs->map_len);
+	}
+
+	/*
+	 * Shared mappings, even read only ones, prevent write sealing in
+	 * rmilter_body_store_fd, private one is never written so it still
+	 * reads the file pages
+	 */
+	bs->map = mmap (NULL, bs->len, PROT_READ, MAP_PRIVATE, bs->fd, 0);
+
+	if (bs->map == MAP_FAILED) {
+		bs->map = NULL;
+
+		return NULL;
+	}
+
+	bs->map_len = bs->len;
+
+	return bs->map;
+}
+
+gint
+rmilter_body_store_fd (struct rmilter_body_store *bs)
+{
+	if (!rmilter_body_store_spill (bs)) {
+		return -1;
+	}
+
+	if (!bs->sealed) {
+#ifdef F_ADD_SEALS
+		/* Receiver must not be able to change the body under us */
+		(void)fcntl (bs->fd, F_ADD_SEALS,
+				F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+		lseek (bs->fd, 0, SEEK_SET);
+		bs->sealed = TRUE;
+	}
+
+	return bs->fd;
+}
+
+void
+rmilter_body_store_reset (struct rmilter_body_store *bs)
+{
+	struct rmilter_body_block *blk, *tmp;
+
+	LL_FOREACH_SAFE (bs->head, blk, tmp) {
+		g_free (blk);
+	}
+
+	if (bs->map != NULL) {
+		munmap (bs->map, bs->map_len);
+	}
+
+	if (bs->fd != -1) {
+		close (bs->fd);
+	}
+
+	rmilter_body_store_init (bs, bs->spill_threshold);
+}
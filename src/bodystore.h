@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBRMILTER_BODYSTORE_H
+#define LIBRMILTER_BODYSTORE_H
+
+#include "librmilter_compat.h"
+
+/* Size of a single in-memory body block */
+#define RMILTER_BODY_BLOCK_SIZE (64 * 1024)
+
+struct rmilter_body_block {
+	gsize len;
+	struct rmilter_body_block *next;
+	guchar data[RMILTER_BODY_BLOCK_SIZE];
+};
+
+/*
+ * Message body storage: body chunks are appended to a list of fixed size
+ * blocks that are never reallocated. When the body grows over the threshold,
+ * it is moved to an anonymous file (memfd where available) that could be
+ * mapped or passed to another process.
+ */
+struct rmilter_body_store {
+	struct rmilter_body_block *head;
+	struct rmilter_body_block *tail;
+	gsize len;
+	gsize spill_threshold;
+	gint fd;
+	guchar *map;
+	gsize map_len;
+	gboolean sealed;
+};
+
+void rmilter_body_store_init (struct rmilter_body_store *bs,
+		gsize spill_threshold);
+
+/**
+ * Appends chunk to the body
+ * @return FALSE if chunk cannot be written to the spill file
+ */
+gboolean rmilter_body_store_append (struct rmilter_body_store *bs,
+		const guchar *data, gsize len);
+
+/**
+ * Returns contiguous view of the body, spilling it to file if needed
+ * @return pointer to the body or NULL on error or when body is empty
+ */
+const guchar *rmilter_body_store_map (struct rmilter_body_store *bs);
+
+/**
+ * Moves body to the anonymous file and returns its descriptor, no more data
+ * could be appended after this call
+ * @return file descriptor or -1 on error
+ */
+gint rmilter_body_store_fd (struct rmilter_body_store *bs);
+
+/**
+ * Frees all resources and prepares store for the next message
+ */
+void rmilter_body_store_reset (struct rmilter_body_store *bs);
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBRMILTER_BUF_H
+#define LIBRMILTER_BUF_H
+
+#include <string.h>
+#include "librmilter_compat.h"
+
+/*
+ * Growable byte buffer, zeroed structure is an empty buffer
+ */
+struct rmilter_buf {
+	guchar *data;
+	gsize len;
+	gsize allocated;
+};
+
+/*
+ * Vector of strings, zeroed structure is an empty vector
+ */
+struct rmilter_ptrs {
+	const gchar **pdata;
+	guint len;
+	guint allocated;
+};
+
+/**
+ * Ensures that `n` more bytes could be appended without reallocation
+ */
+static inline void
+rmilter_buf_reserve (struct rmilter_buf *b, gsize n)
+{
+	gsize nsize;
+
+	if (b->len + n > b->allocated) {
+		nsize = MAX (b->allocated * 2, 64);
+
+		while (nsize < b->len + n) {
+			nsize *= 2;
+		}
+
+		b->data = g_realloc (b->data, nsize);
+		b->allocated = nsize;
+	}
+}
+
+static inline void
+rmilter_buf_append (struct rmilter_buf *b, const void *data, gsize len)
+{
+	rmilter_buf_reserve (b, len);
+	memcpy (b->data + b->len, data, len);
+	b->len += len;
+}
+
+/**
+ * Empties buffer keeping its storage
+ */
+static inline void
+rmilter_buf_reset (struct rmilter_buf *b)
+{
+	b->len = 0;
+}
+
+/**
+ * Releases storage of buffer, which is empty afterwards
+ */
+static inline void
+rmilter_buf_free (struct rmilter_buf *b)
+{
+	g_free (b->data);
+	memset (b, 0, sizeof (*b));
+}
+
+static inline void
+rmilter_ptrs_add (struct rmilter_ptrs *v, const gchar *p)
+{
+	if (v->len == v->allocated) {
+		v->allocated = MAX (v->allocated * 2, 8);
+		v->pdata = g_realloc (v->pdata,
+				v->allocated * sizeof (*v->pdata));
+	}
+
+	v->pdata[v->len ++] = p;
+}
+
+static inline void
+rmilter_ptrs_reset (struct rmilter_ptrs *v)
+{
+	v->len = 0;
+}
+
+static inline void
+rmilter_ptrs_free (struct rmilter_ptrs *v)
+{
+	g_free (v->pdata);
+	memset (v, 0, sizeof (*v));
+}
+
+#endif
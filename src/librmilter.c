@@ -27,78 +27,183 @@
 #endif
 
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "librmilter.h"
 #include "librmilter_internal.h"
 
-static const guint initial_buffer_size = 8192;
 static const gdouble default_io_timeout = 10.0;
+static const gdouble default_progress_interval = 5.0;
+static const gsize default_body_spill_threshold = 1024 * 1024;
+static const gsize default_stream_buffer = 1024 * 1024;
+static const gsize session_arena_chunk = 1024;
+static const gsize message_arena_chunk = 2048;
+
+/* Maximum number of free sessions kept by milter */
+#define RMILTER_SESSION_CACHE 32
+
+G_STATIC_ASSERT (G_STRUCT_OFFSET (struct rmilter_session, m) <=
+		RMILTER_CACHELINE);
 
 static void
-rmilter_session_dtor (void *d)
+rmilter_session_free (struct rmilter_session *s)
 {
-	struct rmilter_session *s = d;
-	struct rmilter_reply_element *rep, *tmp;
-	GHashTableIter it;
-	gpointer k, v;
+	rmilter_ptrs_free (&s->args);
+	rmilter_arena_destroy (&s->cold->arena);
+	rmilter_arena_destroy (&s->cold->msg_arena);
+	rmilter_macro_set_destroy (&s->cold->macros);
 
-	if (s->read_ev) {
-		s->m->async->del_read (s->m->async->data, s->read_ev);
+	if (s->body) {
+		g_slice_free1 (sizeof (*s->body), s->body);
 	}
 
-	if (s->write_ev) {
-		s->m->async->del_write (s->m->async->data, s->write_ev);
+	g_slice_free1 (sizeof (*s->cold), s->cold);
+	free (s);
+}
+
+/*
+ * Returns session with buffers allocated and all other fields cleared
+ */
+static struct rmilter_session *
+rmilter_session_alloc (struct rmilter_milter *m)
+{
+	struct rmilter_session *s;
+	void *p;
+
+	if (m->free_sessions) {
+		s = m->free_sessions;
+		m->free_sessions = s->next;
+		m->nfree_sessions --;
+		s->next = NULL;
+
+		return s;
 	}
 
-	if (s->timeout_ev) {
-		s->m->async->del_timer (s->m->async->data, s->timeout_ev);
+	if (posix_memalign (&p, RMILTER_CACHELINE, sizeof (*s)) != 0) {
+		/* The same as g_malloc does when it runs out of memory */
+		abort ();
 	}
 
-	if (s->fd != -1) {
-		close (s->fd);
+	s = p;
+	memset (s, 0, sizeof (*s));
+	s->cold = g_slice_alloc0 (sizeof (*s->cold));
+	rmilter_arena_init (&s->cold->arena, session_arena_chunk);
+	rmilter_arena_init (&s->cold->msg_arena, message_arena_chunk);
+	rmilter_macro_set_init (&s->cold->macros);
+
+	return s;
+}
+
+/*
+ * Clears session keeping its storage and returns it to the milter's cache
+ */
+static void
+rmilter_session_recycle (struct rmilter_milter *m, struct rmilter_session *s)
+{
+	struct rmilter_session_cold *cold = s->cold;
+	struct rmilter_body_store *body;
+	struct rmilter_ptrs args;
+
+	if (m->nfree_sessions >= RMILTER_SESSION_CACHE || m->wanna_die) {
+		rmilter_session_free (s);
+
+		return;
 	}
 
-	if (s->cmd_buf) {
-		g_byte_array_free (s->cmd_buf, TRUE);
+	args = s->args;
+	rmilter_ptrs_reset (&args);
+	body = s->body;
+	memset (s, 0, sizeof (*s));
+	s->args = args;
+	s->body = body;
+	s->cold = cold;
+
+	rmilter_arena_reset (&cold->arena);
+	rmilter_arena_reset (&cold->msg_arena);
+	cold->module = cold->id = NULL;
+	cold->handoff = NULL;
+	rmilter_macro_set_clear (&cold->macros);
+
+	LL_PREPEND (m->free_sessions, s);
+	m->nfree_sessions ++;
+}
+
+static void
+rmilter_session_dtor (void *d)
+{
+	struct rmilter_session *s = d;
+	struct rmilter_milter *m = s->m;
+
+	if (s->read_ev) {
+		m->async->del_read (m->async->data, s->read_ev);
 	}
 
-	if (s->cmd.data) {
-		g_byte_array_free (s->cmd.data, TRUE);
+	if (s->write_ev) {
+		m->async->del_write (m->async->data, s->write_ev);
 	}
 
-	if (s->macros) {
-		g_hash_table_iter_init (&it, s->macros);
+	rmilter_wheel_cancel (&m->wheel, &s->io_timer);
+	rmilter_wheel_cancel (&m->wheel, &s->progress_timer);
+	rmilter_wheel_cancel (&m->wheel, &s->deadline_timer);
 
-		while (g_hash_table_iter_next (&it, &k, &v)) {
-			g_string_free (k, TRUE);
-			g_string_free (v, TRUE);
-		}
+	if (s->pending) {
+		s->pending->s = NULL;
+	}
 
-		g_hash_table_unref (s->macros);
+	if (s->fd != -1) {
+		close (s->fd);
 	}
 
-	DL_FOREACH_SAFE (s->replies, rep, tmp) {
-		if (rep->data) {
-			g_byte_array_free (rep->data, TRUE);
-		}
+	rmilter_session_free_replies (s);
+	rmilter_ringbuf_pool_put (&m->rbufs, &s->rbuf);
 
-		g_slice_free1 (sizeof (*rep), rep);
+	if (s->body) {
+		rmilter_body_store_reset (s->body);
 	}
 
-	g_queue_delete_link (s->m->sessions, s->parent_link);
+	DL_DELETE (m->sessions, s);
 
+	if (s->cold->handoff) {
+		g_free (s->cold->handoff);
+	}
+
+	RMILTER_ATOMIC_SUB (&m->nsessions, 1);
+	rmilter_session_recycle (m, s);
 	/* Release refcount on the parent object */
-	REF_RELEASE (s->m);
-	g_slice_free1 (sizeof (*s), s);
+	REF_RELEASE (m);
 }
 
 static void
 rmilter_milter_dtor (void *d)
 {
 	struct rmilter_milter *m = d;
+	struct rmilter_session *s;
+	guint i;
 
 	/* At this point we assume that all sessions pending are dead */
-	g_assert (m->sessions->length == 0);
+	g_assert (m->sessions == NULL);
+
+	if (m->inbox) {
+		rmilter_inbox_free (m->inbox);
+	}
+
+	if (m->tick_ev) {
+		m->async->del_periodic (m->async->data, m->tick_ev);
+	}
+
+	while ((s = m->free_sessions) != NULL) {
+		m->free_sessions = s->next;
+		rmilter_session_free (s);
+	}
+
+	rmilter_milter_free_replies (m);
+	rmilter_ringbuf_pool_destroy (&m->rbufs);
+	rmilter_macro_names_destroy (&m->macro_names);
+
+	for (i = 0; i < RMILTER_NSTAGES; i ++) {
+		g_free (m->macro_lists[i]);
+	}
 
 	g_slice_free1 (sizeof (*m), m);
 }
@@ -128,65 +233,259 @@ rmilter_create (struct rmilter_callbacks *callbacks,
 		m->log_data = log_data;
 	}
 
-	m->sessions = g_queue_new ();
+	rmilter_wheel_init (&m->wheel);
 	m->io_timeout = default_io_timeout;
+	m->progress_interval = default_progress_interval;
+	m->max_data_size = MILTER_MAX_DATA_SIZE;
+	m->body_spill_threshold = default_body_spill_threshold;
+	m->stream_buffer = default_stream_buffer;
 
 	REF_INIT_RETAIN (m, rmilter_milter_dtor);
 
 	return m;
 }
 
+void
+rmilter_set_body_store (struct rmilter_milter *milter, bool enable,
+		size_t spill_threshold)
+{
+	g_assert (milter != NULL);
+
+	milter->body_store = enable;
+
+	if (spill_threshold > 0) {
+		milter->body_spill_threshold = spill_threshold;
+	}
+}
+
+void
+rmilter_set_max_data_size (struct rmilter_milter *milter,
+		enum rmilter_max_data_size mds)
+{
+	g_assert (milter != NULL);
+
+	switch (mds) {
+	case RMILTER_MDS_1M:
+		milter->max_data_size = MILTER_MDS_1M;
+		break;
+	case RMILTER_MDS_256K:
+		milter->max_data_size = MILTER_MDS_256K;
+		break;
+	default:
+		milter->max_data_size = MILTER_MAX_DATA_SIZE;
+		break;
+	}
+}
+
+int
+rmilter_macro_id (struct rmilter_milter *milter, const char *name)
+{
+	g_assert (milter != NULL);
+
+	return rmilter_macro_names_find (&milter->macro_names, name, strlen (name),
+			TRUE);
+}
+
+void
+rmilter_set_progress_interval (struct rmilter_milter *milter,
+		double interval)
+{
+	g_assert (milter != NULL);
+
+	milter->progress_interval = interval;
+}
+
+void
+rmilter_set_stage_timeout (struct rmilter_milter *milter,
+		unsigned int stages, double timeout)
+{
+	guint i;
+
+	g_assert (milter != NULL);
+
+	for (i = 0; i < RMILTER_NSTAGES; i ++) {
+		if (stages & (1u << i)) {
+			milter->stage_timeouts[i] = timeout;
+		}
+	}
+}
+
 bool
-rmilter_consume_socket (struct rmilter_milter *milter, int fd,
-		const char *module, const char *id, void *ud)
+rmilter_set_macro_list (struct rmilter_milter *milter, unsigned int stages,
+		const char *macros)
 {
-	struct rmilter_session *s;
+	const guint supported = RMILTER_STAGE_CONNECT | RMILTER_STAGE_HELO |
+			RMILTER_STAGE_MAIL | RMILTER_STAGE_RCPT | RMILTER_STAGE_DATA |
+			RMILTER_STAGE_EOH | RMILTER_STAGE_EOM;
+	const gchar *p, *end;
+	guint i;
 
 	g_assert (milter != NULL);
 
-	if (milter->wanna_die) {
+	if (stages & ~supported) {
 		return false;
 	}
 
-	s = g_slice_alloc0 (sizeof (*s));
-	s->m = milter;
-	s->cmd_buf = g_byte_array_sized_new (initial_buffer_size);
-	s->cmd.data = g_byte_array_sized_new (initial_buffer_size);
-	s->macros = g_hash_table_new ((GHashFunc)g_string_hash,
-			(GEqualFunc)g_string_equal);
+	for (i = 0; i < RMILTER_NSTAGES; i ++) {
+		if (stages & (1u << i)) {
+			g_free (milter->macro_lists[i]);
+			milter->macro_lists[i] = g_strdup (macros);
+		}
+	}
+
+	/* Requested macros get identifiers before any session needs them */
+	for (p = macros; p != NULL && *p != '\0'; p = end) {
+		while (*p == ' ') {
+			p ++;
+		}
+
+		for (end = p; *end != '\0' && *end != ' '; end ++);
+
+		if (end > p) {
+			rmilter_macro_names_find (&milter->macro_names, p, end - p, TRUE);
+		}
+	}
+
+	return true;
+}
+
+void
+rmilter_set_body_sample (struct rmilter_milter *milter, size_t sample)
+{
+	g_assert (milter != NULL);
+
+	milter->body_sample = sample;
+}
+
+void
+rmilter_set_stream_buffer (struct rmilter_milter *milter, size_t size)
+{
+	g_assert (milter != NULL);
+	g_assert (size > 0);
+
+	milter->stream_buffer = size;
+}
+
+void
+rmilter_set_noreply_stages (struct rmilter_milter *milter,
+		unsigned int stages)
+{
+	g_assert (milter != NULL);
+
+	milter->noreply_stages = stages;
+}
+
+struct rmilter_session *
+rmilter_session_new (struct rmilter_milter *m, gint fd,
+		const gchar *module, const gchar *id, void *ud)
+{
+	struct rmilter_session *s;
+
+	if (m->wanna_die) {
+		return NULL;
+	}
+
+	s = rmilter_session_alloc (m);
+	s->kind = RMILTER_EVENT_SESSION;
+	s->m = m;
+	s->max_data_size = MILTER_MAX_DATA_SIZE;
 	s->fd = fd;
-	s->id = id;
-	s->module = module;
+	s->cold->id = id;
+	s->cold->module = module;
+	s->ud = ud;
 
 	REF_INIT_RETAIN (s, rmilter_session_dtor);
 	/* Grab reference from the parent */
 	REF_RETAIN (s->m);
+	RMILTER_ATOMIC_ADD (&m->nsessions, 1);
 
-	g_queue_push_head (milter->sessions, s);
-	s->parent_link = g_queue_peek_head_link (milter->sessions);
-	rmilter_session_start (s);
+	DL_PREPEND (m->sessions, s);
 
-	return true;
+	if (!rmilter_session_start (s)) {
+		/* Descriptor is left to the caller, callbacks have not been called */
+		s->fd = -1;
+		s->state = st_closed;
+		REF_RELEASE (s);
+
+		return NULL;
+	}
+
+	return s;
+}
+
+static void
+rmilter_milter_tick (void *arg)
+{
+	struct rmilter_milter *m = arg;
+
+	/* Sessions closed by timers might release the last reference */
+	REF_RETAIN (m);
+	rmilter_wheel_expire (&m->wheel, g_get_monotonic_time ());
+
+	if (m->wheel.count == 0 && m->tick_ev) {
+		/* Idle milter does not wake the loop up */
+		m->async->del_periodic (m->async->data, m->tick_ev);
+		m->tick_ev = NULL;
+	}
+
+	REF_RELEASE (m);
+}
+
+void
+rmilter_milter_arm_timer (struct rmilter_milter *m,
+		struct rmilter_wheel_timer *t, gdouble after)
+{
+	rmilter_wheel_arm (&m->wheel, t,
+			g_get_monotonic_time () + (gint64)(MAX (after, 0.0) * 1e6));
+
+	if (m->tick_ev == NULL) {
+		m->tick_ev = m->async->add_periodic (m->async->data,
+				RMILTER_WHEEL_TICK_US / 1e6, rmilter_milter_tick, m);
+
+		if (m->tick_ev == NULL) {
+			/* Next timer armed retries, timers are late meanwhile */
+			msg_err_milter ("cannot add periodic event for timers");
+		}
+	}
+}
+
+bool
+rmilter_consume_socket (struct rmilter_milter *milter, int fd,
+		const char *module, const char *id, void *ud)
+{
+	g_assert (milter != NULL);
+
+	return rmilter_session_new (milter, fd, module, id, ud) != NULL;
 }
 
 void
 rmilter_destroy (struct rmilter_milter *milter)
 {
-	struct rmilter_session *s;
-	GList *cur;
+	struct rmilter_session *s, *next;
 
 	g_assert (milter != NULL);
+	/* Group must not release the last reference from another thread */
+	g_assert (RMILTER_ATOMIC_LOAD (&milter->ngroups) == 0);
 
 	/* Stop new sessions from being added */
-	milter->wanna_die = TRUE;
-	cur = milter->sessions->tail;
+	RMILTER_ATOMIC_STORE (&milter->wanna_die, TRUE);
+
+	if (milter->inbox) {
+		/*
+		 * Jobs and body streams that are done but not delivered yet hold
+		 * references to their sessions, so they are finished before the
+		 * inbox stops being watched
+		 */
+		rmilter_inbox_finish_tasks (milter->inbox);
+		rmilter_inbox_stop (milter->inbox);
+	}
 
-	while (cur) {
-		s = cur->data;
+	for (s = milter->sessions; s != NULL; s = next) {
+		/* Closing might remove the session from the list */
+		next = s->next;
 
 		/* Release the reference owned by milter itself */
 		rmilter_session_close (s);
-		cur = g_list_next (cur);
 	}
 
 	/* Release ownership to allow destruction when all sessions are dead */
@@ -196,9 +495,15 @@ rmilter_destroy (struct rmilter_milter *milter)
 void
 rmilter_process_read (int fd, void *arg)
 {
-	struct rmilter_session *s = arg;
-
-	rmilter_session_want_read (s);
+	/* Both sessions and inboxes start with their kind */
+	switch (*(enum rmilter_event_kind *)arg) {
+	case RMILTER_EVENT_INBOX:
+		rmilter_inbox_process (arg);
+		break;
+	default:
+		rmilter_session_want_read (arg);
+		break;
+	}
 }
 
 void
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBRMILTER_COMPAT_H
+#define LIBRMILTER_COMPAT_H
+
+/*
+ * The library uses a small subset of GLib: basic types, a few macros and
+ * allocation functions. When built with RMILTER_WITH_GLIB (or when glib.h has
+ * been already included) GLib itself provides them, otherwise they are
+ * defined here on top of libc, so the library does not depend on GLib.
+ *
+ * This header is private: public headers use plain C types only, so these
+ * names never reach the code of milters.
+ */
+#if defined(RMILTER_WITH_GLIB) || defined(__G_LIB_H__)
+#include <glib.h>
+#else
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include <time.h>
+
+typedef char gchar;
+typedef unsigned char guchar;
+typedef int gint;
+typedef unsigned int guint;
+typedef int gboolean;
+typedef double gdouble;
+typedef void * gpointer;
+typedef const void * gconstpointer;
+typedef size_t gsize;
+typedef ssize_t gssize;
+typedef int8_t gint8;
+typedef uint8_t guint8;
+typedef int16_t gint16;
+typedef uint16_t guint16;
+typedef int32_t gint32;
+typedef uint32_t guint32;
+typedef int64_t gint64;
+typedef uint64_t guint64;
+
+#ifndef FALSE
+#define FALSE (0)
+#endif
+#ifndef TRUE
+#define TRUE (!FALSE)
+#endif
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define G_MAXUINT UINT_MAX
+#define G_GINT64_CONSTANT(val) (INT64_C (val))
+#define G_N_ELEMENTS(arr) (sizeof (arr) / sizeof ((arr)[0]))
+#define G_STRUCT_OFFSET(type, member) ((long)offsetof (type, member))
+#define G_STRFUNC ((const char *)(__func__))
+#define G_PASTE_ARGS(a, b) a ## b
+#define G_PASTE(a, b) G_PASTE_ARGS (a, b)
+#define G_STATIC_ASSERT(expr) \
+	typedef char G_PASTE (rmilter_static_assert_, __LINE__)[(expr) ? 1 : -1]
+
+#define g_assert(expr) assert (expr)
+#define g_ascii_isdigit(c) ((c) >= '0' && (c) <= '9')
+
+/*
+ * Like in GLib, allocation failures are fatal
+ */
+static inline gpointer
+g_malloc (gsize n)
+{
+	gpointer p;
+
+	if (n == 0) {
+		return NULL;
+	}
+
+	p = malloc (n);
+
+	if (p == NULL) {
+		abort ();
+	}
+
+	return p;
+}
+
+static inline gpointer
+g_malloc0 (gsize n)
+{
+	gpointer p;
+
+	if (n == 0) {
+		return NULL;
+	}
+
+	p = calloc (1, n);
+
+	if (p == NULL) {
+		abort ();
+	}
+
+	return p;
+}
+
+static inline gpointer
+g_realloc (gpointer mem, gsize n)
+{
+	gpointer p;
+
+	if (n == 0) {
+		free (mem);
+
+		return NULL;
+	}
+
+	p = realloc (mem, n);
+
+	if (p == NULL) {
+		abort ();
+	}
+
+	return p;
+}
+
+static inline void
+g_free (gpointer mem)
+{
+	free (mem);
+}
+
+/* Slices are plain heap allocations in modern GLib as well */
+#define g_slice_alloc(n) g_malloc (n)
+#define g_slice_alloc0(n) g_malloc0 (n)
+#define g_slice_free1(n, mem) g_free (mem)
+
+static inline gchar *
+g_strndup (const gchar *str, gsize n)
+{
+	gchar *p;
+	const gchar *end;
+
+	if (str == NULL) {
+		return NULL;
+	}
+
+	end = memchr (str, '\0', n);
+
+	if (end != NULL) {
+		n = end - str;
+	}
+
+	p = g_malloc (n + 1);
+	memcpy (p, str, n);
+	p[n] = '\0';
+
+	return p;
+}
+
+static inline gchar *
+g_strdup (const gchar *str)
+{
+	return str ? g_strndup (str, strlen (str)) : NULL;
+}
+
+/*
+ * Returns monotonic time in microseconds
+ */
+static inline gint64
+g_get_monotonic_time (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (gint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#endif
+
+#endif
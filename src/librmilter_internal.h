@@ -26,49 +26,162 @@
 #define LIBRDNS_LIBMILTER_INTERNAL_H
 
 #include "librmilter.h"
+#include "librmilter_compat.h"
 #include "ref.h"
 #include "utlist.h"
 #include "logger.h"
 #include "session.h"
+#include "protocol.h"
+#include "ringbuf.h"
+#include "bodystore.h"
+#include "shard.h"
+#include "pool.h"
+#include "stream.h"
+#include "wheel.h"
+#include "arena.h"
+#include "macro.h"
+#include "buf.h"
+
+/* Counters shared with other threads, relaxed ordering is enough for them */
+#ifdef HAVE_ATOMIC_BUILTINS
+#define RMILTER_ATOMIC_LOAD(p) __atomic_load_n ((p), __ATOMIC_RELAXED)
+#define RMILTER_ATOMIC_STORE(p, v) __atomic_store_n ((p), (v), __ATOMIC_RELAXED)
+#define RMILTER_ATOMIC_ADD(p, v) __atomic_fetch_add ((p), (v), __ATOMIC_RELAXED)
+#define RMILTER_ATOMIC_SUB(p, v) __atomic_fetch_sub ((p), (v), __ATOMIC_RELAXED)
+#else
+#define RMILTER_ATOMIC_LOAD(p) (*(p))
+#define RMILTER_ATOMIC_STORE(p, v) (*(p) = (v))
+#define RMILTER_ATOMIC_ADD(p, v) ((*(p) += (v)) - (v))
+#define RMILTER_ATOMIC_SUB(p, v) ((*(p) -= (v)) + (v))
+#endif
+
+/* Command header: 4 bytes of length and command byte */
+#define RMILTER_CMD_HDR_LEN (MILTER_LEN_BYTES + 1)
+/*
+ * Receive buffer holds at least one command of the negotiated size; rounding
+ * to a power of two pages leaves nearly as much room to read the next one
+ */
+#define RMILTER_RBUF_SIZE(mds) ((mds) + RMILTER_CMD_HDR_LEN)
 
 enum rmilter_session_state {
-	st_read_cmd,
-	st_len_1,
-	st_len_2,
-	st_len_3,
-	st_len_4,
-	st_read_data,
-	st_send_reply
+	st_read_cmd = 0,
+	st_wait_verdict,
+	st_closed
 };
 
 struct rmilter_command {
 	char cmd;
+	/* Payload length, command byte is excluded */
 	guint cmdlen;
-	GByteArray *data;
+};
+
+/*
+ * Preencoded SMFIR_REPLYCODE frame
+ */
+struct rmilter_reply_code {
+	guchar *frame;
+	gsize len;
+	/* The first digit of SMTP code */
+	gchar rclass;
+	/* Cached codes are owned by milter and are never freed by sessions */
+	gboolean cached;
+	struct rmilter_reply_code *next;
 };
 
 struct rmilter_reply_element {
-	char code;
-	GByteArray *data;
+	/* Encoded length and reply code */
+	guchar hdr[RMILTER_CMD_HDR_LEN];
+	/* Either `hdr` or a static preencoded frame */
+	const guchar *frame;
+	gsize frame_len;
+	/* Payload, might be NULL or empty */
+	struct rmilter_buf data;
+	/* Non-cached reply code that is referred by `frame` */
+	struct rmilter_reply_code *code;
+	/* Bytes of frame and payload that have been written to the socket */
+	gsize written;
 	struct rmilter_reply_element *next, *prev;
 };
 
-struct rmilter_session {
-	struct rmilter_milter *m;
-	GList *parent_link;
+/* Number of `enum rmilter_stage` values */
+#define RMILTER_NSTAGES 10
+
+/* Handle of the deferred verdict, session is a weak reference */
+struct rmilter_pending {
+	struct rmilter_session *s;
+	rmilter_cancel_callback cancel;
+	void *cancel_ud;
+};
+
+/* Size of cache line */
+#define RMILTER_CACHELINE 64
+
+/*
+ * Session data that is rarely touched while commands are processed
+ */
+struct rmilter_session_cold {
 	const char *module;
 	const char *id;
-	GHashTable *macros;
-	GByteArray *cmd_buf;
-	struct rmilter_reply_element *replies;
+	/* Owns module and id if the socket has been passed from another thread */
+	struct rmilter_handoff *handoff;
+	/* Storage for the lifetime of connection and of the current message */
+	struct rmilter_arena arena;
+	struct rmilter_arena msg_arena;
+	/* Values of macros, they are stored in the arenas */
+	struct rmilter_macro_set macros;
+};
+
+/*
+ * Sessions are aligned to cache line and the first one holds everything
+ * that the command parser touches
+ */
+struct rmilter_session {
+	/* Must be the first member, see `rmilter_process_read` */
+	enum rmilter_event_kind kind;
+	enum rmilter_session_state state;
 	struct rmilter_command cmd;
 	gint fd;
-	enum rmilter_session_state state;
+	/* Reading is stopped until the stream has space */
+	gboolean stream_paused;
+	struct rmilter_ringbuf rbuf;
+	/* The end of the hot part */
+	struct rmilter_milter *m;
+	ref_entry_t ref;
 	void *ud;
+	struct rmilter_ptrs args;
+	struct rmilter_reply_element *replies;
 	void *read_ev;
 	void *write_ev;
-	void *timeout_ev;
-	ref_entry_t ref;
+	/* Timers on the wheel of the milter */
+	struct rmilter_wheel_timer io_timer;
+	struct rmilter_wheel_timer progress_timer;
+	struct rmilter_wheel_timer deadline_timer;
+	struct rmilter_reply_code *reply_code;
+	struct rmilter_body_store *body;
+	/* Body bytes processed in the current message */
+	gsize body_seen;
+	gboolean body_skipped;
+	gboolean eom_called;
+	/* Deferred verdict of the current command */
+	struct rmilter_pending *pending;
+	/* Work of the current command running in the thread pool */
+	struct rmilter_job *job;
+	/* Consumer of the body of the current message */
+	struct rmilter_stream *stream;
+	/* Verdict of end of message is the verdict of the stream */
+	gboolean stream_ended;
+	gboolean resumed;
+	enum librmilter_reply resumed_verdict;
+	/* Monotonic deadline of the current stage in microseconds, 0 if none */
+	gint64 stage_deadline;
+	guint32 version;
+	guint32 actions;
+	guint32 protocol;
+	/* Maximum command payload negotiated */
+	guint32 max_data_size;
+	struct rmilter_session_cold *cold;
+	/* Links in the list of milter's sessions or in the list of free ones */
+	struct rmilter_session *prev, *next;
 };
 
 struct rmilter_milter {
@@ -76,10 +189,60 @@ struct rmilter_milter {
 	struct rmilter_async_context *async;
 	rmilter_log_function log;
 	void *log_data;
-	GQueue *sessions;
+	struct rmilter_session *sessions;
+	/* Sessions available for reuse, with their buffers allocated */
+	struct rmilter_session *free_sessions;
+	guint nfree_sessions;
+	/* Number of sessions alive, read by other threads */
+	guint nsessions;
+	/* Sockets passed from other threads, NULL if milter is not sharded */
+	struct rmilter_inbox *inbox;
+	struct rmilter_pool *pool;
+	/* Identifiers of macro names sent by the MTA */
+	struct rmilter_macro_names macro_names;
+	/* Receive buffers of sessions that have data to process */
+	struct rmilter_ringbuf_pool rbufs;
+	/* Timeouts of all sessions driven by a single periodic event */
+	struct rmilter_wheel wheel;
+	void *tick_ev;
+	/* Reply elements available for reuse */
+	struct rmilter_reply_element *free_replies;
+	guint nfree_replies;
+	struct rmilter_reply_code *reply_codes;
 	gdouble io_timeout;
-	gboolean wanna_die;
+	gdouble progress_interval;
+	gdouble stage_timeouts[RMILTER_NSTAGES];
+	/* Space separated macros to request for stages, NULL for the default */
+	gchar *macro_lists[RMILTER_NSTAGES];
+	/* Maximum command payload to negotiate */
+	guint32 max_data_size;
+	/* Stages that never reply anything but continue */
+	guint noreply_stages;
+	gsize body_spill_threshold;
+	gboolean body_store;
+	gsize body_sample;
+	/* Bytes of body chunks queued to a stream consumer */
+	gsize stream_buffer;
+	guint wanna_die;
+	/* Shard groups that refer to the milter, must be gone before it is */
+	guint ngroups;
 	ref_entry_t ref;
 };
 
+/**
+ * Creates session for the socket and starts it
+ * @return new session or NULL if milter is being destroyed
+ */
+struct rmilter_session *rmilter_session_new (struct rmilter_milter *m,
+		gint fd, const gchar *module, const gchar *id, void *ud);
+
+/**
+ * Arms or rearms timer on the wheel of milter
+ * @param m milter
+ * @param t timer
+ * @param after timeout in seconds
+ */
+void rmilter_milter_arm_timer (struct rmilter_milter *m,
+		struct rmilter_wheel_timer *t, gdouble after);
+
 #endif
@@ -53,12 +53,12 @@ void rmilter_logger_helper (struct rmilter_milter *m,
 	RMILTER_LOG_DEBUG, "milter", NULL, G_STRFUNC, __VA_ARGS__); } while (0)
 
 #define msg_err_session(...) do { rmilter_logger_helper (s->m, \
-	RMILTER_LOG_ERROR, s->module, s->id, G_STRFUNC, __VA_ARGS__); } while (0)
+	RMILTER_LOG_ERROR, s->cold->module, s->cold->id, G_STRFUNC, __VA_ARGS__); } while (0)
 #define msg_warn_session(...) do { rmilter_logger_helper (s->m, \
-	RMILTER_LOG_WARNING, s->module, s->id, G_STRFUNC, __VA_ARGS__); } while (0)
+	RMILTER_LOG_WARNING, s->cold->module, s->cold->id, G_STRFUNC, __VA_ARGS__); } while (0)
 #define msg_info_session(...) do { rmilter_logger_helper (s->m, \
-	RMILTER_LOG_INFO, s->module, s->id, G_STRFUNC, __VA_ARGS__); } while (0)
+	RMILTER_LOG_INFO, s->cold->module, s->cold->id, G_STRFUNC, __VA_ARGS__); } while (0)
 #define msg_debug_session(...) do { rmilter_logger_helper (s->m, \
-	RMILTER_LOG_DEBUG, s->module, s->id, G_STRFUNC, __VA_ARGS__); } while (0)
+	RMILTER_LOG_DEBUG, s->cold->module, s->cold->id, G_STRFUNC, __VA_ARGS__); } while (0)
 
 #endif
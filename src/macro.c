@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "macro.h"
+#include "protocol.h"
+
+/* Order of stages, connection stages go first */
+static const gchar rmilter_macro_cmds[RMILTER_MACRO_STAGES - 1] = {
+	SMFIC_CONNECT, SMFIC_HELO, SMFIC_MAIL, SMFIC_RCPT, SMFIC_DATA,
+	SMFIC_HEADER, SMFIC_EOH, SMFIC_BODYEOB, SMFIC_UNKNOWN
+};
+
+static inline guint32
+rmilter_macro_hash (const gchar *name, gsize len)
+{
+	guint32 h = 2166136261u;
+	gsize i;
+
+	for (i = 0; i < len; i ++) {
+		h = (h ^ (guchar)name[i]) * 16777619u;
+	}
+
+	return h;
+}
+
+gint
+rmilter_macro_names_find (struct rmilter_macro_names *names,
+		const gchar *name, gsize len, gboolean intern)
+{
+	guint slot, id;
+
+	if (len > 2 && name[0] == '{' && name[len - 1] == '}') {
+		name ++;
+		len -= 2;
+	}
+
+	slot = rmilter_macro_hash (name, len) & (RMILTER_MACRO_SLOTS - 1);
+
+	/* Table is never more than half full, so there is always an empty slot */
+	while (names->slots[slot] != 0) {
+		id = names->slots[slot] - 1;
+
+		if (names->lens[id] == len &&
+				memcmp (names->names[id], name, len) == 0) {
+			return id;
+		}
+
+		slot = (slot + 1) & (RMILTER_MACRO_SLOTS - 1);
+	}
+
+	if (!intern || names->count == RMILTER_MACRO_MAX) {
+		return -1;
+	}
+
+	id = names->count ++;
+	names->names[id] = g_strndup (name, len);
+	names->lens[id] = len;
+	names->slots[slot] = id + 1;
+
+	return id;
+}
+
+void
+rmilter_macro_names_destroy (struct rmilter_macro_names *names)
+{
+	guint i;
+
+	for (i = 0; i < names->count; i ++) {
+		g_free (names->names[i]);
+	}
+
+	memset (names, 0, sizeof (*names));
+}
+
+guint
+rmilter_macro_stage (gchar cmd)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (rmilter_macro_cmds); i ++) {
+		if (rmilter_macro_cmds[i] == cmd) {
+			return i;
+		}
+	}
+
+	return RMILTER_MACRO_STAGES - 1;
+}
+
+void
+rmilter_macro_set_init (struct rmilter_macro_set *set)
+{
+	guint i;
+
+	set->values = NULL;
+	set->nvalues = 0;
+
+	for (i = 0; i < RMILTER_MACRO_STAGES; i ++) {
+		set->gens[i] = 1;
+	}
+}
+
+void
+rmilter_macro_set_clear (struct rmilter_macro_set *set)
+{
+	guint i;
+
+	/* Stored generations are never reused, so values need no clearing */
+	for (i = 0; i < RMILTER_MACRO_STAGES; i ++) {
+		rmilter_macro_set_drop (set, i);
+	}
+}
+
+void
+rmilter_macro_set_destroy (struct rmilter_macro_set *set)
+{
+	g_free (set->values);
+	rmilter_macro_set_init (set);
+}
+
+void
+rmilter_macro_set_put (struct rmilter_macro_set *set, gint id, guint stage,
+		const gchar *value)
+{
+	guint n;
+
+	if ((guint)id >= set->nvalues) {
+		n = MAX (set->nvalues * 2, 16);
+
+		while (n <= (guint)id) {
+			n *= 2;
+		}
+
+		set->values = g_realloc (set->values, n * sizeof (*set->values));
+		memset (set->values + set->nvalues, 0,
+				(n - set->nvalues) * sizeof (*set->values));
+		set->nvalues = n;
+	}
+
+	set->values[id].value = value;
+	set->values[id].gen = set->gens[stage];
+	set->values[id].stage = stage;
+}
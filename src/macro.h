@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBRMILTER_MACRO_H
+#define LIBRMILTER_MACRO_H
+
+#include "librmilter_compat.h"
+
+/* Maximum number of distinct macro names per milter */
+#define RMILTER_MACRO_MAX 256
+#define RMILTER_MACRO_SLOTS (RMILTER_MACRO_MAX * 2)
+/* Commands that macros are defined for, the last one is for the others */
+#define RMILTER_MACRO_STAGES 10
+/* Stages of connect and HELO, macros of other stages belong to a message */
+#define RMILTER_MACRO_CONN_STAGES 2
+
+/*
+ * Macro names of milter interned to small integers, open addressing table
+ * of identifiers plus one
+ */
+struct rmilter_macro_names {
+	gchar *names[RMILTER_MACRO_MAX];
+	gsize lens[RMILTER_MACRO_MAX];
+	guint16 slots[RMILTER_MACRO_SLOTS];
+	guint count;
+};
+
+struct rmilter_macro_value {
+	const gchar *value;
+	/* Value is valid while generation of its stage is the same */
+	guint32 gen;
+	guint32 stage;
+};
+
+/*
+ * Macro values of session indexed by name identifiers
+ */
+struct rmilter_macro_set {
+	struct rmilter_macro_value *values;
+	guint nvalues;
+	guint32 gens[RMILTER_MACRO_STAGES];
+};
+
+/**
+ * Returns identifier of the macro name, braces of long names are ignored
+ * @param names names table
+ * @param name macro name
+ * @param len length of the name
+ * @param intern add name to the table if it is not there
+ * @return identifier or -1 if name is unknown or the table is full
+ */
+gint rmilter_macro_names_find (struct rmilter_macro_names *names,
+		const gchar *name, gsize len, gboolean intern);
+
+/**
+ * Releases names of the table
+ */
+void rmilter_macro_names_destroy (struct rmilter_macro_names *names);
+
+/**
+ * Returns stage index of the command that macros are defined for
+ */
+guint rmilter_macro_stage (gchar cmd);
+
+/**
+ * Initializes empty set of values
+ */
+void rmilter_macro_set_init (struct rmilter_macro_set *set);
+
+/**
+ * Forgets all values, the storage is kept
+ */
+void rmilter_macro_set_clear (struct rmilter_macro_set *set);
+
+/**
+ * Releases storage of values
+ */
+void rmilter_macro_set_destroy (struct rmilter_macro_set *set);
+
+/**
+ * Stores value of macro defined for the stage, value is not copied
+ */
+void rmilter_macro_set_put (struct rmilter_macro_set *set, gint id,
+		guint stage, const gchar *value);
+
+/* Forgets values of the stage in constant time */
+static inline void
+rmilter_macro_set_drop (struct rmilter_macro_set *set, guint stage)
+{
+	set->gens[stage] ++;
+}
+
+static inline const gchar *
+rmilter_macro_set_get (const struct rmilter_macro_set *set, gint id)
+{
+	const struct rmilter_macro_value *v;
+
+	if (id < 0 || (guint)id >= set->nvalues) {
+		return NULL;
+	}
+
+	v = &set->values[id];
+
+	return (v->value && v->gen == set->gens[v->stage]) ? v->value : NULL;
+}
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBRMILTER_MPSC_H
+#define LIBRMILTER_MPSC_H
+
+#include <stddef.h>
+
+/*
+ * Intrusive lock-free multiple producers single consumer queue by Dmitry
+ * Vyukov. Producers swap the tail and then link the previous node, so the
+ * consumer might see a node that is not linked yet: pop returns NULL then and
+ * the producer is expected to notify the consumer once more after pushing.
+ */
+struct rmilter_mpsc_node {
+	struct rmilter_mpsc_node *next;
+};
+
+struct rmilter_mpsc {
+	/* Consumer side */
+	struct rmilter_mpsc_node *head;
+	/* Producers side */
+	struct rmilter_mpsc_node *tail;
+	struct rmilter_mpsc_node stub;
+};
+
+#ifdef HAVE_ATOMIC_BUILTINS
+static inline void
+rmilter_mpsc_init (struct rmilter_mpsc *q)
+{
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+static inline void
+rmilter_mpsc_push (struct rmilter_mpsc *q, struct rmilter_mpsc_node *n)
+{
+	struct rmilter_mpsc_node *prev;
+
+	__atomic_store_n (&n->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n (&q->tail, n, __ATOMIC_ACQ_REL);
+	__atomic_store_n (&prev->next, n, __ATOMIC_RELEASE);
+}
+
+static inline struct rmilter_mpsc_node *
+rmilter_mpsc_pop (struct rmilter_mpsc *q)
+{
+	struct rmilter_mpsc_node *head = q->head, *next, *tail;
+
+	next = __atomic_load_n (&head->next, __ATOMIC_ACQUIRE);
+
+	if (head == &q->stub) {
+		if (next == NULL) {
+			return NULL;
+		}
+
+		q->head = next;
+		head = next;
+		next = __atomic_load_n (&head->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next != NULL) {
+		q->head = next;
+
+		return head;
+	}
+
+	tail = __atomic_load_n (&q->tail, __ATOMIC_ACQUIRE);
+
+	if (head != tail) {
+		/* Producer has not linked its node yet */
+		return NULL;
+	}
+
+	/* The last node is returned when stub is queued after it */
+	rmilter_mpsc_push (q, &q->stub);
+	next = __atomic_load_n (&head->next, __ATOMIC_ACQUIRE);
+
+	if (next != NULL) {
+		q->head = next;
+
+		return head;
+	}
+
+	return NULL;
+}
+#endif
+
+#endif
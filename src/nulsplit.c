@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "librmilter_internal.h"
+#include "nulsplit.h"
+
+#ifdef RMILTER_HAS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+typedef gsize (*rmilter_find_nul_func) (const guchar *p, gsize len,
+		guint32 *pos, gsize maxpos);
+
+gsize
+rmilter_find_nul_scalar (const guchar *p, gsize len, guint32 *pos,
+		gsize maxpos)
+{
+	gsize i, n = 0;
+
+	for (i = 0; i < len && n < maxpos; i ++) {
+		if (p[i] == '\0') {
+			pos[n++] = i;
+		}
+	}
+
+	return n;
+}
+
+#ifdef RMILTER_HAS_X86_SIMD
+/*
+ * Converts bitmask of NUL bytes found at `base` to positions
+ */
+#define RMILTER_MASK_TO_POS(mask, base) do {								\
+	while ((mask) != 0) {													\
+		pos[n++] = (base) + __builtin_ctzll (mask);							\
+		if (n == maxpos) {													\
+			return n;														\
+		}																	\
+		(mask) &= (mask) - 1;												\
+	}																		\
+} while (0)
+
+/*
+ * Both implementations look at 64 bytes blocks first: comparison results are
+ * merged, so a block without NULs costs a single test. Long headers are
+ * mostly such blocks, whilst short strings of macros are found per block.
+ */
+__attribute__((target("sse2"))) gsize
+rmilter_find_nul_sse2 (const guchar *p, gsize len, guint32 *pos,
+		gsize maxpos)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	__m128i c0, c1, c2, c3;
+	guint64 mask;
+	gsize i = 0, n = 0;
+
+	if (maxpos == 0) {
+		return 0;
+	}
+
+	for (; i + 64 <= len; i += 64) {
+		c0 = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)(p + i)), zero);
+		c1 = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)(p + i + 16)),
+				zero);
+		c2 = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)(p + i + 32)),
+				zero);
+		c3 = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)(p + i + 48)),
+				zero);
+
+		if (_mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (c0, c1),
+				_mm_or_si128 (c2, c3))) == 0) {
+			continue;
+		}
+
+		mask = (guint64)(guint)_mm_movemask_epi8 (c0) |
+				((guint64)(guint)_mm_movemask_epi8 (c1) << 16) |
+				((guint64)(guint)_mm_movemask_epi8 (c2) << 32) |
+				((guint64)(guint)_mm_movemask_epi8 (c3) << 48);
+		RMILTER_MASK_TO_POS (mask, i);
+	}
+
+	for (; i + 16 <= len; i += 16) {
+		mask = (guint)_mm_movemask_epi8 (_mm_cmpeq_epi8 (
+				_mm_loadu_si128 ((const __m128i *)(p + i)), zero));
+		RMILTER_MASK_TO_POS (mask, i);
+	}
+
+	for (; i < len; i ++) {
+		if (p[i] == '\0') {
+			pos[n++] = i;
+
+			if (n == maxpos) {
+				break;
+			}
+		}
+	}
+
+	return n;
+}
+
+__attribute__((target("avx2"))) gsize
+rmilter_find_nul_avx2 (const guchar *p, gsize len, guint32 *pos,
+		gsize maxpos)
+{
+	const __m256i zero = _mm256_setzero_si256 ();
+	__m256i c0, c1;
+	guint64 mask;
+	gsize i = 0, n = 0, j, tail;
+
+	if (maxpos == 0) {
+		return 0;
+	}
+
+	for (; i + 64 <= len; i += 64) {
+		c0 = _mm256_cmpeq_epi8 (
+				_mm256_loadu_si256 ((const __m256i *)(p + i)), zero);
+		c1 = _mm256_cmpeq_epi8 (
+				_mm256_loadu_si256 ((const __m256i *)(p + i + 32)), zero);
+
+		if (_mm256_testz_si256 (_mm256_or_si256 (c0, c1),
+				_mm256_or_si256 (c0, c1))) {
+			continue;
+		}
+
+		mask = (guint64)(guint)_mm256_movemask_epi8 (c0) |
+				((guint64)(guint)_mm256_movemask_epi8 (c1) << 32);
+		RMILTER_MASK_TO_POS (mask, i);
+	}
+
+	/* Tail is processed by SSE2 and scalar code */
+	if (i < len) {
+		tail = rmilter_find_nul_sse2 (p + i, len - i, pos + n, maxpos - n);
+
+		for (j = n; j < n + tail; j ++) {
+			pos[j] += i;
+		}
+
+		n += tail;
+	}
+
+	return n;
+}
+
+#undef RMILTER_MASK_TO_POS
+#endif
+
+static gsize rmilter_find_nul_detect (const guchar *p, gsize len,
+		guint32 *pos, gsize maxpos);
+
+static rmilter_find_nul_func rmilter_find_nul_impl = rmilter_find_nul_detect;
+
+static gsize
+rmilter_find_nul_detect (const guchar *p, gsize len, guint32 *pos,
+		gsize maxpos)
+{
+	rmilter_find_nul_func impl = rmilter_find_nul_scalar;
+
+#ifdef RMILTER_HAS_X86_SIMD
+	__builtin_cpu_init ();
+
+	if (__builtin_cpu_supports ("avx2")) {
+		impl = rmilter_find_nul_avx2;
+	}
+	else if (__builtin_cpu_supports ("sse2")) {
+		impl = rmilter_find_nul_sse2;
+	}
+#endif
+
+	/* Pool threads might detect it at the same time and store the same value */
+	RMILTER_ATOMIC_STORE (&rmilter_find_nul_impl, impl);
+
+	return impl (p, len, pos, maxpos);
+}
+
+gsize
+rmilter_find_nul (const guchar *p, gsize len, guint32 *pos, gsize maxpos)
+{
+	rmilter_find_nul_func impl = RMILTER_ATOMIC_LOAD (&rmilter_find_nul_impl);
+
+	return impl (p, len, pos, maxpos);
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBRMILTER_NULSPLIT_H
+#define LIBRMILTER_NULSPLIT_H
+
+#include "librmilter_compat.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define RMILTER_HAS_X86_SIMD 1
+#endif
+
+/**
+ * Finds positions of NUL characters in the buffer, MAIL, RCPT, HEADER and
+ * MACRO commands are lists of NUL terminated strings. SIMD implementation is
+ * selected at runtime if CPU supports it.
+ * @param p data
+ * @param len length of data
+ * @param pos output array of NUL offsets relative to `p`
+ * @param maxpos size of the output array, search stops when it is full
+ * @return number of positions found
+ */
+gsize rmilter_find_nul (const guchar *p, gsize len, guint32 *pos,
+		gsize maxpos);
+
+/* Particular implementations, exported for benchmarking */
+gsize rmilter_find_nul_scalar (const guchar *p, gsize len, guint32 *pos,
+		gsize maxpos);
+#ifdef RMILTER_HAS_X86_SIMD
+gsize rmilter_find_nul_sse2 (const guchar *p, gsize len, guint32 *pos,
+		gsize maxpos);
+gsize rmilter_find_nul_avx2 (const guchar *p, gsize len, guint32 *pos,
+		gsize maxpos);
+#endif
+
+#endif
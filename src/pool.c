@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+#include <unistd.h>
+#include "librmilter.h"
+#include "librmilter_internal.h"
+#include "pool.h"
+
+struct rmilter_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Queued tasks linked by their inbox nodes, which are unused until run */
+	struct rmilter_mpsc_node *head;
+	struct rmilter_mpsc_node **tail;
+	gboolean stopping;
+	guint nthreads;
+	pthread_t *threads;
+};
+
+static void *
+rmilter_pool_run (void *arg)
+{
+	struct rmilter_pool *pool = arg;
+	struct rmilter_mpsc_node *n;
+
+	for (;;) {
+		pthread_mutex_lock (&pool->lock);
+
+		while (pool->head == NULL && !pool->stopping) {
+			pthread_cond_wait (&pool->cond, &pool->lock);
+		}
+
+		n = pool->head;
+
+		if (n == NULL) {
+			/* Stopping and all queued tasks are done */
+			pthread_mutex_unlock (&pool->lock);
+			break;
+		}
+
+		pool->head = n->next;
+
+		if (pool->head == NULL) {
+			pool->tail = &pool->head;
+		}
+
+		pthread_mutex_unlock (&pool->lock);
+
+		n->next = NULL;
+		((struct rmilter_task *)n)->run ((struct rmilter_task *)n);
+	}
+
+	return NULL;
+}
+
+void
+rmilter_pool_push (struct rmilter_pool *pool, struct rmilter_task *t)
+{
+	t->node.next = NULL;
+	pthread_mutex_lock (&pool->lock);
+	*pool->tail = &t->node;
+	pool->tail = &t->node.next;
+	pthread_cond_signal (&pool->cond);
+	pthread_mutex_unlock (&pool->lock);
+}
+
+static void
+rmilter_job_run (struct rmilter_task *t)
+{
+	struct rmilter_job *job = (struct rmilter_job *)t;
+
+	job->verdict = job->work (job->arg);
+	/* Session and milter are kept alive by the job */
+	rmilter_inbox_complete (job->s->m->inbox, t);
+}
+
+/*
+ * Delivers result of the job and frees it, called from the loop thread
+ */
+static void
+rmilter_job_done (struct rmilter_task *t)
+{
+	struct rmilter_job *job = (struct rmilter_job *)t;
+	struct rmilter_session *s = job->s, *alive;
+	enum librmilter_reply verdict = job->verdict;
+
+	if (s->job == job) {
+		s->job = NULL;
+	}
+
+	/* Session might have been closed or the message aborted meanwhile */
+	alive = rmilter_pending_session (job->p);
+
+	if (job->finish) {
+		verdict = job->finish (alive, verdict, job->arg);
+	}
+
+	rmilter_session_resume (job->p, verdict);
+
+	if (job->body) {
+		rmilter_body_store_reset (job->body);
+		g_slice_free1 (sizeof (*job->body), job->body);
+	}
+
+	g_slice_free1 (sizeof (*job), job);
+	REF_RELEASE (s);
+}
+
+struct rmilter_pool *
+rmilter_pool_create (unsigned int nthreads)
+{
+	struct rmilter_pool *pool;
+
+#ifdef HAVE_ATOMIC_BUILTINS
+	long ncpu;
+
+	if (nthreads == 0) {
+		ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+		nthreads = ncpu > 0 ? (unsigned int)ncpu : 1;
+	}
+
+	pool = g_malloc0 (sizeof (*pool));
+	pthread_mutex_init (&pool->lock, NULL);
+	pthread_cond_init (&pool->cond, NULL);
+	pool->tail = &pool->head;
+	pool->threads = g_malloc (nthreads * sizeof (*pool->threads));
+
+	for (pool->nthreads = 0; pool->nthreads < nthreads; pool->nthreads ++) {
+		if (pthread_create (&pool->threads[pool->nthreads], NULL,
+				rmilter_pool_run, pool) != 0) {
+			break;
+		}
+	}
+
+	if (pool->nthreads == 0) {
+		rmilter_pool_destroy (pool);
+		pool = NULL;
+	}
+#else
+	/* Results cannot be posted to loops without lock-free queues */
+	pool = NULL;
+#endif
+
+	return pool;
+}
+
+void
+rmilter_pool_destroy (struct rmilter_pool *pool)
+{
+	guint i;
+
+	g_assert (pool != NULL);
+
+	/* Threads exit once the queued jobs are done */
+	pthread_mutex_lock (&pool->lock);
+	pool->stopping = TRUE;
+	pthread_cond_broadcast (&pool->cond);
+	pthread_mutex_unlock (&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i ++) {
+		pthread_join (pool->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy (&pool->lock);
+	pthread_cond_destroy (&pool->cond);
+	g_free (pool->threads);
+	g_free (pool);
+}
+
+bool
+rmilter_set_thread_pool (struct rmilter_milter *milter,
+		struct rmilter_pool *pool)
+{
+	g_assert (milter != NULL);
+
+	if (pool != NULL && milter->inbox == NULL) {
+		milter->inbox = rmilter_inbox_new (milter);
+
+		if (milter->inbox == NULL) {
+			return false;
+		}
+	}
+
+	milter->pool = pool;
+
+	return true;
+}
+
+enum librmilter_reply
+rmilter_session_offload (struct rmilter_session *s, rmilter_work_func work,
+		rmilter_work_finish finish, void *arg)
+{
+	struct rmilter_job *job;
+	enum librmilter_reply verdict;
+
+	if (s->m->pool == NULL) {
+		/* No pool, so work is done in place */
+		verdict = work (arg);
+
+		return finish ? finish (s, verdict, arg) : verdict;
+	}
+
+	if (s->job != NULL) {
+		msg_err_session ("work has been already offloaded, tempfail message");
+
+		return RMILTER_REPLY_TEMPFAIL;
+	}
+
+	job = g_slice_alloc0 (sizeof (*job));
+	job->task.run = rmilter_job_run;
+	job->task.done = rmilter_job_done;
+	job->s = s;
+	job->p = rmilter_session_defer (s);
+	job->work = work;
+	job->finish = finish;
+	job->arg = arg;
+	s->job = job;
+	REF_RETAIN (s);
+
+	rmilter_pool_push (s->m->pool, &job->task);
+
+	return RMILTER_REPLY_PENDING;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBRMILTER_POOL_H
+#define LIBRMILTER_POOL_H
+
+#include "librmilter_compat.h"
+#include "librmilter.h"
+#include "mpsc.h"
+
+struct rmilter_body_store;
+struct rmilter_pool;
+
+/*
+ * Task is run by a pool thread and then, if it is posted to the inbox of a
+ * milter, finished by the milter's loop thread
+ */
+struct rmilter_task {
+	/* Link in the inbox, must be the first member */
+	struct rmilter_mpsc_node node;
+	void (*run) (struct rmilter_task *t);
+	void (*done) (struct rmilter_task *t);
+};
+
+/*
+ * Work offloaded to the thread pool. Job holds a reference to its session
+ * until the result is delivered in the session's loop thread.
+ */
+struct rmilter_job {
+	struct rmilter_task task;
+	struct rmilter_session *s;
+	struct rmilter_pending *p;
+	/* Body of the aborted message that work might still be reading */
+	struct rmilter_body_store *body;
+	rmilter_work_func work;
+	rmilter_work_finish finish;
+	void *arg;
+	enum librmilter_reply verdict;
+};
+
+/**
+ * Queues task to the pool
+ */
+void rmilter_pool_push (struct rmilter_pool *pool, struct rmilter_task *t);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBRMILTER_PROTOCOL_H
+#define LIBRMILTER_PROTOCOL_H
+
+/*
+ * Milter protocol definitions, names are the same as in sendmail's mfdef.h
+ */
+#define SMFI_PROT_VERSION 6
+#define MILTER_LEN_BYTES 4
+#define MILTER_OPTLEN (MILTER_LEN_BYTES * 3)
+#define MILTER_MAX_DATA_SIZE 65535
+#define MILTER_MDS_256K ((256 * 1024) - 1)
+#define MILTER_MDS_1M ((1024 * 1024) - 1)
+
+/* Commands: MTA -> milter */
+#define SMFIC_ABORT 'A'
+#define SMFIC_BODY 'B'
+#define SMFIC_CONNECT 'C'
+#define SMFIC_MACRO 'D'
+#define SMFIC_BODYEOB 'E'
+#define SMFIC_HELO 'H'
+#define SMFIC_QUIT_NC 'K'
+#define SMFIC_HEADER 'L'
+#define SMFIC_MAIL 'M'
+#define SMFIC_EOH 'N'
+#define SMFIC_OPTNEG 'O'
+#define SMFIC_QUIT 'Q'
+#define SMFIC_RCPT 'R'
+#define SMFIC_DATA 'T'
+#define SMFIC_UNKNOWN 'U'
+
+/* Replies: milter -> MTA */
+#define SMFIR_ADDRCPT '+'
+#define SMFIR_DELRCPT '-'
+#define SMFIR_ADDRCPT_PAR '2'
+#define SMFIR_SHUTDOWN '4'
+#define SMFIR_ACCEPT 'a'
+#define SMFIR_REPLBODY 'b'
+#define SMFIR_CONTINUE 'c'
+#define SMFIR_DISCARD 'd'
+#define SMFIR_CHGFROM 'e'
+#define SMFIR_CONN_FAIL 'f'
+#define SMFIR_ADDHEADER 'h'
+#define SMFIR_INSHEADER 'i'
+#define SMFIR_SETSYMLIST 'l'
+#define SMFIR_CHGHEADER 'm'
+#define SMFIR_PROGRESS 'p'
+#define SMFIR_QUARANTINE 'q'
+#define SMFIR_REJECT 'r'
+#define SMFIR_SKIP 's'
+#define SMFIR_TEMPFAIL 't'
+#define SMFIR_REPLYCODE 'y'
+
+/* Stages of symbol lists sent with SMFIR_SETSYMLIST */
+#define SMFIM_CONNECT 0
+#define SMFIM_HELO 1
+#define SMFIM_ENVFROM 2
+#define SMFIM_ENVRCPT 3
+#define SMFIM_DATA 4
+#define SMFIM_EOM 5
+#define SMFIM_EOH 6
+
+/* Connection families */
+#define SMFIA_UNKNOWN 'U'
+#define SMFIA_UNIX 'L'
+#define SMFIA_INET '4'
+#define SMFIA_INET6 '6'
+
+/* Actions that milter may perform */
+#define SMFIF_ADDHDRS 0x00000001L
+#define SMFIF_CHGBODY 0x00000002L
+#define SMFIF_ADDRCPT 0x00000004L
+#define SMFIF_DELRCPT 0x00000008L
+#define SMFIF_CHGHDRS 0x00000010L
+#define SMFIF_QUARANTINE 0x00000020L
+#define SMFIF_CHGFROM 0x00000040L
+#define SMFIF_ADDRCPT_PAR 0x00000080L
+#define SMFIF_SETSYMLIST 0x00000100L
+
+/* Protocol steps */
+#define SMFIP_NOCONNECT 0x00000001L
+#define SMFIP_NOHELO 0x00000002L
+#define SMFIP_NOMAIL 0x00000004L
+#define SMFIP_NORCPT 0x00000008L
+#define SMFIP_NOBODY 0x00000010L
+#define SMFIP_NOHDRS 0x00000020L
+#define SMFIP_NOEOH 0x00000040L
+#define SMFIP_NR_HDR 0x00000080L
+#define SMFIP_NOUNKNOWN 0x00000100L
+#define SMFIP_NODATA 0x00000200L
+#define SMFIP_SKIP 0x00000400L
+#define SMFIP_RCPT_REJ 0x00000800L
+#define SMFIP_NR_CONN 0x00001000L
+#define SMFIP_NR_HELO 0x00002000L
+#define SMFIP_NR_MAIL 0x00004000L
+#define SMFIP_NR_RCPT 0x00008000L
+#define SMFIP_NR_DATA 0x00010000L
+#define SMFIP_NR_UNKN 0x00020000L
+#define SMFIP_NR_EOH 0x00040000L
+#define SMFIP_NR_BODY 0x00080000L
+#define SMFIP_HDR_LEADSPC 0x00100000L
+#define SMFIP_MDS_256K 0x10000000L
+#define SMFIP_MDS_1M 0x20000000L
+
+#endif
@@ -0,0 +1,701 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include "librmilter.h"
+#include "librmilter_internal.h"
+#include "session.h"
+
+/* Maximum number of iovecs written at once, two per reply */
+#define RMILTER_REPLY_IOV 64
+/* Maximum number of reply elements cached per milter */
+#define RMILTER_REPLY_CACHE 256
+/* Payload buffers larger than this are not cached */
+#define RMILTER_REPLY_CACHE_DATA 1024
+
+#define RMILTER_STATIC_FRAME(code) { 0, 0, 0, 1, (code) }
+
+/* Fixed verdicts are sent from read-only preencoded frames */
+static const guchar rmilter_verdict_frames[][RMILTER_CMD_HDR_LEN] = {
+	[RMILTER_REPLY_CONTINUE] = RMILTER_STATIC_FRAME (SMFIR_CONTINUE),
+	[RMILTER_REPLY_REJECT] = RMILTER_STATIC_FRAME (SMFIR_REJECT),
+	[RMILTER_REPLY_DISCARD] = RMILTER_STATIC_FRAME (SMFIR_DISCARD),
+	[RMILTER_REPLY_ACCEPT] = RMILTER_STATIC_FRAME (SMFIR_ACCEPT),
+	[RMILTER_REPLY_TEMPFAIL] = RMILTER_STATIC_FRAME (SMFIR_TEMPFAIL),
+	[RMILTER_REPLY_SKIP] = RMILTER_STATIC_FRAME (SMFIR_SKIP)
+};
+
+#undef RMILTER_STATIC_FRAME
+
+static inline gsize
+rmilter_reply_len (struct rmilter_reply_element *rep)
+{
+	return rep->frame_len + rep->data.len;
+}
+
+static void
+rmilter_reply_code_free (struct rmilter_reply_code *code)
+{
+	g_free (code->frame);
+	g_slice_free1 (sizeof (*code), code);
+}
+
+/*
+ * Takes reply element from the milter's cache if possible
+ */
+static struct rmilter_reply_element *
+rmilter_reply_new (struct rmilter_milter *m, gchar code, gsize len)
+{
+	struct rmilter_reply_element *rep;
+
+	if (m->free_replies) {
+		rep = m->free_replies;
+		LL_DELETE (m->free_replies, rep);
+		m->nfree_replies --;
+	}
+	else {
+		rep = g_slice_alloc0 (sizeof (*rep));
+	}
+
+	rep->hdr[MILTER_LEN_BYTES] = code;
+	rep->frame = rep->hdr;
+	rep->frame_len = sizeof (rep->hdr);
+
+	if (len > 0) {
+		rmilter_buf_reserve (&rep->data, len);
+	}
+
+	return rep;
+}
+
+/*
+ * Returns reply element to the milter's cache
+ */
+static void
+rmilter_reply_free (struct rmilter_milter *m, struct rmilter_reply_element *rep)
+{
+	if (rep->code) {
+		rmilter_reply_code_free (rep->code);
+		rep->code = NULL;
+	}
+
+	if (m->nfree_replies < RMILTER_REPLY_CACHE) {
+		if (rep->data.allocated > RMILTER_REPLY_CACHE_DATA) {
+			rmilter_buf_free (&rep->data);
+		}
+		else {
+			rmilter_buf_reset (&rep->data);
+		}
+
+		rep->written = 0;
+		LL_PREPEND (m->free_replies, rep);
+		m->nfree_replies ++;
+
+		return;
+	}
+
+	rmilter_buf_free (&rep->data);
+	g_slice_free1 (sizeof (*rep), rep);
+}
+
+static void
+rmilter_reply_append_str (struct rmilter_reply_element *rep, const gchar *str)
+{
+	/* Strings are sent with the trailing NUL */
+	rmilter_buf_append (&rep->data, str, strlen (str) + 1);
+}
+
+static void
+rmilter_reply_append_u32 (struct rmilter_reply_element *rep, guint32 val)
+{
+	val = htonl (val);
+	rmilter_buf_append (&rep->data, &val, sizeof (val));
+}
+
+static void
+rmilter_session_queue_reply (struct rmilter_session *s,
+		struct rmilter_reply_element *rep)
+{
+	guint32 netlen;
+
+	/* Length includes the reply code */
+	netlen = htonl (rmilter_reply_len (rep) - MILTER_LEN_BYTES);
+	memcpy (rep->hdr, &netlen, sizeof (netlen));
+	DL_APPEND (s->replies, rep);
+}
+
+/*
+ * Queues reply that is completely encoded in the specified frame, which must
+ * be alive until the reply is written
+ */
+static void
+rmilter_session_queue_frame (struct rmilter_session *s, const guchar *frame,
+		gsize len)
+{
+	struct rmilter_reply_element *rep;
+
+	rep = rmilter_reply_new (s->m, 0, 0);
+	rep->frame = frame;
+	rep->frame_len = len;
+	DL_APPEND (s->replies, rep);
+}
+
+void
+rmilter_session_reply (struct rmilter_session *s, gchar code,
+		const void *data, gsize len)
+{
+	struct rmilter_reply_element *rep;
+
+	rep = rmilter_reply_new (s->m, code, len);
+
+	if (len > 0) {
+		rmilter_buf_append (&rep->data, data, len);
+	}
+
+	rmilter_session_queue_reply (s, rep);
+}
+
+/* Symbol list stage for each bit of `enum rmilter_stage`, -1 if none */
+static const gint rmilter_symlist_stages[RMILTER_NSTAGES] = {
+	SMFIM_CONNECT, SMFIM_HELO, SMFIM_ENVFROM, SMFIM_ENVRCPT, SMFIM_DATA,
+	-1, SMFIM_EOH, -1, -1, SMFIM_EOM
+};
+
+void
+rmilter_session_reply_optneg (struct rmilter_session *s)
+{
+	struct rmilter_reply_element *rep;
+	guint i;
+
+	rep = rmilter_reply_new (s->m, SMFIC_OPTNEG, MILTER_OPTLEN);
+	rmilter_reply_append_u32 (rep, s->version);
+	rmilter_reply_append_u32 (rep, s->actions);
+	rmilter_reply_append_u32 (rep, s->protocol);
+
+	for (i = 0; i < RMILTER_NSTAGES; i ++) {
+		if (s->m->macro_lists[i] == NULL || rmilter_symlist_stages[i] == -1) {
+			continue;
+		}
+
+		if (!(s->actions & SMFIF_SETSYMLIST)) {
+			msg_debug_session ("MTA does not support symbol lists");
+			break;
+		}
+
+		rmilter_reply_append_u32 (rep, rmilter_symlist_stages[i]);
+		rmilter_reply_append_str (rep, s->m->macro_lists[i]);
+	}
+
+	rmilter_session_queue_reply (s, rep);
+}
+
+void
+rmilter_session_send_verdict (struct rmilter_session *s,
+		enum librmilter_reply verdict)
+{
+	struct rmilter_reply_code *code = s->reply_code;
+
+	if (verdict >= G_N_ELEMENTS (rmilter_verdict_frames)) {
+		msg_err_session ("invalid verdict: %d, tempfail message", verdict);
+		verdict = RMILTER_REPLY_TEMPFAIL;
+	}
+
+	if (code != NULL) {
+		/* Reply code is used for the next reject or tempfail only */
+		if ((verdict == RMILTER_REPLY_REJECT && code->rclass == '5') ||
+				(verdict == RMILTER_REPLY_TEMPFAIL && code->rclass == '4')) {
+			s->reply_code = NULL;
+			rmilter_session_queue_frame (s, code->frame, code->len);
+
+			if (!code->cached) {
+				/* Element owns the code now */
+				s->replies->prev->code = code;
+			}
+
+			return;
+		}
+		else if (verdict == RMILTER_REPLY_REJECT ||
+				verdict == RMILTER_REPLY_TEMPFAIL) {
+			msg_warn_session ("reply code %c.. does not match the verdict, "
+					"ignore it", code->rclass);
+		}
+	}
+
+	rmilter_session_queue_frame (s, rmilter_verdict_frames[verdict],
+			sizeof (rmilter_verdict_frames[verdict]));
+}
+
+void
+rmilter_session_free_replies (struct rmilter_session *s)
+{
+	struct rmilter_reply_element *rep, *tmp;
+
+	DL_FOREACH_SAFE (s->replies, rep, tmp) {
+		DL_DELETE (s->replies, rep);
+		rmilter_reply_free (s->m, rep);
+	}
+
+	if (s->reply_code && !s->reply_code->cached) {
+		rmilter_reply_code_free (s->reply_code);
+	}
+
+	s->reply_code = NULL;
+}
+
+void
+rmilter_milter_free_replies (struct rmilter_milter *m)
+{
+	struct rmilter_reply_element *rep, *rtmp;
+	struct rmilter_reply_code *code, *ctmp;
+
+	LL_FOREACH_SAFE (m->free_replies, rep, rtmp) {
+		rmilter_buf_free (&rep->data);
+		g_slice_free1 (sizeof (*rep), rep);
+	}
+
+	LL_FOREACH_SAFE (m->reply_codes, code, ctmp) {
+		rmilter_reply_code_free (code);
+	}
+
+	m->free_replies = NULL;
+	m->nfree_replies = 0;
+	m->reply_codes = NULL;
+}
+
+/*
+ * Encodes SMFIR_REPLYCODE frame: "rcode xcode message"
+ */
+static struct rmilter_reply_code *
+rmilter_reply_code_new (struct rmilter_milter *m, const gchar *rcode,
+		const gchar *xcode, const gchar *message)
+{
+	struct rmilter_reply_code *code;
+	gsize payload_len;
+	guint32 netlen;
+	guchar *p;
+
+	if (rcode == NULL || strlen (rcode) != 3 ||
+			(rcode[0] != '4' && rcode[0] != '5') ||
+			!g_ascii_isdigit (rcode[1]) || !g_ascii_isdigit (rcode[2])) {
+		msg_err_milter ("invalid SMTP reply code: %s", rcode ? rcode : "null");
+
+		return NULL;
+	}
+
+	if (xcode && xcode[0] != rcode[0]) {
+		msg_err_milter ("extended code %s does not match reply code %s",
+				xcode, rcode);
+
+		return NULL;
+	}
+
+	if (message && strpbrk (message, "\r\n") != NULL) {
+		msg_err_milter ("multiline replies are not supported");
+
+		return NULL;
+	}
+
+	/* rcode, optional xcode and message, each followed by a space or NUL */
+	payload_len = 4 + (xcode ? strlen (xcode) + 1 : 0) +
+			(message ? strlen (message) + 1 : 0);
+
+	code = g_slice_alloc0 (sizeof (*code));
+	code->rclass = rcode[0];
+	code->len = RMILTER_CMD_HDR_LEN + payload_len;
+	code->frame = g_malloc (code->len);
+
+	netlen = htonl (payload_len + 1);
+	memcpy (code->frame, &netlen, sizeof (netlen));
+	code->frame[MILTER_LEN_BYTES] = SMFIR_REPLYCODE;
+	p = code->frame + RMILTER_CMD_HDR_LEN;
+	memcpy (p, rcode, 3);
+	p += 3;
+
+	if (xcode) {
+		*p++ = ' ';
+		memcpy (p, xcode, strlen (xcode));
+		p += strlen (xcode);
+	}
+
+	if (message) {
+		*p++ = ' ';
+		memcpy (p, message, strlen (message));
+		p += strlen (message);
+	}
+
+	*p = '\0';
+
+	return code;
+}
+
+struct rmilter_reply_code *
+rmilter_register_reply (struct rmilter_milter *m, const char *rcode,
+		const char *xcode, const char *message)
+{
+	struct rmilter_reply_code *code;
+
+	code = rmilter_reply_code_new (m, rcode, xcode, message);
+
+	if (code) {
+		code->cached = TRUE;
+		LL_PREPEND (m->reply_codes, code);
+	}
+
+	return code;
+}
+
+bool
+rmilter_session_set_reply (struct rmilter_session *s, const char *rcode,
+		const char *xcode, const char *message)
+{
+	struct rmilter_reply_code *code;
+
+	code = rmilter_reply_code_new (s->m, rcode, xcode, message);
+
+	if (code == NULL) {
+		return false;
+	}
+
+	if (s->reply_code && !s->reply_code->cached) {
+		rmilter_reply_code_free (s->reply_code);
+	}
+
+	s->reply_code = code;
+
+	return true;
+}
+
+bool
+rmilter_session_set_cached_reply (struct rmilter_session *s,
+		struct rmilter_reply_code *code)
+{
+	if (code == NULL || !code->cached) {
+		return false;
+	}
+
+	if (s->reply_code && !s->reply_code->cached) {
+		rmilter_reply_code_free (s->reply_code);
+	}
+
+	s->reply_code = code;
+
+	return true;
+}
+
+/*
+ * Gathers as many queued replies as possible to a single writev call
+ */
+void
+rmilter_session_want_write (struct rmilter_session *s)
+{
+	struct rmilter_reply_element *rep;
+	struct iovec iov[RMILTER_REPLY_IOV];
+	gint niov;
+	gsize off, left;
+	gssize r;
+
+	while (s->replies != NULL) {
+		niov = 0;
+
+		DL_FOREACH (s->replies, rep) {
+			if (niov + 2 > RMILTER_REPLY_IOV) {
+				break;
+			}
+
+			/* Merely the first reply could be written partially */
+			off = rep->written;
+
+			if (off < rep->frame_len) {
+				iov[niov].iov_base = (void *)(rep->frame + off);
+				iov[niov].iov_len = rep->frame_len - off;
+				niov ++;
+				off = 0;
+			}
+			else {
+				off -= rep->frame_len;
+			}
+
+			if (rep->data.len > off) {
+				iov[niov].iov_base = rep->data.data + off;
+				iov[niov].iov_len = rep->data.len - off;
+				niov ++;
+			}
+		}
+
+		r = writev (s->fd, iov, niov);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (s->write_ev == NULL) {
+					s->write_ev = s->m->async->add_write (s->m->async->data,
+							s->fd, s);
+
+					if (s->write_ev == NULL) {
+						msg_err_session ("cannot watch socket for writing");
+						rmilter_session_close (s);
+					}
+				}
+
+				return;
+			}
+
+			msg_err_session ("cannot write reply to server: %s",
+					strerror (errno));
+			rmilter_session_close (s);
+
+			return;
+		}
+
+		/* Remove replies that have been written completely */
+		while (r > 0) {
+			rep = s->replies;
+			left = rmilter_reply_len (rep) - rep->written;
+
+			if ((gsize)r >= left) {
+				r -= left;
+				DL_DELETE (s->replies, rep);
+				rmilter_reply_free (s->m, rep);
+			}
+			else {
+				rep->written += r;
+				r = 0;
+			}
+		}
+	}
+
+	if (s->write_ev) {
+		s->m->async->del_write (s->m->async->data, s->write_ev);
+		s->write_ev = NULL;
+	}
+}
+
+/*
+ * Message modification functions
+ */
+
+static gboolean
+rmilter_session_check_action (struct rmilter_session *s, guint32 action,
+		const gchar *what)
+{
+	/*
+	 * Modifications are accepted by the MTA in reply to EOM only: either from
+	 * the `eom` callback, from the finish of the body stream ended by EOM or
+	 * before their deferred verdicts are resumed
+	 */
+	if (s->cmd.cmd != SMFIC_BODYEOB || !(s->eom_called || s->stream_ended) ||
+			s->state == st_closed) {
+		msg_err_session ("cannot %s: message can be modified at the end of "
+				"message only", what);
+
+		return FALSE;
+	}
+
+	if (!(s->actions & action)) {
+		msg_err_session ("cannot %s: action has not been negotiated", what);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+bool
+rmilter_session_add_header (struct rmilter_session *s, const char *name,
+		const char *value)
+{
+	struct rmilter_reply_element *rep;
+
+	if (!rmilter_session_check_action (s, SMFIF_ADDHDRS, "add header")) {
+		return false;
+	}
+
+	rep = rmilter_reply_new (s->m, SMFIR_ADDHEADER, strlen (name) +
+			strlen (value) + 2);
+	rmilter_reply_append_str (rep, name);
+	rmilter_reply_append_str (rep, value);
+	rmilter_session_queue_reply (s, rep);
+
+	return true;
+}
+
+bool
+rmilter_session_insert_header (struct rmilter_session *s, unsigned int idx,
+		const char *name, const char *value)
+{
+	struct rmilter_reply_element *rep;
+
+	if (!rmilter_session_check_action (s, SMFIF_ADDHDRS, "insert header")) {
+		return false;
+	}
+
+	rep = rmilter_reply_new (s->m, SMFIR_INSHEADER, sizeof (guint32) +
+			strlen (name) + strlen (value) + 2);
+	rmilter_reply_append_u32 (rep, idx);
+	rmilter_reply_append_str (rep, name);
+	rmilter_reply_append_str (rep, value);
+	rmilter_session_queue_reply (s, rep);
+
+	return true;
+}
+
+bool
+rmilter_session_change_header (struct rmilter_session *s, const char *name,
+		unsigned int idx, const char *value)
+{
+	struct rmilter_reply_element *rep;
+
+	if (!rmilter_session_check_action (s, SMFIF_CHGHDRS, "change header")) {
+		return false;
+	}
+
+	/* Empty value means header removal */
+	if (value == NULL) {
+		value = "";
+	}
+
+	rep = rmilter_reply_new (s->m, SMFIR_CHGHEADER, sizeof (guint32) +
+			strlen (name) + strlen (value) + 2);
+	rmilter_reply_append_u32 (rep, idx);
+	rmilter_reply_append_str (rep, name);
+	rmilter_reply_append_str (rep, value);
+	rmilter_session_queue_reply (s, rep);
+
+	return true;
+}
+
+bool
+rmilter_session_add_rcpt (struct rmilter_session *s, const char *rcpt,
+		const char *args)
+{
+	struct rmilter_reply_element *rep;
+
+	if (args == NULL) {
+		if (!rmilter_session_check_action (s, SMFIF_ADDRCPT, "add rcpt")) {
+			return false;
+		}
+
+		rep = rmilter_reply_new (s->m, SMFIR_ADDRCPT, strlen (rcpt) + 1);
+		rmilter_reply_append_str (rep, rcpt);
+	}
+	else {
+		if (!rmilter_session_check_action (s, SMFIF_ADDRCPT_PAR, "add rcpt")) {
+			return false;
+		}
+
+		rep = rmilter_reply_new (s->m, SMFIR_ADDRCPT_PAR, strlen (rcpt) +
+				strlen (args) + 2);
+		rmilter_reply_append_str (rep, rcpt);
+		rmilter_reply_append_str (rep, args);
+	}
+
+	rmilter_session_queue_reply (s, rep);
+
+	return true;
+}
+
+bool
+rmilter_session_del_rcpt (struct rmilter_session *s, const char *rcpt)
+{
+	struct rmilter_reply_element *rep;
+
+	if (!rmilter_session_check_action (s, SMFIF_DELRCPT, "delete rcpt")) {
+		return false;
+	}
+
+	rep = rmilter_reply_new (s->m, SMFIR_DELRCPT, strlen (rcpt) + 1);
+	rmilter_reply_append_str (rep, rcpt);
+	rmilter_session_queue_reply (s, rep);
+
+	return true;
+}
+
+bool
+rmilter_session_change_from (struct rmilter_session *s, const char *from,
+		const char *args)
+{
+	struct rmilter_reply_element *rep;
+
+	if (!rmilter_session_check_action (s, SMFIF_CHGFROM, "change from")) {
+		return false;
+	}
+
+	rep = rmilter_reply_new (s->m, SMFIR_CHGFROM, strlen (from) +
+			(args ? strlen (args) + 1 : 0) + 1);
+	rmilter_reply_append_str (rep, from);
+
+	if (args) {
+		rmilter_reply_append_str (rep, args);
+	}
+
+	rmilter_session_queue_reply (s, rep);
+
+	return true;
+}
+
+bool
+rmilter_session_quarantine (struct rmilter_session *s, const char *reason)
+{
+	struct rmilter_reply_element *rep;
+
+	if (!rmilter_session_check_action (s, SMFIF_QUARANTINE, "quarantine")) {
+		return false;
+	}
+
+	rep = rmilter_reply_new (s->m, SMFIR_QUARANTINE, strlen (reason) + 1);
+	rmilter_reply_append_str (rep, reason);
+	rmilter_session_queue_reply (s, rep);
+
+	return true;
+}
+
+bool
+rmilter_session_replace_body (struct rmilter_session *s,
+		const unsigned char *data, size_t len)
+{
+	gsize chunk;
+
+	if (!rmilter_session_check_action (s, SMFIF_CHGBODY, "replace body")) {
+		return false;
+	}
+
+	/* Body is sent by chunks that fit into a command */
+	do {
+		chunk = MIN (len, s->max_data_size);
+		rmilter_session_reply (s, SMFIR_REPLBODY, data, chunk);
+		data += chunk;
+		len -= chunk;
+	} while (len > 0);
+
+	return true;
+}
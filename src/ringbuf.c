@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include "ringbuf.h"
+
+static gsize
+rmilter_ringbuf_round_size (gsize size)
+{
+	gsize pgsize = sysconf (_SC_PAGESIZE), res = pgsize;
+
+	while (res < size) {
+		res <<= 1;
+	}
+
+	return res;
+}
+
+#ifdef HAVE_MEMFD_CREATE
+static gboolean
+rmilter_ringbuf_map_mirrored (struct rmilter_ringbuf *rb, gsize size)
+{
+	guchar *base, *p1, *p2;
+	gint fd;
+
+	fd = memfd_create ("rmilter-ringbuf", MFD_CLOEXEC);
+
+	if (fd == -1) {
+		return FALSE;
+	}
+
+	if (ftruncate (fd, size) == -1) {
+		close (fd);
+
+		return FALSE;
+	}
+
+	/* Reserve address space for both mappings */
+	base = mmap (NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (base == MAP_FAILED) {
+		close (fd);
+
+		return FALSE;
+	}
+
+	p1 = mmap (base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+			fd, 0);
+	p2 = mmap (base + size, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, fd, 0);
+	/* Mappings keep the memory alive */
+	close (fd);
+
+	if (p1 != base || p2 != base + size) {
+		munmap (base, size * 2);
+
+		return FALSE;
+	}
+
+	rb->base = base;
+	rb->mirrored = TRUE;
+
+	return TRUE;
+}
+#endif
+
+gboolean
+rmilter_ringbuf_init (struct rmilter_ringbuf *rb, gsize size)
+{
+	memset (rb, 0, sizeof (*rb));
+	size = rmilter_ringbuf_round_size (size);
+
+#ifdef HAVE_MEMFD_CREATE
+	if (rmilter_ringbuf_map_mirrored (rb, size)) {
+		rb->size = size;
+
+		return TRUE;
+	}
+#endif
+
+	rb->base = g_malloc (size);
+	rb->size = size;
+
+	return TRUE;
+}
+
+void
+rmilter_ringbuf_destroy (struct rmilter_ringbuf *rb)
+{
+	if (rb->base) {
+		if (rb->mirrored) {
+			munmap (rb->base, rb->size * 2);
+		}
+		else {
+			g_free (rb->base);
+		}
+
+		rb->base = NULL;
+	}
+}
+
+guchar *
+rmilter_ringbuf_wptr (struct rmilter_ringbuf *rb, gsize *avail)
+{
+	gsize used = rmilter_ringbuf_used (rb);
+
+	if (rb->mirrored) {
+		*avail = rb->size - used;
+
+		return rb->base + (rb->tail & (rb->size - 1));
+	}
+
+	if (rb->head > 0 && rb->tail == rb->size) {
+		/* Move pending data to the beginning of the buffer */
+		memmove (rb->base, rb->base + rb->head, used);
+		rb->head = 0;
+		rb->tail = used;
+	}
+
+	*avail = rb->size - rb->tail;
+
+	return rb->base + rb->tail;
+}
+
+/*
+ * Returns size class of the buffer or -1 if buffers of this size are not pooled
+ */
+static gint
+rmilter_ringbuf_class (gsize size)
+{
+	gsize pgsize = sysconf (_SC_PAGESIZE);
+	gint cl = 0;
+
+	while (pgsize < size) {
+		pgsize <<= 1;
+		cl ++;
+	}
+
+	return (pgsize == size && cl < RMILTER_RINGBUF_CLASSES) ? cl : -1;
+}
+
+void
+rmilter_ringbuf_pool_get (struct rmilter_ringbuf_pool *pool,
+		struct rmilter_ringbuf *rb, gsize size)
+{
+	gint cl;
+
+	size = rmilter_ringbuf_round_size (size);
+	cl = rmilter_ringbuf_class (size);
+
+	if (cl != -1 && pool->nfree[cl] > 0) {
+		memcpy (rb, &pool->free[cl][-- pool->nfree[cl]], sizeof (*rb));
+
+		return;
+	}
+
+	rmilter_ringbuf_init (rb, size);
+}
+
+void
+rmilter_ringbuf_pool_put (struct rmilter_ringbuf_pool *pool,
+		struct rmilter_ringbuf *rb)
+{
+	gint cl;
+
+	if (rb->base == NULL) {
+		return;
+	}
+
+	cl = rmilter_ringbuf_class (rb->size);
+
+	if (cl != -1 && pool->nfree[cl] < RMILTER_RINGBUF_POOL_MAX) {
+		rb->head = rb->tail = 0;
+		memcpy (&pool->free[cl][pool->nfree[cl] ++], rb, sizeof (*rb));
+		memset (rb, 0, sizeof (*rb));
+	}
+	else {
+		rmilter_ringbuf_destroy (rb);
+	}
+}
+
+void
+rmilter_ringbuf_pool_grow (struct rmilter_ringbuf_pool *pool,
+		struct rmilter_ringbuf *rb, gsize size)
+{
+	struct rmilter_ringbuf nrb;
+	gsize used, avail;
+	guchar *p;
+
+	if (rmilter_ringbuf_round_size (size) <= rb->size) {
+		return;
+	}
+
+	rmilter_ringbuf_pool_get (pool, &nrb, size);
+	used = rmilter_ringbuf_used (rb);
+
+	if (used > 0) {
+		p = rmilter_ringbuf_wptr (&nrb, &avail);
+		memcpy (p, rmilter_ringbuf_rptr (rb), used);
+		rmilter_ringbuf_produce (&nrb, used);
+	}
+
+	rmilter_ringbuf_pool_put (pool, rb);
+	memcpy (rb, &nrb, sizeof (*rb));
+}
+
+void
+rmilter_ringbuf_pool_destroy (struct rmilter_ringbuf_pool *pool)
+{
+	guint cl;
+
+	for (cl = 0; cl < RMILTER_RINGBUF_CLASSES; cl ++) {
+		while (pool->nfree[cl] > 0) {
+			rmilter_ringbuf_destroy (&pool->free[cl][-- pool->nfree[cl]]);
+		}
+	}
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBRMILTER_RINGBUF_H
+#define LIBRMILTER_RINGBUF_H
+
+#include "librmilter_compat.h"
+
+/*
+ * Receive buffer. When possible, the same memory is mapped twice back-to-back,
+ * so any data stored in the ring (and, hence, any command) is available as a
+ * single contiguous slice even if it wraps around the end of the ring.
+ * Otherwise, a linear buffer is used and pending data is moved to its
+ * beginning when there is no space left at the end.
+ */
+struct rmilter_ringbuf {
+	guchar *base;
+	gsize size;
+	guint64 head;
+	guint64 tail;
+	gboolean mirrored;
+};
+
+/* Buffers of page size times powers of two up to this one are pooled */
+#define RMILTER_RINGBUF_CLASSES 12
+/* Maximum number of free buffers of a size class */
+#define RMILTER_RINGBUF_POOL_MAX 64
+
+/*
+ * Free buffers of a milter grouped by size. Sessions borrow a buffer while
+ * they have data to process and return it when they become idle.
+ */
+struct rmilter_ringbuf_pool {
+	struct rmilter_ringbuf
+		free[RMILTER_RINGBUF_CLASSES][RMILTER_RINGBUF_POOL_MAX];
+	guint nfree[RMILTER_RINGBUF_CLASSES];
+};
+
+/**
+ * Initializes ring buffer, size is rounded up to a power of two of pages
+ * @param rb ring buffer
+ * @param size desired size
+ * @return TRUE if buffer has been allocated
+ */
+gboolean rmilter_ringbuf_init (struct rmilter_ringbuf *rb, gsize size);
+
+/**
+ * Releases memory used by a ring buffer
+ */
+void rmilter_ringbuf_destroy (struct rmilter_ringbuf *rb);
+
+/**
+ * Returns contiguous space available for writing
+ * @param rb ring buffer
+ * @param avail number of bytes that could be written
+ * @return pointer to the free space
+ */
+guchar *rmilter_ringbuf_wptr (struct rmilter_ringbuf *rb, gsize *avail);
+
+/**
+ * Releases all buffers of the pool
+ */
+void rmilter_ringbuf_pool_destroy (struct rmilter_ringbuf_pool *pool);
+
+/**
+ * Takes empty buffer of at least `size` bytes from the pool or allocates a new
+ * one
+ * @param pool buffers pool
+ * @param rb ring buffer without memory
+ * @param size desired size
+ */
+void rmilter_ringbuf_pool_get (struct rmilter_ringbuf_pool *pool,
+		struct rmilter_ringbuf *rb, gsize size);
+
+/**
+ * Returns buffer to the pool, stored data is discarded
+ */
+void rmilter_ringbuf_pool_put (struct rmilter_ringbuf_pool *pool,
+		struct rmilter_ringbuf *rb);
+
+/**
+ * Replaces buffer with a larger one from the pool preserving the stored data
+ */
+void rmilter_ringbuf_pool_grow (struct rmilter_ringbuf_pool *pool,
+		struct rmilter_ringbuf *rb, gsize size);
+
+/* Number of bytes stored */
+static inline gsize
+rmilter_ringbuf_used (const struct rmilter_ringbuf *rb)
+{
+	return rb->tail - rb->head;
+}
+
+/* Pointer to the stored data, all `used` bytes are contiguous */
+static inline guchar *
+rmilter_ringbuf_rptr (const struct rmilter_ringbuf *rb)
+{
+	if (rb->mirrored) {
+		return rb->base + (rb->head & (rb->size - 1));
+	}
+
+	return rb->base + rb->head;
+}
+
+/* Marks `len` bytes written to the space returned by `wptr` as stored */
+static inline void
+rmilter_ringbuf_produce (struct rmilter_ringbuf *rb, gsize len)
+{
+	rb->tail += len;
+}
+
+/* Discards `len` bytes from the beginning of the stored data */
+static inline void
+rmilter_ringbuf_consume (struct rmilter_ringbuf *rb, gsize len)
+{
+	rb->head += len;
+
+	if (!rb->mirrored && rb->head == rb->tail) {
+		rb->head = rb->tail = 0;
+	}
+}
+
+#endif
@@ -28,129 +28,1362 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
 #include "librmilter.h"
 #include "librmilter_internal.h"
 #include "session.h"
+#include "nulsplit.h"
 
+/*
+ * Fills session arguments array with pointers to NUL terminated strings
+ * within the command data, unterminated trailing garbage is ignored
+ */
+static guint
+rmilter_session_split_args (struct rmilter_session *s, const guchar *data,
+		gsize len)
+{
+	guint32 nuls[64];
+	gsize off = 0, start = 0, i, n;
+
+	rmilter_ptrs_reset (&s->args);
+
+	while (off < len) {
+		n = rmilter_find_nul (data + off, len - off, nuls, G_N_ELEMENTS (nuls));
+
+		if (n == 0) {
+			break;
+		}
+
+		for (i = 0; i < n; i ++) {
+			rmilter_ptrs_add (&s->args, (const gchar *)(data + start));
+			start = off + nuls[i] + 1;
+		}
+
+		off = start;
+	}
+
+	return s->args.len;
+}
+
+/*
+ * Returns split arguments in the form they are passed to callbacks
+ */
+static inline struct rmilter_args
+rmilter_session_args (struct rmilter_session *s)
+{
+	struct rmilter_args args;
+
+	args.argv = (const char *const *)s->args.pdata;
+	args.argc = s->args.len;
+
+	return args;
+}
+
+/* Command and protocol step flags for each stage, in order of stage bits */
+static const struct rmilter_stage_flags {
+	enum rmilter_stage stage;
+	gchar cmd;
+	guint32 nostep;
+	guint32 noreply;
+} rmilter_stages[] = {
+	{RMILTER_STAGE_CONNECT, SMFIC_CONNECT, SMFIP_NOCONNECT, SMFIP_NR_CONN},
+	{RMILTER_STAGE_HELO, SMFIC_HELO, SMFIP_NOHELO, SMFIP_NR_HELO},
+	{RMILTER_STAGE_MAIL, SMFIC_MAIL, SMFIP_NOMAIL, SMFIP_NR_MAIL},
+	{RMILTER_STAGE_RCPT, SMFIC_RCPT, SMFIP_NORCPT, SMFIP_NR_RCPT},
+	{RMILTER_STAGE_DATA, SMFIC_DATA, SMFIP_NODATA, SMFIP_NR_DATA},
+	{RMILTER_STAGE_HEADER, SMFIC_HEADER, SMFIP_NOHDRS, SMFIP_NR_HDR},
+	{RMILTER_STAGE_EOH, SMFIC_EOH, SMFIP_NOEOH, SMFIP_NR_EOH},
+	{RMILTER_STAGE_BODY, SMFIC_BODY, SMFIP_NOBODY, SMFIP_NR_BODY},
+	{RMILTER_STAGE_UNKNOWN, SMFIC_UNKNOWN, SMFIP_NOUNKNOWN, SMFIP_NR_UNKN},
+	{RMILTER_STAGE_EOM, SMFIC_BODYEOB, 0, 0},
+};
+
+/*
+ * Returns stages that milter has no interest in: such stages are not sent
+ * by the MTA or, if it cannot skip them, are not replied
+ */
+static guint
+rmilter_session_unused_stages (struct rmilter_session *s)
+{
+	struct rmilter_callbacks *cb = s->m->cb;
+	guint stages = 0;
+
+	if (cb->connect == NULL) {
+		stages |= RMILTER_STAGE_CONNECT;
+	}
+	if (cb->hello == NULL) {
+		stages |= RMILTER_STAGE_HELO;
+	}
+	if (cb->envfrom == NULL) {
+		stages |= RMILTER_STAGE_MAIL;
+	}
+	if (cb->envrcpt == NULL) {
+		stages |= RMILTER_STAGE_RCPT;
+	}
+	if (cb->data == NULL) {
+		stages |= RMILTER_STAGE_DATA;
+	}
+	if (cb->header == NULL) {
+		stages |= RMILTER_STAGE_HEADER;
+	}
+	if (cb->eoh == NULL) {
+		stages |= RMILTER_STAGE_EOH;
+	}
+	/* Body is still needed if we store it */
+	if (cb->body == NULL && !s->m->body_store) {
+		stages |= RMILTER_STAGE_BODY;
+	}
+	if (cb->unknown == NULL) {
+		stages |= RMILTER_STAGE_UNKNOWN;
+	}
+
+	return stages;
+}
+
+static guint32
+rmilter_session_protocol_steps (struct rmilter_session *s, guint32 offered)
+{
+	guint unused, noreply, i;
+	guint32 steps = 0;
+
+	unused = rmilter_session_unused_stages (s);
+	noreply = unused | s->m->noreply_stages;
+
+	/* Body store may need to report an error and sampling needs skip */
+	if (s->m->body_store || s->m->body_sample > 0) {
+		noreply &= ~RMILTER_STAGE_BODY;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (rmilter_stages); i ++) {
+		if (unused & rmilter_stages[i].stage) {
+			steps |= rmilter_stages[i].nostep;
+		}
+		if (noreply & rmilter_stages[i].stage) {
+			steps |= rmilter_stages[i].noreply;
+		}
+	}
+
+	if (!(unused & RMILTER_STAGE_BODY)) {
+		steps |= SMFIP_SKIP;
+	}
+
+	/* We cannot ask for something the MTA cannot do */
+	return steps & offered;
+}
+
+/*
+ * Returns TRUE if MTA does not wait for reply to the current command
+ */
+static gboolean
+rmilter_session_is_noreply (struct rmilter_session *s)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (rmilter_stages); i ++) {
+		if (rmilter_stages[i].cmd == s->cmd.cmd) {
+			return (s->protocol & rmilter_stages[i].noreply) != 0;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Sends verdict for a stage unless MTA was told not to wait for it
+ */
+static void
+rmilter_session_stage_verdict (struct rmilter_session *s,
+		enum librmilter_reply ret)
+{
+	if (ret == RMILTER_REPLY_SKIP && s->cmd.cmd != SMFIC_BODY) {
+		msg_warn_session ("skip is not allowed for command '%c'", s->cmd.cmd);
+		ret = RMILTER_REPLY_CONTINUE;
+	}
+
+	if (rmilter_session_is_noreply (s)) {
+		if (ret != RMILTER_REPLY_CONTINUE) {
+			msg_warn_session ("verdict %d ignored for no reply command '%c'",
+					(gint)ret, s->cmd.cmd);
+		}
+
+		return;
+	}
+
+	rmilter_session_send_verdict (s, ret);
+}
+
+static gboolean
+rmilter_session_optneg (struct rmilter_session *s, const guchar *data,
+		gsize len)
+{
+	guint32 version, actions, protocol;
+
+	if (len < MILTER_OPTLEN) {
+		return FALSE;
+	}
+
+	memcpy (&version, data, sizeof (version));
+	memcpy (&actions, data + MILTER_LEN_BYTES, sizeof (actions));
+	memcpy (&protocol, data + MILTER_LEN_BYTES * 2, sizeof (protocol));
+	version = ntohl (version);
+	actions = ntohl (actions);
+	protocol = ntohl (protocol);
+
+	if (version < 2) {
+		msg_err_session ("unsupported protocol version: %u", version);
+		return FALSE;
+	}
+
+	s->version = MIN (version, SMFI_PROT_VERSION);
+	/* We request all actions allowed and only protocol steps we need */
+	s->actions = actions;
+	s->protocol = rmilter_session_protocol_steps (s, protocol);
+
+	/* Larger commands are used if both MTA and milter want them */
+	if (s->m->max_data_size >= MILTER_MDS_1M && (protocol & SMFIP_MDS_1M)) {
+		s->protocol |= SMFIP_MDS_1M;
+		s->max_data_size = MILTER_MDS_1M;
+	}
+	else if (s->m->max_data_size >= MILTER_MDS_256K &&
+			(protocol & SMFIP_MDS_256K)) {
+		s->protocol |= SMFIP_MDS_256K;
+		s->max_data_size = MILTER_MDS_256K;
+	}
+
+	msg_debug_session ("negotiated version %u, actions: %x, protocol: %x",
+			s->version, s->actions, s->protocol);
+
+	rmilter_session_reply_optneg (s);
+
+	return TRUE;
+}
+
+/*
+ * Forgets macros and other data of the current message
+ */
+static void
+rmilter_session_message_free (struct rmilter_session *s)
+{
+	guint stage;
+
+	for (stage = RMILTER_MACRO_CONN_STAGES; stage < RMILTER_MACRO_STAGES;
+			stage ++) {
+		rmilter_macro_set_drop (&s->cold->macros, stage);
+	}
+
+	rmilter_arena_reset (&s->cold->msg_arena);
+}
+
+static gboolean
+rmilter_session_macros (struct rmilter_session *s, const guchar *data,
+		gsize len)
+{
+	struct rmilter_arena *arena;
+	const gchar *name, *value;
+	guint i, nargs, stage;
+	gint id;
+
+	/* The first byte is the command that macros are defined for */
+	if (len < 1) {
+		return FALSE;
+	}
+
+	stage = rmilter_macro_stage (data[0]);
+
+	if (stage < RMILTER_MACRO_CONN_STAGES) {
+		arena = &s->cold->arena;
+	}
+	else {
+		if (data[0] == SMFIC_MAIL) {
+			/* Macros of envelope sender start a new message */
+			rmilter_session_message_free (s);
+		}
+
+		arena = &s->cold->msg_arena;
+	}
+
+	/* New definitions replace all macros previously sent for the command */
+	rmilter_macro_set_drop (&s->cold->macros, stage);
+	nargs = rmilter_session_split_args (s, data + 1, len - 1);
+
+	for (i = 0; i + 1 < nargs; i += 2) {
+		name = s->args.pdata[i];
+		value = s->args.pdata[i + 1];
+		id = rmilter_macro_names_find (&s->m->macro_names, name,
+				strlen (name), TRUE);
+
+		if (id == -1) {
+			msg_debug_session ("too many macro names, ignore macro %s", name);
+			continue;
+		}
+
+		rmilter_macro_set_put (&s->cold->macros, id, stage,
+				rmilter_arena_strndup (arena, value, strlen (value)));
+	}
+
+	return TRUE;
+}
+
+static void
+rmilter_session_reset_macros (struct rmilter_session *s)
+{
+	rmilter_macro_set_clear (&s->cold->macros);
+	rmilter_arena_reset (&s->cold->arena);
+	rmilter_arena_reset (&s->cold->msg_arena);
+}
+
+static gboolean
+rmilter_session_parse_connect (struct rmilter_session *s,
+		const guchar *data, gsize len,
+		const gchar **hostname, struct rmilter_addr *addr)
+{
+	const guchar *p = data, *end = data + len, *c;
+	const gchar *addrstr;
+	guint16 port;
+	gchar family;
+
+	memset (addr, 0, sizeof (*addr));
+	c = memchr (p, '\0', len);
+
+	if (c == NULL || c + 1 >= end) {
+		return FALSE;
+	}
+
+	*hostname = (const gchar *)p;
+	p = c + 1;
+	family = *p++;
+
+	if (family == SMFIA_UNKNOWN) {
+		addr->type = RMILTER_ADDR_UNKNOWN;
+		return TRUE;
+	}
+
+	if (end - p < (gssize)sizeof (port)) {
+		return FALSE;
+	}
+
+	memcpy (&port, p, sizeof (port));
+	addr->port = ntohs (port);
+	p += sizeof (port);
+
+	if (memchr (p, '\0', end - p) == NULL) {
+		return FALSE;
+	}
+
+	addrstr = (const gchar *)p;
+
+	switch (family) {
+	case SMFIA_INET:
+		addr->type = RMILTER_ADDR_IP4;
+
+		if (inet_pton (AF_INET, addrstr, &addr->addr.ip4) != 1) {
+			msg_warn_session ("bad inet address: %s", addrstr);
+			addr->type = RMILTER_ADDR_UNKNOWN;
+		}
+		break;
+	case SMFIA_INET6:
+		addr->type = RMILTER_ADDR_IP6;
+
+		/* Sendmail prefixes IPv6 addresses */
+		if (strncasecmp (addrstr, "IPv6:", sizeof ("IPv6:") - 1) == 0) {
+			addrstr += sizeof ("IPv6:") - 1;
+		}
+
+		if (inet_pton (AF_INET6, addrstr, addr->addr.ip6) != 1) {
+			msg_warn_session ("bad inet6 address: %s", addrstr);
+			addr->type = RMILTER_ADDR_UNKNOWN;
+		}
+		break;
+	case SMFIA_UNIX:
+		addr->type = RMILTER_ADDR_UNIX;
+		addr->addr.path = addrstr;
+		break;
+	default:
+		msg_warn_session ("unknown address family: %c", family);
+		addr->type = RMILTER_ADDR_UNKNOWN;
+		break;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Drops per-message state
+ */
+void
+rmilter_session_message_reset (struct rmilter_session *s)
+{
+	if (s->job) {
+		/* Work might be still reading body, so job owns it now */
+		s->job->body = s->body;
+		s->body = NULL;
+		s->job = NULL;
+	}
+
+	if (s->stream) {
+		rmilter_stream_cancel (s->stream);
+		s->stream = NULL;
+	}
+
+	if (s->body) {
+		rmilter_body_store_reset (s->body);
+	}
+
+	s->body_seen = 0;
+	s->body_skipped = FALSE;
+	s->stream_ended = FALSE;
+	s->eom_called = FALSE;
+}
+
+static enum librmilter_reply
+rmilter_session_body_chunk (struct rmilter_session *s, guchar *data,
+		gsize len)
+{
+	enum librmilter_reply ret = RMILTER_REPLY_CONTINUE;
+	gsize sample = s->m->body_sample;
+
+	if (s->body_skipped) {
+		/* MTA cannot skip body, so we just ignore it */
+		return RMILTER_REPLY_CONTINUE;
+	}
+
+	if (sample > 0) {
+		len = MIN (len, sample - s->body_seen);
+	}
+
+	s->body_seen += len;
+
+	if (s->m->body_store) {
+		if (s->body == NULL) {
+			s->body = g_slice_alloc (sizeof (*s->body));
+			rmilter_body_store_init (s->body, s->m->body_spill_threshold);
+		}
+
+		if (!rmilter_body_store_append (s->body, data, len)) {
+			msg_err_session ("cannot store body chunk: %s", strerror (errno));
+
+			return RMILTER_REPLY_TEMPFAIL;
+		}
+	}
+
+	if (s->stream) {
+		rmilter_stream_push (s->stream, data, len);
+	}
+
+	if (s->m->cb->body) {
+		ret = s->m->cb->body (s, s->ud, data, len);
+	}
+
+	return ret;
+}
+
+/*
+ * Applies body sampling and skip policy to the body callback verdict
+ */
+static enum librmilter_reply
+rmilter_session_body_verdict (struct rmilter_session *s,
+		enum librmilter_reply ret)
+{
+	gsize sample = s->m->body_sample;
+
+	if (s->body_skipped) {
+		return RMILTER_REPLY_CONTINUE;
+	}
+
+	if (ret == RMILTER_REPLY_CONTINUE && sample > 0 && s->body_seen >= sample) {
+		msg_debug_session ("body sample of %zu bytes is collected", sample);
+		ret = RMILTER_REPLY_SKIP;
+	}
+
+	if (ret == RMILTER_REPLY_SKIP) {
+		s->body_skipped = TRUE;
+
+		if (!(s->protocol & SMFIP_SKIP)) {
+			ret = RMILTER_REPLY_CONTINUE;
+		}
+	}
+
+	return ret;
+}
+
+static void
+rmilter_session_progress (void *arg)
+{
+	struct rmilter_session *s = arg;
+
+	msg_debug_session ("verdict is still pending, send progress");
+	rmilter_session_reply (s, SMFIR_PROGRESS, NULL, 0);
+	rmilter_milter_arm_timer (s->m, &s->progress_timer,
+			s->m->progress_interval);
+
+	if (s->write_ev == NULL) {
+		rmilter_session_want_write (s);
+	}
+}
+
+/*
+ * Notifies the owner of the pending verdict that it is not needed anymore
+ */
+static void
+rmilter_session_cancel (struct rmilter_session *s,
+		enum rmilter_cancel_reason reason)
+{
+	struct rmilter_pending *p = s->pending;
+
+	if (p == NULL) {
+		return;
+	}
+
+	s->pending = NULL;
+	p->s = NULL;
+
+	/* Handle might be resumed and freed from the callback */
+	if (p->cancel) {
+		p->cancel (p, reason, p->cancel_ud);
+	}
+}
+
+static void rmilter_session_complete (struct rmilter_session *s,
+		enum librmilter_reply verdict);
+
+static void
+rmilter_session_deadline (void *arg)
+{
+	struct rmilter_session *s = arg;
+
+	if (s->state != st_wait_verdict) {
+		return;
+	}
+
+	msg_info_session ("time budget for command '%c' is over, tempfail it",
+			s->cmd.cmd);
+	rmilter_session_cancel (s, RMILTER_CANCEL_TIMEOUT);
+	rmilter_session_complete (s, RMILTER_REPLY_TEMPFAIL);
+}
+
+/*
+ * Stops processing commands until the pending verdict is resolved
+ */
+static void
+rmilter_session_suspend (struct rmilter_session *s)
+{
+	struct rmilter_milter *m = s->m;
+	gdouble left;
+
+	/* Socket is still read to notice abort or quit sent by the MTA */
+	s->state = st_wait_verdict;
+	rmilter_wheel_cancel (&m->wheel, &s->io_timer);
+
+	if (!rmilter_wheel_timer_armed (&s->deadline_timer) &&
+			s->stage_deadline != 0) {
+		left = (s->stage_deadline - g_get_monotonic_time ()) / 1e6;
+		rmilter_milter_arm_timer (m, &s->deadline_timer, left);
+	}
+
+	/* Keep MTA from timing out, progress is supported since version 6 */
+	if (!rmilter_wheel_timer_armed (&s->progress_timer) && s->version >= 6 &&
+			m->progress_interval > 0 && !rmilter_session_is_noreply (s)) {
+		rmilter_milter_arm_timer (m, &s->progress_timer, m->progress_interval);
+	}
+}
+
+static void
+rmilter_session_wakeup (struct rmilter_session *s)
+{
+	struct rmilter_async_context *async = s->m->async;
+
+	rmilter_wheel_cancel (&s->m->wheel, &s->progress_timer);
+	rmilter_wheel_cancel (&s->m->wheel, &s->deadline_timer);
+
+	/* Reading might be stopped if the buffer is full */
+	if (s->read_ev) {
+		async->start_event (async->data, s->read_ev);
+	}
+
+	rmilter_milter_arm_timer (s->m, &s->io_timer, s->m->io_timeout);
+}
+
+/*
+ * Handles verdict returned by the callback for the current command
+ */
+static void
+rmilter_session_stage_done (struct rmilter_session *s,
+		enum librmilter_reply ret)
+{
+	struct rmilter_callbacks *cb = s->m->cb;
+
+	if (ret == RMILTER_REPLY_PENDING) {
+		if (s->resumed) {
+			/* Resolved before the callback has returned */
+			s->resumed = FALSE;
+			ret = s->resumed_verdict;
+		}
+		else if (s->pending) {
+			rmilter_session_suspend (s);
+
+			return;
+		}
+		else {
+			msg_err_session ("pending verdict without a deferred handle, "
+					"tempfail message");
+			ret = RMILTER_REPLY_TEMPFAIL;
+		}
+	}
+	else if (s->pending || s->resumed) {
+		/* Callback has deferred verdict but returned it synchronously */
+		msg_warn_session ("deferred handle is ignored for command '%c'",
+				s->cmd.cmd);
+
+		if (s->pending) {
+			s->pending->s = NULL;
+			s->pending = NULL;
+		}
+
+		s->resumed = FALSE;
+	}
+
+	switch (s->cmd.cmd) {
+	case SMFIC_BODY:
+		ret = rmilter_session_body_verdict (s, ret);
+		break;
+	case SMFIC_BODYEOB:
+		if (!s->eom_called) {
+			if (!s->stream_ended) {
+				/* Verdict for the last body chunk */
+				ret = rmilter_session_body_verdict (s, ret);
+
+				if (ret == RMILTER_REPLY_CONTINUE && s->stream) {
+					/* Wait for the consumer of body */
+					s->stream_ended = TRUE;
+					ret = rmilter_stream_end (s->stream);
+					s->stream = NULL;
+					rmilter_session_stage_done (s, ret);
+
+					return;
+				}
+			}
+
+			if (ret == RMILTER_REPLY_SKIP) {
+				ret = RMILTER_REPLY_CONTINUE;
+			}
+
+			if (ret == RMILTER_REPLY_CONTINUE && cb->eom) {
+				s->eom_called = TRUE;
+				rmilter_session_stage_done (s, cb->eom (s, s->ud));
+
+				return;
+			}
+		}
+
+		rmilter_session_stage_verdict (s, ret);
+		rmilter_session_message_reset (s);
+		rmilter_session_message_free (s);
+
+		return;
+	default:
+		break;
+	}
+
+	rmilter_session_stage_verdict (s, ret);
+}
+
+/*
+ * Starts time budget for the stage of the command
+ */
+static void
+rmilter_session_start_stage (struct rmilter_session *s, gchar cmd)
+{
+	guint i;
+
+	s->stage_deadline = 0;
+
+	for (i = 0; i < G_N_ELEMENTS (rmilter_stages); i ++) {
+		if (rmilter_stages[i].cmd == cmd) {
+			if (s->m->stage_timeouts[i] > 0) {
+				s->stage_deadline = g_get_monotonic_time () +
+						(gint64)(s->m->stage_timeouts[i] * 1e6);
+			}
+
+			break;
+		}
+	}
+}
+
+/*
+ * Processes a complete command, all arguments passed to callbacks point to
+ * the command data
+ */
 static void
-rmilter_session_state_machine (struct rmilter_session *s, gssize rlen)
+rmilter_session_dispatch (struct rmilter_session *s, gchar cmd,
+		guchar *data, gsize len)
 {
-	guchar *p = s->cmd_buf->data, *end;
-	gssize to_copy;
+	struct rmilter_callbacks *cb = s->m->cb;
+	enum librmilter_reply ret = RMILTER_REPLY_CONTINUE;
+	struct rmilter_addr addr;
+	struct rmilter_args args;
+	const gchar *hostname;
 
-	end = p + rlen;
+	msg_debug_session ("got command '%c', %zu bytes", cmd, len);
+	rmilter_session_start_stage (s, cmd);
 
-	while (p < end) {
-		switch (s->state) {
-		case st_read_cmd:
-			s->cmd.cmd = *p;
-			s->state = st_len_1;
-			s->cmd.cmdlen = 0;
-			g_byte_array_set_size (s->cmd.data, 0);
-			p ++;
-			break;
-		case st_len_1:
-			/* The first length byte in big endian order */
-			s->cmd.cmdlen |= *p << 24;
-			s->state = st_len_2;
-			p++;
+	switch (cmd) {
+	case SMFIC_OPTNEG:
+		if (!rmilter_session_optneg (s, data, len)) {
+			goto err;
+		}
+		break;
+	case SMFIC_MACRO:
+		if (!rmilter_session_macros (s, data, len)) {
+			goto err;
+		}
+		break;
+	case SMFIC_CONNECT:
+		if (!rmilter_session_parse_connect (s, data, len, &hostname, &addr)) {
+			goto err;
+		}
+
+		if (cb->connect) {
+			ret = cb->connect (s, s->ud, hostname, &addr);
+		}
+
+		rmilter_session_stage_done (s, ret);
+		break;
+	case SMFIC_HELO:
+		if (rmilter_session_split_args (s, data, len) < 1) {
+			goto err;
+		}
+
+		if (cb->hello) {
+			ret = cb->hello (s, s->ud, s->args.pdata[0]);
+		}
+
+		rmilter_session_stage_done (s, ret);
+		break;
+	case SMFIC_MAIL:
+		if (rmilter_session_split_args (s, data, len) < 1) {
+			goto err;
+		}
+
+		/* New message in the same connection */
+		rmilter_session_message_reset (s);
+
+		if (cb->envfrom) {
+			args = rmilter_session_args (s);
+			ret = cb->envfrom (s, s->ud, &args);
+		}
+
+		rmilter_session_stage_done (s, ret);
+		break;
+	case SMFIC_RCPT:
+		if (rmilter_session_split_args (s, data, len) < 1) {
+			goto err;
+		}
+
+		if (cb->envrcpt) {
+			args = rmilter_session_args (s);
+			ret = cb->envrcpt (s, s->ud, &args);
+		}
+
+		rmilter_session_stage_done (s, ret);
+		break;
+	case SMFIC_DATA:
+		if (cb->data) {
+			ret = cb->data (s, s->ud);
+		}
+
+		rmilter_session_stage_done (s, ret);
+		break;
+	case SMFIC_HEADER:
+		if (rmilter_session_split_args (s, data, len) < 2) {
+			goto err;
+		}
+
+		if (cb->header) {
+			ret = cb->header (s, s->ud, s->args.pdata[0],
+					s->args.pdata[1]);
+		}
+
+		rmilter_session_stage_done (s, ret);
+		break;
+	case SMFIC_EOH:
+		if (cb->eoh) {
+			ret = cb->eoh (s, s->ud);
+		}
+
+		rmilter_session_stage_done (s, ret);
+		break;
+	case SMFIC_BODY:
+		ret = rmilter_session_body_chunk (s, data, len);
+		rmilter_session_stage_done (s, ret);
+		break;
+	case SMFIC_BODYEOB:
+		/* End of body command may contain the last body chunk */
+		if (len > 0) {
+			ret = rmilter_session_body_chunk (s, data, len);
+		}
+
+		rmilter_session_stage_done (s, ret);
+		break;
+	case SMFIC_UNKNOWN:
+		if (rmilter_session_split_args (s, data, len) < 1) {
+			goto err;
+		}
+
+		if (cb->unknown) {
+			ret = cb->unknown (s, s->ud, s->args.pdata[0]);
+		}
+
+		rmilter_session_stage_done (s, ret);
+		break;
+	case SMFIC_ABORT:
+		/* Message is aborted, no reply is expected */
+		if (cb->abort) {
+			cb->abort (s, s->ud);
+		}
+
+		rmilter_session_message_reset (s);
+		rmilter_session_message_free (s);
+		break;
+	case SMFIC_QUIT_NC:
+		/* Connection is closed but MTA reuses the session for a new one */
+		if (cb->close) {
+			cb->close (s, s->ud);
+		}
+
+		rmilter_session_reset_macros (s);
+		rmilter_session_message_reset (s);
+		break;
+	case SMFIC_QUIT:
+		/* Flush replies for the commands preceding quit */
+		if (s->replies) {
+			rmilter_session_want_write (s);
+		}
+
+		rmilter_session_close (s);
+		break;
+	default:
+		msg_err_session ("unknown command: '%c'", cmd);
+		rmilter_session_close (s);
+		break;
+	}
+
+	return;
+
+err:
+	msg_err_session ("malformed command '%c' of length %zu", cmd, len);
+	rmilter_session_close (s);
+}
+
+/*
+ * Decodes command header, sets command and its payload length
+ */
+static gboolean
+rmilter_session_decode_hdr (struct rmilter_session *s, const guchar *hdr)
+{
+	guint32 len;
+
+	memcpy (&len, hdr, sizeof (len));
+	len = ntohl (len);
+
+	/* Length includes the command byte */
+	if (len == 0 || len - 1 > s->max_data_size) {
+		msg_err_session ("invalid command length: %u", len);
+		rmilter_session_close (s);
+
+		return FALSE;
+	}
+
+	s->cmd.cmd = hdr[MILTER_LEN_BYTES];
+	s->cmd.cmdlen = len - 1;
+
+	return TRUE;
+}
+
+/*
+ * Dispatches all complete commands from the receive buffer in place, partial
+ * commands are left in the buffer until the rest is read
+ */
+static void
+rmilter_session_state_machine (struct rmilter_session *s)
+{
+	guchar *p;
+	gsize avail;
+
+	while (s->state == st_read_cmd) {
+		avail = rmilter_ringbuf_used (&s->rbuf);
+
+		if (avail < RMILTER_CMD_HDR_LEN) {
 			break;
-		case st_len_2:
-			/* The second length byte in big endian order */
-			s->cmd.cmdlen |= *p << 16;
-			s->state = st_len_3;
-			p++;
+		}
+
+		p = rmilter_ringbuf_rptr (&s->rbuf);
+
+		if (!rmilter_session_decode_hdr (s, p)) {
 			break;
-		case st_len_3:
-			/* The third length byte in big endian order */
-			s->cmd.cmdlen |= *p << 8;
-			s->state = st_len_4;
-			p++;
+		}
+
+		if (avail - RMILTER_CMD_HDR_LEN < s->cmd.cmdlen) {
 			break;
-		case st_len_4:
-			/* The fourth length byte in big endian order */
-			s->cmd.cmdlen |= *p;
-			s->state = st_read_data;
-			p++;
+		}
+
+		if (s->stream && (s->cmd.cmd == SMFIC_BODY ||
+				s->cmd.cmd == SMFIC_BODYEOB) &&
+				rmilter_stream_full (s->stream) &&
+				rmilter_stream_pause (s->stream)) {
+			/* Consumer of body is behind, so stop reading from the MTA */
+			msg_debug_session ("body stream is full, pause reading");
+			s->stream_paused = TRUE;
+			s->m->async->stop_event (s->m->async->data, s->read_ev);
+			rmilter_wheel_cancel (&s->m->wheel, &s->io_timer);
+
 			break;
-		case st_read_data:
-			to_copy = MIN (s->cmd.cmdlen, end - p);
+		}
 
-			if (to_copy > 0) {
-				g_byte_array_append (s->cmd.data, p, to_copy);
-				p += to_copy;
-			}
+		rmilter_session_dispatch (s, s->cmd.cmd, p + RMILTER_CMD_HDR_LEN,
+				s->cmd.cmdlen);
 
-			/* Check if we have read the complete command */
-			if (s->cmd.cmdlen == s->cmd.data->len) {
-				g_byte_array_set_size (s->cmd.data, 0);
-				/* Read the next command */
-				s->state = st_read_cmd;
+		if (s->state != st_closed) {
+			/* Pending command is not needed for the verdict anymore */
+			rmilter_ringbuf_consume (&s->rbuf,
+					RMILTER_CMD_HDR_LEN + s->cmd.cmdlen);
+
+			/* Larger commands might have been negotiated */
+			if (s->rbuf.size < RMILTER_RBUF_SIZE (s->max_data_size)) {
+				rmilter_ringbuf_pool_grow (&s->m->rbufs, &s->rbuf,
+						RMILTER_RBUF_SIZE (s->max_data_size));
 			}
-			break;
+		}
+	}
+}
+
+/*
+ * Looks for commands that cancel the pending verdict in the unprocessed data
+ */
+static gchar
+rmilter_session_peek_cancel (struct rmilter_session *s)
+{
+	const guchar *p;
+	gsize used, off = 0;
+	guint32 len;
+
+	p = rmilter_ringbuf_rptr (&s->rbuf);
+	used = rmilter_ringbuf_used (&s->rbuf);
+
+	while (used - off >= RMILTER_CMD_HDR_LEN) {
+		memcpy (&len, p + off, sizeof (len));
+		len = ntohl (len);
+
+		switch (p[off + MILTER_LEN_BYTES]) {
+		case SMFIC_ABORT:
+		case SMFIC_QUIT:
+		case SMFIC_QUIT_NC:
+			return p[off + MILTER_LEN_BYTES];
 		default:
 			break;
 		}
+
+		if (len == 0 || len - 1 > s->max_data_size) {
+			/* Garbage is handled by the state machine */
+			break;
+		}
+
+		off += MILTER_LEN_BYTES + len;
+	}
+
+	return 0;
+}
+
+/*
+ * Processes buffered commands and sends replies
+ */
+static void
+rmilter_session_process (struct rmilter_session *s)
+{
+	gchar cmd;
+
+	for (;;) {
+		rmilter_session_state_machine (s);
+
+		if (s->state != st_wait_verdict) {
+			break;
+		}
+
+		cmd = rmilter_session_peek_cancel (s);
+
+		if (cmd == 0) {
+			break;
+		}
+
+		/* MTA is not waiting for the pending reply anymore */
+		msg_info_session ("got command '%c' while verdict is pending, "
+				"cancel it", cmd);
+		rmilter_session_cancel (s, cmd == SMFIC_ABORT ?
+				RMILTER_CANCEL_ABORT : RMILTER_CANCEL_CLOSE);
+		s->state = st_read_cmd;
+		rmilter_session_wakeup (s);
+	}
+
+	/* If the socket is not writable, replies wait for the write event */
+	if (s->state != st_closed && s->replies != NULL &&
+			s->write_ev == NULL) {
+		rmilter_session_want_write (s);
+	}
+}
+
+/*
+ * Returns receive buffer to the pool if it is empty, so idle sessions and
+ * sessions waiting for a deferred verdict or a job do not hold buffers: the
+ * pending command is consumed once it is dispatched and its arguments are
+ * valid merely during the callback
+ */
+static void
+rmilter_session_compact (struct rmilter_session *s)
+{
+	if (s->rbuf.base != NULL && rmilter_ringbuf_used (&s->rbuf) == 0 &&
+			(s->state == st_read_cmd || s->state == st_wait_verdict) &&
+			!s->stream_paused) {
+		rmilter_ringbuf_pool_put (&s->m->rbufs, &s->rbuf);
 	}
 }
 
 void
 rmilter_session_want_read (struct rmilter_session *s)
 {
+	guchar *p;
+	gsize avail;
 	gssize r;
+	gboolean done;
+
+	/*
+	 * Edge triggered backends report data once, so reading goes on until the
+	 * socket is drained. Short read means that the socket is empty, so
+	 * level triggered backends do not pay for an extra read.
+	 */
+	for (;;) {
+		if (s->rbuf.base == NULL) {
+			/* Buffer is borrowed only when there is something to read */
+			rmilter_ringbuf_pool_get (&s->m->rbufs, &s->rbuf,
+					RMILTER_RBUF_SIZE (s->max_data_size));
+		}
 
-	r = read (s->fd, s->cmd_buf, s->cmd_buf->len);
+		p = rmilter_ringbuf_wptr (&s->rbuf, &avail);
 
-	if (r == -1) {
-		if (errno == EINTR) {
-			rmilter_session_want_read (s);
+		if (avail == 0) {
+			/* Buffer is full of unprocessed data */
+			if (s->state == st_wait_verdict) {
+				s->m->async->stop_event (s->m->async->data, s->read_ev);
+			}
+
+			return;
 		}
-		else {
-			s->m->cb->abort (s, s->ud);
-			msg_err_session ("cannot read data from server: %s",
-					strerror (errno));
+
+		r = read (s->fd, p, avail);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				rmilter_session_compact (s);
+
+				return;
+			}
+			else {
+				if (s->m->cb->abort) {
+					s->m->cb->abort (s, s->ud);
+				}
+
+				msg_err_session ("cannot read data from server: %s",
+						strerror (errno));
+				rmilter_session_close (s);
+			}
+
+			return;
+		}
+		else if (r == 0) {
+			/* This means that server has nothing to pass or end-of-session */
+			msg_debug_session ("read 0 bytes from the server");
 			rmilter_session_close (s);
+
+			return;
+		}
+
+		/* Session might be closed by a command, so hold it until we return */
+		REF_RETAIN (s);
+
+		if (s->state == st_read_cmd) {
+			rmilter_milter_arm_timer (s->m, &s->io_timer, s->m->io_timeout);
+		}
+
+		rmilter_ringbuf_produce (&s->rbuf, r);
+		rmilter_session_process (s);
+		/* Reading might have been stopped by the body stream */
+		done = (gsize)r < avail || s->state == st_closed || s->stream_paused;
+
+		if (done && s->state != st_closed) {
+			rmilter_session_compact (s);
+		}
+
+		REF_RELEASE (s);
+
+		if (done) {
+			return;
 		}
 	}
-	else if (r == 0) {
-		/* This means that server has nothing to pass or end-of-session */
-		msg_debug_session ("read 0 bytes from the server");
-		rmilter_session_close (s);
+}
+
+/*
+ * Delivers verdict of the pending command and continues processing
+ */
+static void
+rmilter_session_complete (struct rmilter_session *s,
+		enum librmilter_reply verdict)
+{
+	REF_RETAIN (s);
+	s->state = st_read_cmd;
+	rmilter_session_stage_done (s, verdict);
+
+	if (s->state == st_read_cmd) {
+		rmilter_session_wakeup (s);
 	}
-	else {
-		rmilter_session_state_machine (s, r);
+
+	/* Process commands that have been read before suspending */
+	rmilter_session_process (s);
+
+	if (s->state != st_closed) {
+		rmilter_session_compact (s);
+	}
+
+	REF_RELEASE (s);
+}
+
+void
+rmilter_session_stream_ready (struct rmilter_session *s)
+{
+	struct rmilter_async_context *async = s->m->async;
+
+	if (!s->stream_paused || s->state == st_closed) {
+		return;
+	}
+
+	msg_debug_session ("body stream has space, resume reading");
+	s->stream_paused = FALSE;
+	async->start_event (async->data, s->read_ev);
+	rmilter_milter_arm_timer (s->m, &s->io_timer, s->m->io_timeout);
+
+	REF_RETAIN (s);
+	rmilter_session_process (s);
+
+	if (s->state != st_closed) {
+		rmilter_session_compact (s);
+	}
+
+	REF_RELEASE (s);
+}
+
+struct rmilter_pending *
+rmilter_session_defer (struct rmilter_session *s)
+{
+	if (s->pending == NULL) {
+		s->pending = g_slice_alloc0 (sizeof (*s->pending));
+		s->pending->s = s;
+	}
+
+	return s->pending;
+}
+
+struct rmilter_session *
+rmilter_pending_session (struct rmilter_pending *p)
+{
+	return p->s;
+}
+
+void
+rmilter_session_resume (struct rmilter_pending *p,
+		enum librmilter_reply verdict)
+{
+	struct rmilter_session *s = p->s;
+
+	g_slice_free1 (sizeof (*p), p);
+
+	if (s == NULL) {
+		/* Session has been closed meanwhile */
+		return;
+	}
+
+	s->pending = NULL;
+
+	if (verdict == RMILTER_REPLY_PENDING) {
+		msg_err_session ("cannot resume with pending verdict, tempfail message");
+		verdict = RMILTER_REPLY_TEMPFAIL;
+	}
+
+	if (s->state != st_wait_verdict) {
+		/* Called from the callback itself */
+		s->resumed = TRUE;
+		s->resumed_verdict = verdict;
+
+		return;
 	}
+
+	rmilter_session_complete (s, verdict);
 }
 
 void
-rmilter_session_want_write (struct rmilter_session *s)
+rmilter_pending_set_cancel (struct rmilter_pending *p,
+		rmilter_cancel_callback cb, void *ud)
+{
+	p->cancel = cb;
+	p->cancel_ud = ud;
+}
+
+double
+rmilter_session_time_left (struct rmilter_session *s)
 {
+	gint64 left;
+
+	if (s->stage_deadline == 0) {
+		return -1;
+	}
+
+	left = s->stage_deadline - g_get_monotonic_time ();
 
+	return left > 0 ? left / 1e6 : 0;
 }
 
 void
 rmilter_session_close (struct rmilter_session *s)
 {
+	if (s->state == st_closed) {
+		return;
+	}
+
 	msg_debug_session ("closing session: %p", s);
+	s->state = st_closed;
 
 	if (s->m->cb->close) {
 		s->m->cb->close (s, s->ud);
 	}
 
-	s->m->async->del_read (s->read_ev, s->m->async->data);
-	s->m->async->del_timer (s->timeout_ev, s->m->async->data);
+	if (s->read_ev) {
+		s->m->async->del_read (s->m->async->data, s->read_ev);
+		s->read_ev = NULL;
+	}
+
+	if (s->write_ev) {
+		s->m->async->del_write (s->m->async->data, s->write_ev);
+		s->write_ev = NULL;
+	}
+
+	rmilter_wheel_cancel (&s->m->wheel, &s->io_timer);
+	rmilter_wheel_cancel (&s->m->wheel, &s->progress_timer);
+	rmilter_wheel_cancel (&s->m->wheel, &s->deadline_timer);
+
+	/* Pending verdict cannot be delivered anymore */
+	rmilter_session_cancel (s, RMILTER_CANCEL_CLOSE);
+
+	if (s->stream) {
+		rmilter_stream_cancel (s->stream);
+		s->stream = NULL;
+	}
 
 	/* Release reference that is handled by milter itself */
 	REF_RELEASE (s);
 }
 
-void
+gboolean
 rmilter_session_start (struct rmilter_session *s)
 {
-	/* cmd is the initial state */
-	s->state = st_read_cmd;
-	/* Create read and timeout events */
+	gint flags;
+
+	/* Replies are written asynchronously */
+	flags = fcntl (s->fd, F_GETFL, 0);
+
+	if (flags != -1 && !(flags & O_NONBLOCK)) {
+		fcntl (s->fd, F_SETFL, flags | O_NONBLOCK);
+	}
+
+	/* Create read event and timers */
+	rmilter_wheel_timer_init (&s->io_timer, rmilter_process_timer, s);
+	rmilter_wheel_timer_init (&s->progress_timer, rmilter_session_progress, s);
+	rmilter_wheel_timer_init (&s->deadline_timer, rmilter_session_deadline, s);
 	s->read_ev = s->m->async->add_read (s->m->async->data, s->fd, s);
-	s->timeout_ev = s->m->async->add_timer (s->m->async->data,
-			s->m->io_timeout, s);
+
+	if (s->read_ev == NULL) {
+		msg_err_session ("cannot watch session socket");
+
+		return FALSE;
+	}
+
+	/* Command is the initial state */
+	s->state = st_read_cmd;
+	rmilter_milter_arm_timer (s->m, &s->io_timer, s->m->io_timeout);
+
+	return TRUE;
+}
+
+const char *
+rmilter_session_get_macro (struct rmilter_session *s, const char *name)
+{
+	gint id;
+
+	id = rmilter_macro_names_find (&s->m->macro_names, name, strlen (name),
+			FALSE);
+
+	return rmilter_macro_set_get (&s->cold->macros, id);
+}
+
+const char *
+rmilter_session_get_macro_id (struct rmilter_session *s, int id)
+{
+	return rmilter_macro_set_get (&s->cold->macros, id);
+}
+
+size_t
+rmilter_session_body_len (struct rmilter_session *s)
+{
+	return s->body ? s->body->len : 0;
+}
+
+const unsigned char *
+rmilter_session_body_map (struct rmilter_session *s, size_t *len)
+{
+	const guchar *p;
+
+	if (s->body == NULL || s->body->len == 0) {
+		return NULL;
+	}
+
+	p = rmilter_body_store_map (s->body);
+
+	if (p == NULL) {
+		msg_err_session ("cannot map body: %s", strerror (errno));
+	}
+	else if (len) {
+		*len = s->body->len;
+	}
+
+	return p;
+}
+
+int
+rmilter_session_body_fd (struct rmilter_session *s, size_t *len)
+{
+	gint fd;
+
+	if (s->body == NULL) {
+		return -1;
+	}
+
+	fd = rmilter_body_store_fd (s->body);
+
+	if (fd == -1) {
+		msg_err_session ("cannot export body: %s", strerror (errno));
+	}
+	else if (len) {
+		*len = s->body->len;
+	}
+
+	return fd;
 }
@@ -25,11 +25,48 @@
 #ifndef LIBRDNS_SESSION_H
 #define LIBRDNS_SESSION_H
 
+#include <stddef.h>
+#include "librmilter.h"
+
 struct rmilter_session;
 
-void rmilter_session_start (struct rmilter_session *s);
+gboolean rmilter_session_start (struct rmilter_session *s);
 void rmilter_session_close (struct rmilter_session *s);
 void rmilter_session_want_read (struct rmilter_session *s);
 void rmilter_session_want_write (struct rmilter_session *s);
+void rmilter_session_message_reset (struct rmilter_session *s);
+
+/*
+ * Resumes reading paused because the body stream has been full
+ */
+void rmilter_session_stream_ready (struct rmilter_session *s);
+
+/*
+ * Appends reply to the session's output queue, replies are written when
+ * the current input is processed
+ */
+void rmilter_session_reply (struct rmilter_session *s, char code,
+		const void *data, size_t len);
+
+/*
+ * Appends reply to the negotiation with the symbol lists requested by milter
+ */
+void rmilter_session_reply_optneg (struct rmilter_session *s);
+
+/*
+ * Appends reply that corresponds to the callback's return code
+ */
+void rmilter_session_send_verdict (struct rmilter_session *s,
+		enum librmilter_reply verdict);
+
+/*
+ * Frees all replies and reply code that have not been sent
+ */
+void rmilter_session_free_replies (struct rmilter_session *s);
+
+/*
+ * Frees reply elements cache and reply codes of the milter
+ */
+void rmilter_milter_free_replies (struct rmilter_milter *m);
 
 #endif
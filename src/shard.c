@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+#include "librmilter.h"
+#include "librmilter_internal.h"
+#include "shard.h"
+#include "pool.h"
+
+struct rmilter_shard_group {
+	struct rmilter_milter **milters;
+	guint nmilters;
+	guint next;
+	enum rmilter_shard_policy policy;
+	/* Milters are added from their own threads */
+	pthread_mutex_t lock;
+};
+
+#ifdef HAVE_ATOMIC_BUILTINS
+static void
+rmilter_inbox_wakeup (struct rmilter_inbox *inbox)
+{
+	guint64 val = 1;
+
+	if (__atomic_exchange_n (&inbox->wakeup, 1, __ATOMIC_SEQ_CST) == 0) {
+		if (write (inbox->wfd, &val, sizeof (val)) == -1 && errno != EAGAIN) {
+			/* Loop will see the socket on the next wakeup */
+			return;
+		}
+	}
+}
+#endif
+
+struct rmilter_inbox *
+rmilter_inbox_new (struct rmilter_milter *m)
+{
+	struct rmilter_inbox *inbox;
+	gint fds[2];
+
+#ifdef HAVE_EVENTFD
+	fds[0] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (fds[0] == -1) {
+		msg_err_milter ("cannot create eventfd: %s", strerror (errno));
+
+		return NULL;
+	}
+
+	fds[1] = fds[0];
+#else
+	if (pipe (fds) == -1) {
+		msg_err_milter ("cannot create pipe: %s", strerror (errno));
+
+		return NULL;
+	}
+
+	fcntl (fds[0], F_SETFL, fcntl (fds[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl (fds[1], F_SETFL, fcntl (fds[1], F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+	inbox = g_slice_alloc0 (sizeof (*inbox));
+	inbox->kind = RMILTER_EVENT_INBOX;
+	inbox->m = m;
+#ifdef HAVE_ATOMIC_BUILTINS
+	rmilter_mpsc_init (&inbox->sockets);
+	rmilter_mpsc_init (&inbox->completions);
+#endif
+	inbox->rfd = fds[0];
+	inbox->wfd = fds[1];
+	inbox->ev = m->async->add_read (m->async->data, inbox->rfd, inbox);
+
+	if (inbox->ev == NULL) {
+		msg_err_milter ("cannot watch inbox");
+		rmilter_inbox_free (inbox);
+
+		return NULL;
+	}
+
+	return inbox;
+}
+
+gboolean
+rmilter_inbox_push (struct rmilter_inbox *inbox, gint fd,
+		const gchar *module, const gchar *id, void *ud)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+	struct rmilter_handoff *h;
+	gsize mlen, idlen;
+	gchar *p;
+
+	mlen = module ? strlen (module) + 1 : 0;
+	idlen = id ? strlen (id) + 1 : 0;
+	h = g_malloc (sizeof (*h) + mlen + idlen);
+	h->fd = fd;
+	h->ud = ud;
+	p = (gchar *)(h + 1);
+	h->module = module ? memcpy (p, module, mlen) : NULL;
+	h->id = id ? memcpy (p + mlen, id, idlen) : NULL;
+
+	RMILTER_ATOMIC_ADD (&inbox->queued, 1);
+	rmilter_mpsc_push (&inbox->sockets, &h->node);
+	rmilter_inbox_wakeup (inbox);
+
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+void
+rmilter_inbox_complete (struct rmilter_inbox *inbox, struct rmilter_task *t)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+	rmilter_mpsc_push (&inbox->completions, &t->node);
+	rmilter_inbox_wakeup (inbox);
+#endif
+}
+
+void
+rmilter_inbox_finish_tasks (struct rmilter_inbox *inbox)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+	struct rmilter_mpsc_node *n;
+
+	while ((n = rmilter_mpsc_pop (&inbox->completions)) != NULL) {
+		((struct rmilter_task *)n)->done ((struct rmilter_task *)n);
+	}
+#endif
+}
+
+void
+rmilter_inbox_process (struct rmilter_inbox *inbox)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+	struct rmilter_milter *m = inbox->m;
+	struct rmilter_mpsc_node *n;
+	struct rmilter_handoff *h;
+	struct rmilter_session *s;
+	guint64 val;
+
+	while (read (inbox->rfd, &val, sizeof (val)) > 0);
+	/* Producers that come after this point wake us up once more */
+	__atomic_store_n (&inbox->wakeup, 0, __ATOMIC_SEQ_CST);
+	rmilter_inbox_finish_tasks (inbox);
+
+	while ((n = rmilter_mpsc_pop (&inbox->sockets)) != NULL) {
+		h = (struct rmilter_handoff *)n;
+		RMILTER_ATOMIC_SUB (&inbox->queued, 1);
+		s = rmilter_session_new (m, h->fd, h->module, h->id, h->ud);
+
+		if (s == NULL) {
+			close (h->fd);
+			g_free (h);
+		}
+		else {
+			/* Session owns module and id strings now */
+			s->cold->handoff = h;
+		}
+	}
+#endif
+}
+
+void
+rmilter_inbox_stop (struct rmilter_inbox *inbox)
+{
+	struct rmilter_milter *m = inbox->m;
+
+	if (inbox->ev) {
+		m->async->del_read (m->async->data, inbox->ev);
+		inbox->ev = NULL;
+	}
+}
+
+void
+rmilter_inbox_free (struct rmilter_inbox *inbox)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+	struct rmilter_mpsc_node *n;
+
+	/* Jobs keep milter alive and are finished by `rmilter_destroy` */
+	while ((n = rmilter_mpsc_pop (&inbox->sockets)) != NULL) {
+		close (((struct rmilter_handoff *)n)->fd);
+		g_free (n);
+	}
+#endif
+
+	rmilter_inbox_stop (inbox);
+	close (inbox->rfd);
+
+	if (inbox->wfd != inbox->rfd) {
+		close (inbox->wfd);
+	}
+
+	g_slice_free1 (sizeof (*inbox), inbox);
+}
+
+struct rmilter_shard_group *
+rmilter_shard_group_create (enum rmilter_shard_policy policy)
+{
+	struct rmilter_shard_group *g;
+
+#ifdef HAVE_ATOMIC_BUILTINS
+	g = g_malloc0 (sizeof (*g));
+	g->policy = policy;
+	pthread_mutex_init (&g->lock, NULL);
+#else
+	/* Lock-free queues cannot be used */
+	g = NULL;
+#endif
+
+	return g;
+}
+
+bool
+rmilter_shard_group_add (struct rmilter_shard_group *g,
+		struct rmilter_milter *milter)
+{
+	g_assert (g != NULL);
+	g_assert (milter != NULL);
+
+	if (milter->inbox == NULL) {
+		milter->inbox = rmilter_inbox_new (milter);
+
+		if (milter->inbox == NULL) {
+			return false;
+		}
+	}
+
+	REF_RETAIN (milter);
+	RMILTER_ATOMIC_ADD (&milter->ngroups, 1);
+	pthread_mutex_lock (&g->lock);
+	g->milters = g_realloc (g->milters,
+			(g->nmilters + 1) * sizeof (*g->milters));
+	g->milters[g->nmilters ++] = milter;
+	pthread_mutex_unlock (&g->lock);
+
+	return true;
+}
+
+static struct rmilter_milter *
+rmilter_shard_group_select (struct rmilter_shard_group *g)
+{
+	struct rmilter_milter *m, *sel = NULL;
+	guint i, start, load, min_load = G_MAXUINT;
+
+	start = RMILTER_ATOMIC_ADD (&g->next, 1);
+
+	for (i = 0; i < g->nmilters; i ++) {
+		m = g->milters[(start + i) % g->nmilters];
+
+		if (RMILTER_ATOMIC_LOAD (&m->wanna_die)) {
+			continue;
+		}
+
+		if (g->policy == RMILTER_SHARD_ROUND_ROBIN) {
+			return m;
+		}
+
+		/* Sockets in flight are counted as sessions */
+		load = RMILTER_ATOMIC_LOAD (&m->nsessions) +
+				RMILTER_ATOMIC_LOAD (&m->inbox->queued);
+
+		if (load < min_load) {
+			min_load = load;
+			sel = m;
+		}
+	}
+
+	return sel;
+}
+
+bool
+rmilter_shard_group_dispatch (struct rmilter_shard_group *g, int fd,
+		const char *module, const char *id, void *ud)
+{
+	struct rmilter_milter *m;
+
+	g_assert (g != NULL);
+
+	if (g->nmilters == 0) {
+		return false;
+	}
+
+	m = rmilter_shard_group_select (g);
+
+	if (m == NULL) {
+		return false;
+	}
+
+	return rmilter_inbox_push (m->inbox, fd, module, id, ud);
+}
+
+void
+rmilter_shard_group_destroy (struct rmilter_shard_group *g)
+{
+	guint i;
+
+	g_assert (g != NULL);
+
+	/*
+	 * Milters are destroyed after the group, so these references are never
+	 * the last ones and destructors run in the loop threads of milters
+	 */
+	for (i = 0; i < g->nmilters; i ++) {
+		RMILTER_ATOMIC_SUB (&g->milters[i]->ngroups, 1);
+		REF_RELEASE (g->milters[i]);
+	}
+
+	pthread_mutex_destroy (&g->lock);
+	g_free (g->milters);
+	g_free (g);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBRMILTER_SHARD_H
+#define LIBRMILTER_SHARD_H
+
+#include "librmilter_compat.h"
+#include "mpsc.h"
+
+struct rmilter_milter;
+struct rmilter_task;
+
+/*
+ * Kinds of objects passed to read events as user data
+ */
+enum rmilter_event_kind {
+	RMILTER_EVENT_SESSION = 0,
+	RMILTER_EVENT_INBOX
+};
+
+/*
+ * Socket passed to a milter running in another thread
+ */
+struct rmilter_handoff {
+	struct rmilter_mpsc_node node;
+	gint fd;
+	void *ud;
+	/* Module and id strings are stored after the structure */
+	const gchar *module;
+	const gchar *id;
+};
+
+/*
+ * Inbox of a milter that receives sockets from other threads (shard group) or
+ * results of work done by a thread pool. These are pushed to lock-free
+ * queues by any thread and the milter's loop is woken up via eventfd
+ * registered as a read event.
+ */
+struct rmilter_inbox {
+	/* Must be the first member, see `rmilter_process_read` */
+	enum rmilter_event_kind kind;
+	struct rmilter_milter *m;
+	struct rmilter_mpsc sockets;
+	struct rmilter_mpsc completions;
+	/* Nonzero if loop is going to be woken up */
+	guint wakeup;
+	/* Sockets queued but not consumed yet */
+	guint queued;
+	gint rfd;
+	gint wfd;
+	void *ev;
+};
+
+/**
+ * Creates inbox for the milter and registers its read event, must be called
+ * from the milter's loop thread
+ * @param m milter
+ * @return new inbox or NULL on error
+ */
+struct rmilter_inbox *rmilter_inbox_new (struct rmilter_milter *m);
+
+/**
+ * Queues socket to the inbox, might be called from any thread
+ */
+gboolean rmilter_inbox_push (struct rmilter_inbox *inbox, gint fd,
+		const gchar *module, const gchar *id, void *ud);
+
+/**
+ * Queues task to be finished by the loop, might be called from any thread
+ */
+void rmilter_inbox_complete (struct rmilter_inbox *inbox,
+		struct rmilter_task *t);
+
+/**
+ * Finishes all tasks posted to the inbox, called from the milter's loop thread
+ */
+void rmilter_inbox_finish_tasks (struct rmilter_inbox *inbox);
+
+/**
+ * Consumes all sockets and finished jobs queued, called from the milter's
+ * loop thread
+ */
+void rmilter_inbox_process (struct rmilter_inbox *inbox);
+
+/**
+ * Unregisters read event of the inbox
+ */
+void rmilter_inbox_stop (struct rmilter_inbox *inbox);
+
+/**
+ * Closes sockets that are still queued and frees inbox
+ */
+void rmilter_inbox_free (struct rmilter_inbox *inbox);
+
+#endif
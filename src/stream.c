@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "librmilter.h"
+#include "librmilter_internal.h"
+#include "stream.h"
+
+enum rmilter_stream_state {
+	stream_running = 0,
+	stream_eof,
+	stream_cancelled
+};
+
+static void
+rmilter_stream_free (struct rmilter_stream *stream)
+{
+	struct rmilter_session *s = stream->s;
+
+	g_slice_free1 (sizeof (*stream), stream);
+	REF_RELEASE (s);
+}
+
+#ifdef HAVE_ATOMIC_BUILTINS
+static struct rmilter_stream_chunk *
+rmilter_stream_pop (struct rmilter_stream *stream)
+{
+	struct rmilter_stream_chunk *chunk;
+	guint tail = stream->tail;
+
+	if (tail == __atomic_load_n (&stream->head, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	chunk = stream->slots[tail % RMILTER_STREAM_SLOTS];
+	__atomic_store_n (&stream->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return chunk;
+}
+
+static gboolean
+rmilter_stream_empty (struct rmilter_stream *stream)
+{
+	return stream->tail == __atomic_load_n (&stream->head, __ATOMIC_ACQUIRE);
+}
+
+static void
+rmilter_stream_schedule (struct rmilter_stream *stream)
+{
+	if (__atomic_exchange_n (&stream->scheduled, 1, __ATOMIC_SEQ_CST) == 0) {
+		__atomic_add_fetch (&stream->active, 1, __ATOMIC_SEQ_CST);
+		rmilter_pool_push (stream->pool, &stream->drain);
+	}
+}
+
+/*
+ * Ends a run of the consumer. The stream is not touched afterwards unless this
+ * is the last run of the finished stream: once it is posted to the loop, the
+ * stream might be freed at any moment.
+ */
+static void
+rmilter_stream_leave (struct rmilter_stream *stream)
+{
+	struct rmilter_inbox *inbox = stream->s->m->inbox;
+
+	if (__atomic_sub_fetch (&stream->active, 1, __ATOMIC_SEQ_CST) ==
+			RMILTER_STREAM_FINISHED) {
+		rmilter_inbox_complete (inbox, &stream->drain);
+	}
+}
+
+/*
+ * Consumer, runs in a pool thread
+ */
+static void
+rmilter_stream_drain (struct rmilter_task *t)
+{
+	struct rmilter_stream *stream = (struct rmilter_stream *)t;
+	struct rmilter_stream_chunk *chunk;
+	guint state;
+
+	for (;;) {
+		while ((chunk = rmilter_stream_pop (stream)) != NULL) {
+			if (__atomic_load_n (&stream->state, __ATOMIC_ACQUIRE) !=
+					stream_cancelled) {
+				stream->funcs.chunk (stream->ud, chunk->data, chunk->len);
+			}
+
+			__atomic_sub_fetch (&stream->bytes, chunk->len, __ATOMIC_SEQ_CST);
+			g_free (chunk);
+
+			if (__atomic_exchange_n (&stream->paused, 0, __ATOMIC_SEQ_CST)) {
+				rmilter_inbox_complete (stream->s->m->inbox, &stream->wake);
+			}
+		}
+
+		state = __atomic_load_n (&stream->state, __ATOMIC_ACQUIRE);
+
+		if (state != stream_running && rmilter_stream_empty (stream)) {
+			/* No more chunks could be pushed */
+			if (state == stream_eof && stream->funcs.end) {
+				stream->verdict = stream->funcs.end (stream->ud);
+			}
+
+			/*
+			 * Stream stays scheduled, so it is not run anymore, but a previous
+			 * run might still be leaving and the last one posts the stream
+			 */
+			__atomic_or_fetch (&stream->active, RMILTER_STREAM_FINISHED,
+					__ATOMIC_SEQ_CST);
+			rmilter_stream_leave (stream);
+
+			return;
+		}
+
+		/*
+		 * Producer might schedule another run after this point, which is safe
+		 * as this run holds the stream until it leaves
+		 */
+		__atomic_store_n (&stream->scheduled, 0, __ATOMIC_SEQ_CST);
+
+		if (rmilter_stream_empty (stream) &&
+				__atomic_load_n (&stream->state, __ATOMIC_ACQUIRE) ==
+						stream_running) {
+			rmilter_stream_leave (stream);
+
+			return;
+		}
+
+		if (__atomic_exchange_n (&stream->scheduled, 1, __ATOMIC_SEQ_CST)) {
+			/* Producer has scheduled us once more */
+			rmilter_stream_leave (stream);
+
+			return;
+		}
+	}
+}
+#endif
+
+/*
+ * Delivers result of the stream and frees it, called from the loop thread
+ */
+static void
+rmilter_stream_done (struct rmilter_task *t)
+{
+	struct rmilter_stream *stream = (struct rmilter_stream *)t;
+	enum librmilter_reply verdict = stream->verdict;
+	struct rmilter_session *alive = NULL;
+
+	if (stream->p) {
+		alive = rmilter_pending_session (stream->p);
+	}
+
+	if (stream->funcs.finish) {
+		verdict = stream->funcs.finish (alive, verdict, stream->ud);
+	}
+
+	if (stream->p) {
+		rmilter_session_resume (stream->p, verdict);
+	}
+
+	rmilter_stream_free (stream);
+}
+
+static void
+rmilter_stream_wake (struct rmilter_task *t)
+{
+	struct rmilter_stream *stream = (struct rmilter_stream *)
+			((guchar *)t - G_STRUCT_OFFSET (struct rmilter_stream, wake));
+
+	rmilter_session_stream_ready (stream->s);
+}
+
+static void
+rmilter_stream_on_cancel (struct rmilter_pending *p,
+		enum rmilter_cancel_reason reason, void *ud)
+{
+	struct rmilter_stream *stream = ud;
+
+	(void)p;
+	(void)reason;
+	/* End of message is not needed anymore */
+	__atomic_store_n (&stream->state, stream_cancelled, __ATOMIC_RELEASE);
+}
+
+struct rmilter_stream *
+rmilter_stream_new (struct rmilter_session *s,
+		const struct rmilter_stream_funcs *funcs, void *ud)
+{
+	struct rmilter_stream *stream;
+
+	stream = g_slice_alloc0 (sizeof (*stream));
+	stream->drain.run = NULL;
+#ifdef HAVE_ATOMIC_BUILTINS
+	stream->drain.run = rmilter_stream_drain;
+#endif
+	stream->drain.done = rmilter_stream_done;
+	stream->wake.done = rmilter_stream_wake;
+	stream->s = s;
+	memcpy (&stream->funcs, funcs, sizeof (*funcs));
+	stream->ud = ud;
+	stream->pool = s->m->pool;
+	stream->limit = s->m->stream_buffer;
+	stream->verdict = RMILTER_REPLY_CONTINUE;
+	REF_RETAIN (s);
+
+	return stream;
+}
+
+gboolean
+rmilter_stream_full (struct rmilter_stream *stream)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+	if (stream->pool == NULL) {
+		return FALSE;
+	}
+
+	return stream->head - __atomic_load_n (&stream->tail, __ATOMIC_ACQUIRE) ==
+			RMILTER_STREAM_SLOTS ||
+			__atomic_load_n (&stream->bytes, __ATOMIC_SEQ_CST) >= stream->limit;
+#else
+	return FALSE;
+#endif
+}
+
+gboolean
+rmilter_stream_pause (struct rmilter_stream *stream)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+	__atomic_store_n (&stream->paused, 1, __ATOMIC_SEQ_CST);
+
+	if (rmilter_stream_full (stream)) {
+		return TRUE;
+	}
+
+	/* Consumer might have cleared the flag and is going to wake us up */
+	return __atomic_exchange_n (&stream->paused, 0, __ATOMIC_SEQ_CST) == 0;
+#else
+	return FALSE;
+#endif
+}
+
+void
+rmilter_stream_push (struct rmilter_stream *stream, const guchar *data,
+		gsize len)
+{
+	struct rmilter_stream_chunk *chunk;
+
+	if (stream->pool == NULL) {
+		/* Consumed in place */
+		stream->funcs.chunk (stream->ud, data, len);
+
+		return;
+	}
+
+#ifdef HAVE_ATOMIC_BUILTINS
+	chunk = g_malloc (sizeof (*chunk) + len);
+	chunk->len = len;
+	memcpy (chunk->data, data, len);
+
+	__atomic_add_fetch (&stream->bytes, len, __ATOMIC_SEQ_CST);
+	stream->slots[stream->head % RMILTER_STREAM_SLOTS] = chunk;
+	__atomic_store_n (&stream->head, stream->head + 1, __ATOMIC_RELEASE);
+	rmilter_stream_schedule (stream);
+#else
+	(void)chunk;
+#endif
+}
+
+enum librmilter_reply
+rmilter_stream_end (struct rmilter_stream *stream)
+{
+	struct rmilter_session *s = stream->s;
+	enum librmilter_reply verdict = RMILTER_REPLY_CONTINUE;
+
+	if (stream->pool == NULL) {
+		if (stream->funcs.end) {
+			verdict = stream->funcs.end (stream->ud);
+		}
+
+		if (stream->funcs.finish) {
+			verdict = stream->funcs.finish (s, verdict, stream->ud);
+		}
+
+		rmilter_stream_free (stream);
+
+		return verdict;
+	}
+
+#ifdef HAVE_ATOMIC_BUILTINS
+	stream->p = rmilter_session_defer (s);
+	rmilter_pending_set_cancel (stream->p, rmilter_stream_on_cancel, stream);
+	__atomic_store_n (&stream->state, stream_eof, __ATOMIC_RELEASE);
+	rmilter_stream_schedule (stream);
+	verdict = RMILTER_REPLY_PENDING;
+#endif
+
+	return verdict;
+}
+
+void
+rmilter_stream_cancel (struct rmilter_stream *stream)
+{
+	if (stream->pool == NULL) {
+		stream->verdict = RMILTER_REPLY_TEMPFAIL;
+		/* Finish is called without a session */
+		rmilter_stream_done (&stream->drain);
+
+		return;
+	}
+
+#ifdef HAVE_ATOMIC_BUILTINS
+	stream->verdict = RMILTER_REPLY_TEMPFAIL;
+	__atomic_store_n (&stream->state, stream_cancelled, __ATOMIC_RELEASE);
+	rmilter_stream_schedule (stream);
+#endif
+}
+
+bool
+rmilter_session_stream_body (struct rmilter_session *s,
+		const struct rmilter_stream_funcs *funcs, void *arg)
+{
+	g_assert (s != NULL);
+	g_assert (funcs != NULL && funcs->chunk != NULL);
+
+	if (s->stream != NULL || s->body_skipped || s->eom_called ||
+			(s->protocol & SMFIP_NOBODY)) {
+		return false;
+	}
+
+	s->stream = rmilter_stream_new (s, funcs, arg);
+
+	return true;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBRMILTER_STREAM_H
+#define LIBRMILTER_STREAM_H
+
+#include "librmilter_compat.h"
+#include "librmilter.h"
+#include "pool.h"
+
+#define RMILTER_STREAM_SLOTS 64
+/* Set in the counter of consumer runs once the stream is over */
+#define RMILTER_STREAM_FINISHED (1U << 31)
+
+struct rmilter_stream_chunk {
+	gsize len;
+	guchar data[];
+};
+
+/*
+ * Body chunks passed to a consumer running in the thread pool. Chunks are
+ * copied to a bounded single producer single consumer ring; consumer is not
+ * bound to a thread, it is scheduled to the pool when there is data and it is
+ * not running already.
+ */
+struct rmilter_stream {
+	/* Consumer task, posted to the loop when the stream is over */
+	struct rmilter_task drain;
+	/* Posted to the loop when a paused producer could continue */
+	struct rmilter_task wake;
+	struct rmilter_session *s;
+	/* Deferred verdict of the end of message */
+	struct rmilter_pending *p;
+	struct rmilter_stream_funcs funcs;
+	void *ud;
+	struct rmilter_pool *pool;
+	struct rmilter_stream_chunk *slots[RMILTER_STREAM_SLOTS];
+	/* Written by producer */
+	guint head;
+	/* Written by consumer */
+	guint tail;
+	gsize bytes;
+	gsize limit;
+	guint state;
+	guint scheduled;
+	/* Consumer runs scheduled and not finished yet */
+	guint active;
+	guint paused;
+	enum librmilter_reply verdict;
+};
+
+/**
+ * Creates stream for the current message of the session
+ */
+struct rmilter_stream *rmilter_stream_new (struct rmilter_session *s,
+		const struct rmilter_stream_funcs *funcs, void *ud);
+
+/**
+ * Returns TRUE if no more chunks could be pushed
+ */
+gboolean rmilter_stream_full (struct rmilter_stream *stream);
+
+/**
+ * Asks consumer to wake producer up when there is space in the stream
+ * @return TRUE if producer should wait, FALSE if there is space already
+ */
+gboolean rmilter_stream_pause (struct rmilter_stream *stream);
+
+/**
+ * Passes body chunk to the consumer
+ */
+void rmilter_stream_push (struct rmilter_stream *stream, const guchar *data,
+		gsize len);
+
+/**
+ * Finishes stream, the verdict is deferred until consumer is done
+ * @return verdict or `RMILTER_REPLY_PENDING`
+ */
+enum librmilter_reply rmilter_stream_end (struct rmilter_stream *stream);
+
+/**
+ * Drops stream, chunks that have not been consumed yet are skipped
+ */
+void rmilter_stream_cancel (struct rmilter_stream *stream);
+
+#endif
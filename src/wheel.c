@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wheel.h"
+
+static inline void
+rmilter_wheel_link (struct rmilter_wheel_timer *head,
+		struct rmilter_wheel_timer *t)
+{
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+static inline void
+rmilter_wheel_unlink (struct rmilter_wheel_timer *t)
+{
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+}
+
+static inline void
+rmilter_wheel_head_init (struct rmilter_wheel_timer *head)
+{
+	head->next = head->prev = head;
+}
+
+void
+rmilter_wheel_init (struct rmilter_wheel *w)
+{
+	guint i;
+
+	for (i = 0; i < RMILTER_WHEEL_SLOTS; i ++) {
+		rmilter_wheel_head_init (&w->slots[i]);
+	}
+
+	w->last = g_get_monotonic_time () / RMILTER_WHEEL_TICK_US;
+	w->count = 0;
+}
+
+void
+rmilter_wheel_arm (struct rmilter_wheel *w, struct rmilter_wheel_timer *t,
+		gint64 when)
+{
+	gint64 expire;
+
+	if (rmilter_wheel_timer_armed (t)) {
+		rmilter_wheel_unlink (t);
+	}
+	else {
+		if (w->count == 0) {
+			/* Nothing has been processed while the wheel was empty */
+			w->last = g_get_monotonic_time () / RMILTER_WHEEL_TICK_US;
+		}
+
+		w->count ++;
+	}
+
+	/* Round up, so timers never fire early */
+	expire = (when + RMILTER_WHEEL_TICK_US - 1) / RMILTER_WHEEL_TICK_US;
+
+	if (expire <= w->last) {
+		expire = w->last + 1;
+	}
+
+	t->expire = expire;
+	rmilter_wheel_link (&w->slots[expire % RMILTER_WHEEL_SLOTS], t);
+}
+
+void
+rmilter_wheel_cancel (struct rmilter_wheel *w, struct rmilter_wheel_timer *t)
+{
+	if (rmilter_wheel_timer_armed (t)) {
+		rmilter_wheel_unlink (t);
+		w->count --;
+	}
+}
+
+void
+rmilter_wheel_expire (struct rmilter_wheel *w, gint64 now)
+{
+	struct rmilter_wheel_timer expired, *slot, *t;
+	gint64 cur, tick;
+
+	cur = now / RMILTER_WHEEL_TICK_US;
+
+	if (cur <= w->last) {
+		return;
+	}
+
+	/* After a long stall every slot is visited once */
+	tick = MAX (w->last + 1, cur - RMILTER_WHEEL_SLOTS + 1);
+	rmilter_wheel_head_init (&expired);
+
+	for (; tick <= cur && w->count > 0; tick ++) {
+		slot = &w->slots[tick % RMILTER_WHEEL_SLOTS];
+		t = slot->next;
+
+		while (t != slot) {
+			struct rmilter_wheel_timer *next = t->next;
+
+			if (t->expire <= cur) {
+				rmilter_wheel_unlink (t);
+				rmilter_wheel_link (&expired, t);
+			}
+
+			t = next;
+		}
+	}
+
+	w->last = cur;
+
+	/*
+	 * Callbacks might cancel other expired timers or free their owners, so
+	 * timers are taken one by one from the list of expired ones
+	 */
+	while ((t = expired.next) != &expired) {
+		rmilter_wheel_unlink (t);
+		w->count --;
+		t->cb (t->ud);
+	}
+}
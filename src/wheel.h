@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBRMILTER_WHEEL_H
+#define LIBRMILTER_WHEEL_H
+
+#include "librmilter_compat.h"
+
+/* Resolution of the wheel */
+#define RMILTER_WHEEL_TICK_US G_GINT64_CONSTANT (100000)
+/* Number of slots, one revolution is about 51 seconds */
+#define RMILTER_WHEEL_SLOTS 512
+
+/*
+ * Timer linked into a slot of the wheel. Timers are embedded into their
+ * owners, so arming, refreshing and cancelling never allocate.
+ */
+struct rmilter_wheel_timer {
+	struct rmilter_wheel_timer *next, *prev;
+	/* Tick when the timer expires */
+	gint64 expire;
+	void (*cb) (void *ud);
+	void *ud;
+};
+
+/*
+ * Hashed timing wheel: a timer is kept in the slot of its expiration tick
+ * modulo the number of slots, timers that are more than one revolution ahead
+ * are skipped until their tick comes
+ */
+struct rmilter_wheel {
+	struct rmilter_wheel_timer slots[RMILTER_WHEEL_SLOTS];
+	/* The last tick that has been processed */
+	gint64 last;
+	guint count;
+};
+
+/**
+ * Initializes empty wheel
+ */
+void rmilter_wheel_init (struct rmilter_wheel *w);
+
+/**
+ * Initializes timer, it is not armed
+ */
+static inline void
+rmilter_wheel_timer_init (struct rmilter_wheel_timer *t,
+		void (*cb) (void *ud), void *ud)
+{
+	t->next = t->prev = NULL;
+	t->expire = 0;
+	t->cb = cb;
+	t->ud = ud;
+}
+
+static inline gboolean
+rmilter_wheel_timer_armed (const struct rmilter_wheel_timer *t)
+{
+	return t->next != NULL;
+}
+
+/**
+ * Arms or rearms timer to fire after the specified time, that is just a move
+ * between slots
+ * @param w wheel
+ * @param t timer
+ * @param when monotonic time in microseconds
+ */
+void rmilter_wheel_arm (struct rmilter_wheel *w,
+		struct rmilter_wheel_timer *t, gint64 when);
+
+/**
+ * Disarms timer, it is safe to cancel a timer that is not armed
+ */
+void rmilter_wheel_cancel (struct rmilter_wheel *w,
+		struct rmilter_wheel_timer *t);
+
+/**
+ * Fires all timers that have expired by `now`. Callbacks might arm and cancel
+ * any timers.
+ * @param w wheel
+ * @param now monotonic time in microseconds
+ */
+void rmilter_wheel_expire (struct rmilter_wheel *w, gint64 now);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Body store: small bodies stay in memory blocks, bodies over the threshold
+ * are spilled to a file, exported descriptors are sealed
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include "bodystore.h"
+#include "test.h"
+
+#define CHUNK_LEN 1000
+
+static void
+fill_chunk (guchar *chunk, gsize off)
+{
+	gsize i;
+
+	for (i = 0; i < CHUNK_LEN; i ++) {
+		chunk[i] = (guchar)((off + i) % 251);
+	}
+}
+
+static void
+check_body (const guchar *p, gsize len)
+{
+	gsize i;
+
+	RMILTER_CHECK (p != NULL);
+
+	for (i = 0; i < len; i ++) {
+		RMILTER_CHECK (p[i] == (guchar)(i % 251));
+	}
+}
+
+/* Appends the body pattern until the store holds `len` bytes */
+static void
+append_body (struct rmilter_body_store *bs, gsize len)
+{
+	guchar chunk[CHUNK_LEN];
+	gsize off;
+
+	for (off = bs->len; off < len; off += CHUNK_LEN) {
+		fill_chunk (chunk, off);
+		RMILTER_CHECK (rmilter_body_store_append (bs, chunk,
+				MIN (CHUNK_LEN, len - off)));
+	}
+
+	RMILTER_CHECK (bs->len == len);
+}
+
+static void
+test_memory (void)
+{
+	struct rmilter_body_store bs;
+
+	rmilter_body_store_init (&bs, 1024 * 1024);
+	RMILTER_CHECK (rmilter_body_store_map (&bs) == NULL);
+
+	/* Single block is mapped in place */
+	append_body (&bs, RMILTER_BODY_BLOCK_SIZE);
+	RMILTER_CHECK (bs.fd == -1 && bs.head == bs.tail);
+	check_body (rmilter_body_store_map (&bs), bs.len);
+	RMILTER_CHECK (bs.fd == -1);
+
+	/* Several blocks are below the threshold but need a file to be mapped */
+	rmilter_body_store_reset (&bs);
+	append_body (&bs, RMILTER_BODY_BLOCK_SIZE * 3 + 17);
+	RMILTER_CHECK (bs.fd == -1 && bs.head != bs.tail);
+	check_body (rmilter_body_store_map (&bs), bs.len);
+	RMILTER_CHECK (bs.fd != -1 && bs.head == NULL);
+
+	/* Appending after mapping remaps the grown body */
+	append_body (&bs, RMILTER_BODY_BLOCK_SIZE * 3 + 17 + CHUNK_LEN);
+	check_body (rmilter_body_store_map (&bs), bs.len);
+
+	rmilter_body_store_reset (&bs);
+	RMILTER_CHECK (bs.len == 0 && bs.fd == -1 && bs.map == NULL);
+	RMILTER_CHECK (bs.spill_threshold == 1024 * 1024);
+}
+
+static void
+test_spill (void)
+{
+	struct rmilter_body_store bs;
+	gsize len = 300 * 1024 + 5;
+
+	rmilter_body_store_init (&bs, 200 * 1024);
+	append_body (&bs, 200 * 1024);
+	RMILTER_CHECK (bs.fd == -1);
+
+	/* Crossing the threshold moves the blocks to the file */
+	append_body (&bs, len);
+	RMILTER_CHECK (bs.fd != -1 && bs.head == NULL && bs.tail == NULL);
+	check_body (rmilter_body_store_map (&bs), len);
+
+	rmilter_body_store_reset (&bs);
+}
+
+static void
+test_seal (void)
+{
+	struct rmilter_body_store bs;
+	struct stat st;
+	guchar buf[CHUNK_LEN];
+	gsize len = RMILTER_BODY_BLOCK_SIZE + 333;
+	gssize r;
+	gint fd;
+
+	rmilter_body_store_init (&bs, 0);
+	append_body (&bs, len);
+	check_body (rmilter_body_store_map (&bs), len);
+
+	fd = rmilter_body_store_fd (&bs);
+	RMILTER_CHECK (fd != -1 && bs.sealed);
+	RMILTER_CHECK (rmilter_body_store_fd (&bs) == fd);
+	RMILTER_CHECK (fstat (fd, &st) == 0 && st.st_size == (off_t)len);
+
+	/* Descriptor is rewound for the receiver */
+	r = read (fd, buf, sizeof (buf));
+	RMILTER_CHECK (r == sizeof (buf));
+	check_body (buf, sizeof (buf));
+
+	/* No more data is accepted after export */
+	RMILTER_CHECK (!rmilter_body_store_append (&bs, buf, 1));
+	RMILTER_CHECK (bs.len == len);
+
+#ifdef F_GET_SEALS
+	if (fcntl (fd, F_GET_SEALS) != -1) {
+		/* Receiver cannot change the memfd body */
+		RMILTER_CHECK ((fcntl (fd, F_GET_SEALS) & F_SEAL_WRITE) != 0);
+		RMILTER_CHECK (pwrite (fd, buf, 1, 0) == -1);
+		RMILTER_CHECK (ftruncate (fd, 1) == -1);
+	}
+#endif
+
+	check_body (rmilter_body_store_map (&bs), len);
+	rmilter_body_store_reset (&bs);
+	RMILTER_CHECK (!bs.sealed);
+	RMILTER_CHECK (rmilter_body_store_append (&bs, buf, 1));
+	rmilter_body_store_reset (&bs);
+}
+
+int
+main (int argc, char **argv)
+{
+	test_memory ();
+	test_spill ();
+	test_seal ();
+
+	return 0;
+}
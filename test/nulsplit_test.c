@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * NUL split: every implementation finds the same positions as the scalar
+ * one on unaligned buffers, around vector boundaries and with a limited
+ * output array
+ */
+
+#include <string.h>
+#include "nulsplit.h"
+#include "test.h"
+
+#define BUF_LEN 300
+#define MAX_POS 256
+
+typedef gsize (*find_nul_func) (const guchar *p, gsize len, guint32 *pos,
+		gsize maxpos);
+
+static guint32 rnd_state = 1;
+
+static guint32
+rnd (void)
+{
+	rnd_state = rnd_state * 1103515245U + 12345U;
+
+	return rnd_state >> 16;
+}
+
+static void
+check_impl (find_nul_func f, const guchar *p, gsize len, gsize maxpos)
+{
+	guint32 expected[MAX_POS], got[MAX_POS];
+	gsize nexp, ngot;
+
+	nexp = rmilter_find_nul_scalar (p, len, expected, maxpos);
+	ngot = f (p, len, got, maxpos);
+	RMILTER_CHECK (ngot == nexp);
+	RMILTER_CHECK (memcmp (got, expected, nexp * sizeof (guint32)) == 0);
+}
+
+static void
+check_all (const guchar *p, gsize len, gsize maxpos)
+{
+	check_impl (rmilter_find_nul, p, len, maxpos);
+#ifdef RMILTER_HAS_X86_SIMD
+	__builtin_cpu_init ();
+
+	if (__builtin_cpu_supports ("sse2")) {
+		check_impl (rmilter_find_nul_sse2, p, len, maxpos);
+	}
+	if (__builtin_cpu_supports ("avx2")) {
+		check_impl (rmilter_find_nul_avx2, p, len, maxpos);
+	}
+#endif
+}
+
+static void
+test_scalar (void)
+{
+	static const guchar data[] = "from\0to\0\0x";
+	guint32 pos[4];
+
+	RMILTER_CHECK (rmilter_find_nul_scalar (data, 10, pos, 4) == 3);
+	RMILTER_CHECK (pos[0] == 4 && pos[1] == 7 && pos[2] == 8);
+	RMILTER_CHECK (rmilter_find_nul_scalar (data, 10, pos, 2) == 2);
+	RMILTER_CHECK (rmilter_find_nul_scalar (data, 4, pos, 4) == 0);
+}
+
+static void
+test_patterns (void)
+{
+	/* Extra space so that the data can start at any offset of a vector */
+	static guchar buf[BUF_LEN + 64];
+	gsize off, len, i, density;
+
+	for (density = 0; density < 4; density ++) {
+		for (off = 0; off < 64; off ++) {
+			guchar *p = buf + off;
+
+			for (i = 0; i < BUF_LEN; i ++) {
+				switch (density) {
+				case 0:
+					p[i] = 'a';
+					break;
+				case 1:
+					p[i] = (rnd () % 37 == 0) ? '\0' : 'a' + rnd () % 26;
+					break;
+				case 2:
+					p[i] = (rnd () % 3 == 0) ? '\0' : 0x80 + rnd () % 128;
+					break;
+				default:
+					p[i] = '\0';
+					break;
+				}
+			}
+
+			/* Lengths around 16, 32 and 64 byte vector boundaries */
+			for (len = 0; len <= BUF_LEN; len ++) {
+				check_all (p, len, MAX_POS);
+			}
+
+			/* Output array fills up in the middle of a vector */
+			for (i = 0; i < 70; i ++) {
+				check_all (p, BUF_LEN, i);
+			}
+		}
+	}
+}
+
+static void
+test_edges (void)
+{
+	static guchar buf[BUF_LEN];
+	gsize len, i;
+
+	/* Single NUL at the first and the last byte of every length */
+	for (len = 1; len <= 130; len ++) {
+		memset (buf, 'x', sizeof (buf));
+		buf[0] = '\0';
+		check_all (buf, len, MAX_POS);
+		buf[0] = 'x';
+		buf[len - 1] = '\0';
+		check_all (buf, len, MAX_POS);
+
+		/* NUL right after the end is not reported */
+		buf[len - 1] = 'x';
+		buf[len] = '\0';
+		check_all (buf, len, MAX_POS);
+	}
+
+	for (i = 0; i < BUF_LEN; i ++) {
+		memset (buf, 'x', sizeof (buf));
+		buf[i] = '\0';
+		check_all (buf, BUF_LEN, MAX_POS);
+		check_all (buf, BUF_LEN, 1);
+	}
+}
+
+int
+main (int argc, char **argv)
+{
+	test_scalar ();
+	test_patterns ();
+	test_edges ();
+
+	return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Ring buffer: data that wraps around the end of the ring is read back as one
+ * contiguous slice, and growing a ring through the pool keeps its data
+ */
+
+#include <string.h>
+#include "ringbuf.h"
+#include "test.h"
+
+static void
+check_data (struct rmilter_ringbuf *rb, guint64 from)
+{
+	const guchar *p = rmilter_ringbuf_rptr (rb);
+	gsize i, used = rmilter_ringbuf_used (rb);
+
+	for (i = 0; i < used; i ++) {
+		RMILTER_CHECK (p[i] == (guchar)((from + i) * 7));
+	}
+}
+
+static gsize
+fill (struct rmilter_ringbuf *rb, guint64 *written, gsize len)
+{
+	guchar *p;
+	gsize avail, i;
+
+	p = rmilter_ringbuf_wptr (rb, &avail);
+	len = MIN (len, avail);
+
+	for (i = 0; i < len; i ++) {
+		p[i] = (guchar)((*written + i) * 7);
+	}
+
+	rmilter_ringbuf_produce (rb, len);
+	*written += len;
+
+	return len;
+}
+
+static void
+test_wraparound (void)
+{
+	struct rmilter_ringbuf rb;
+	guint64 written = 0, consumed = 0;
+	gsize avail, n;
+	guint i;
+
+	RMILTER_CHECK (rmilter_ringbuf_init (&rb, 4096));
+	RMILTER_CHECK (rb.size >= 4096);
+
+	/* Steps are coprime with the size, so every offset of the end is hit */
+	for (i = 0; i < 10000; i ++) {
+		fill (&rb, &written, 1031);
+		RMILTER_CHECK (rmilter_ringbuf_used (&rb) == written - consumed);
+		check_data (&rb, consumed);
+		n = MIN (rmilter_ringbuf_used (&rb), (gsize)(i % 3 == 0 ? 1500 : 700));
+		rmilter_ringbuf_consume (&rb, n);
+		consumed += n;
+	}
+
+	RMILTER_CHECK (written > rb.size * 100);
+
+	/* Full ring has no space, and all of it is readable at once */
+	while (fill (&rb, &written, rb.size) > 0);
+	RMILTER_CHECK (rmilter_ringbuf_used (&rb) == rb.size);
+	rmilter_ringbuf_wptr (&rb, &avail);
+	RMILTER_CHECK (avail == 0);
+	check_data (&rb, consumed);
+
+	rmilter_ringbuf_consume (&rb, rb.size);
+	RMILTER_CHECK (rmilter_ringbuf_used (&rb) == 0);
+	rmilter_ringbuf_destroy (&rb);
+}
+
+static void
+test_pool_grow (void)
+{
+	struct rmilter_ringbuf_pool pool;
+	struct rmilter_ringbuf rb;
+	guint64 written = 0, consumed = 0;
+	gsize size;
+	guchar *base;
+
+	memset (&pool, 0, sizeof (pool));
+	memset (&rb, 0, sizeof (rb));
+	rmilter_ringbuf_pool_get (&pool, &rb, 4096);
+	size = rb.size;
+
+	/* Stored data wraps around the end when the ring is grown */
+	fill (&rb, &written, size - 100);
+	rmilter_ringbuf_consume (&rb, size - 200);
+	consumed += size - 200;
+	fill (&rb, &written, 1000);
+	rmilter_ringbuf_pool_grow (&pool, &rb, size * 4);
+	RMILTER_CHECK (rb.size >= size * 4);
+	RMILTER_CHECK (rmilter_ringbuf_used (&rb) == written - consumed);
+	check_data (&rb, consumed);
+
+	/* The smaller ring has been returned and is reused empty */
+	rmilter_ringbuf_pool_put (&pool, &rb);
+	RMILTER_CHECK (rb.base == NULL);
+	rmilter_ringbuf_pool_get (&pool, &rb, size);
+	base = rb.base;
+	RMILTER_CHECK (rb.size == size);
+	RMILTER_CHECK (rmilter_ringbuf_used (&rb) == 0);
+	rmilter_ringbuf_pool_put (&pool, &rb);
+	rmilter_ringbuf_pool_get (&pool, &rb, size);
+	RMILTER_CHECK (rb.base == base);
+	rmilter_ringbuf_pool_put (&pool, &rb);
+
+	rmilter_ringbuf_pool_destroy (&pool);
+}
+
+int
+main (int argc, char **argv)
+{
+	test_wraparound ();
+	test_pool_grow ();
+
+	return 0;
+}
@@ -0,0 +1,503 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Session: commands sent by a fake MTA over a socketpair are dispatched to
+ * the callbacks and their verdicts, immediate and deferred, come back in
+ * order; deferred verdicts are cancelled by abort, close and stage timeout
+ */
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include "librmilter_epoll.h"
+#include "protocol.h"
+#include "test.h"
+
+struct test_mta {
+	int fd;
+	struct rmilter_epoll *loop;
+	struct rmilter_async_context *async;
+	struct rmilter_milter *m;
+	unsigned char buf[4096];
+	size_t len;
+};
+
+struct test_state {
+	unsigned int nmail;
+	unsigned int nrcpt;
+	unsigned int neom;
+	unsigned int nclose;
+	unsigned int nabort;
+	unsigned int ncancel;
+	/* Verdict of the deferred callback is resumed by the test */
+	int defer_rcpt;
+	/* Callback defers and resumes its verdict before returning */
+	int resume_inline;
+	/* Deferred verdict of EOM, cancel callback resumes it if set */
+	int defer_eom;
+	int resume_on_cancel;
+	enum rmilter_cancel_reason reason;
+	struct rmilter_pending *pending;
+	char from[64];
+	char param[64];
+};
+
+static struct test_state st;
+
+static void
+test_log (void *log_data, enum rmilter_log_level level, const char *module,
+		const char *id, const char *function, const char *format, va_list args)
+{
+}
+
+static void
+mta_init (struct test_mta *mta, struct rmilter_callbacks *cbs)
+{
+	int sv[2];
+
+	memset (mta, 0, sizeof (*mta));
+	memset (&st, 0, sizeof (st));
+	RMILTER_CHECK (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	RMILTER_CHECK (fcntl (sv[0], F_SETFL, O_NONBLOCK) == 0);
+	mta->fd = sv[0];
+	mta->loop = rmilter_epoll_new ();
+	RMILTER_CHECK (mta->loop != NULL);
+	mta->async = rmilter_gen_epoll (mta->loop);
+	mta->m = rmilter_create (cbs, mta->async, test_log, NULL);
+	RMILTER_CHECK (mta->m != NULL);
+	RMILTER_CHECK (rmilter_consume_socket (mta->m, sv[1], "test", "session",
+			NULL));
+}
+
+static void
+mta_free (struct test_mta *mta)
+{
+	rmilter_destroy (mta->m);
+	rmilter_epoll_free (mta->loop);
+	free (mta->async);
+}
+
+static void
+mta_send (struct test_mta *mta, char cmd, const void *data, size_t len)
+{
+	unsigned char frame[1024];
+	uint32_t nlen = htonl (len + 1);
+
+	RMILTER_CHECK (len + 5 <= sizeof (frame));
+	memcpy (frame, &nlen, sizeof (nlen));
+	frame[4] = cmd;
+
+	if (len > 0) {
+		memcpy (frame + 5, data, len);
+	}
+
+	RMILTER_CHECK (write (mta->fd, frame, len + 5) == (ssize_t)(len + 5));
+}
+
+/* Sends NUL terminated strings as the command arguments */
+static void
+mta_send_args (struct test_mta *mta, char cmd, const char *arg1,
+		const char *arg2)
+{
+	char data[256];
+	size_t len = strlen (arg1) + 1;
+
+	memcpy (data, arg1, len);
+
+	if (arg2 != NULL) {
+		memcpy (data + len, arg2, strlen (arg2) + 1);
+		len += strlen (arg2) + 1;
+	}
+
+	mta_send (mta, cmd, data, len);
+}
+
+/*
+ * Runs the loop once, the loop waits for at most `timeout_ms`
+ * @return FALSE if nothing has happened
+ */
+static int
+mta_run (struct test_mta *mta, int timeout_ms)
+{
+	struct pollfd pfd;
+
+	if (mta->loop->pending == NULL) {
+		/* Timers are armed by the loop right before it waits */
+		rmilter_epoll_arm_timer (mta->loop);
+		pfd.fd = mta->loop->epfd;
+		pfd.events = POLLIN;
+
+		if (poll (&pfd, 1, timeout_ms) == 0) {
+			return 0;
+		}
+	}
+
+	RMILTER_CHECK (rmilter_epoll_run_once (mta->loop) != -1);
+
+	return 1;
+}
+
+/*
+ * Reads the next reply of the milter, the loop is run until it comes
+ * @return command of the reply or 0 if no reply is sent within `timeout_ms`
+ */
+static char
+mta_reply (struct test_mta *mta, unsigned char *data, size_t *len,
+		int timeout_ms)
+{
+	int64_t deadline;
+	uint32_t flen;
+	ssize_t r;
+	int left;
+	char cmd;
+
+	/* Timers of the milter wake the loop up, so the wait is limited overall */
+	deadline = rmilter_epoll_now () + (int64_t)timeout_ms * 1000000;
+
+	for (;;) {
+		if (mta->len >= 4) {
+			memcpy (&flen, mta->buf, sizeof (flen));
+			flen = ntohl (flen);
+			RMILTER_CHECK (flen > 0 && flen + 4 <= sizeof (mta->buf));
+
+			if (mta->len >= flen + 4) {
+				cmd = mta->buf[4];
+
+				if (data != NULL) {
+					memcpy (data, mta->buf + 5, flen - 1);
+					*len = flen - 1;
+				}
+
+				memmove (mta->buf, mta->buf + flen + 4, mta->len - flen - 4);
+				mta->len -= flen + 4;
+
+				return cmd;
+			}
+		}
+
+		r = read (mta->fd, mta->buf + mta->len, sizeof (mta->buf) - mta->len);
+
+		if (r > 0) {
+			mta->len += r;
+			continue;
+		}
+
+		RMILTER_CHECK (r == -1 && errno == EAGAIN);
+		left = (int)((deadline - rmilter_epoll_now ()) / 1000000);
+
+		if (left <= 0 || !mta_run (mta, left)) {
+			return 0;
+		}
+	}
+}
+
+static void
+mta_optneg (struct test_mta *mta, uint32_t *protocol)
+{
+	uint32_t opts[3], reply[3];
+	size_t len;
+
+	opts[0] = htonl (SMFI_PROT_VERSION);
+	opts[1] = htonl (0x1ff);
+	/* All steps and no reply modes are offered */
+	opts[2] = htonl (0xfffff);
+	mta_send (mta, SMFIC_OPTNEG, opts, sizeof (opts));
+	RMILTER_CHECK (mta_reply (mta, (unsigned char *)reply, &len, 1000) ==
+			SMFIC_OPTNEG);
+	RMILTER_CHECK (len >= sizeof (reply));
+	RMILTER_CHECK (ntohl (reply[0]) == SMFI_PROT_VERSION);
+	*protocol = ntohl (reply[2]);
+}
+
+static enum librmilter_reply
+test_envfrom (struct rmilter_session *s, void *priv,
+		const struct rmilter_args *from)
+{
+	st.nmail ++;
+	RMILTER_CHECK (from->argc == 2);
+	snprintf (st.from, sizeof (st.from), "%s", from->argv[0]);
+	snprintf (st.param, sizeof (st.param), "%s", from->argv[1]);
+
+	return RMILTER_REPLY_CONTINUE;
+}
+
+static enum librmilter_reply
+test_envrcpt (struct rmilter_session *s, void *priv,
+		const struct rmilter_args *rcpt)
+{
+	struct rmilter_pending *p;
+
+	st.nrcpt ++;
+
+	if (st.resume_inline) {
+		p = rmilter_session_defer (s);
+		RMILTER_CHECK (rmilter_pending_session (p) == s);
+		rmilter_session_resume (p, RMILTER_REPLY_TEMPFAIL);
+
+		return RMILTER_REPLY_PENDING;
+	}
+
+	if (st.defer_rcpt) {
+		st.pending = rmilter_session_defer (s);
+		RMILTER_CHECK (st.pending != NULL);
+
+		return RMILTER_REPLY_PENDING;
+	}
+
+	return RMILTER_REPLY_CONTINUE;
+}
+
+static void
+test_cancel (struct rmilter_pending *p, enum rmilter_cancel_reason reason,
+		void *ud)
+{
+	RMILTER_CHECK (p == st.pending);
+	RMILTER_CHECK (ud == &st);
+	st.ncancel ++;
+	st.reason = reason;
+
+	if (st.resume_on_cancel) {
+		/* Verdict is ignored, MTA is not waiting for it anymore */
+		rmilter_session_resume (p, RMILTER_REPLY_REJECT);
+		st.pending = NULL;
+	}
+}
+
+static enum librmilter_reply
+test_eom (struct rmilter_session *s, void *priv)
+{
+	st.neom ++;
+
+	if (st.defer_eom) {
+		st.pending = rmilter_session_defer (s);
+		rmilter_pending_set_cancel (st.pending, test_cancel, &st);
+
+		return RMILTER_REPLY_PENDING;
+	}
+
+	return RMILTER_REPLY_ACCEPT;
+}
+
+static enum librmilter_reply
+test_abort (struct rmilter_session *s, void *priv)
+{
+	st.nabort ++;
+
+	return RMILTER_REPLY_CONTINUE;
+}
+
+static enum librmilter_reply
+test_close (struct rmilter_session *s, void *priv)
+{
+	st.nclose ++;
+
+	return RMILTER_REPLY_CONTINUE;
+}
+
+static void
+mta_quit (struct test_mta *mta)
+{
+	mta_send (mta, SMFIC_QUIT, NULL, 0);
+
+	while (st.nclose == 0) {
+		RMILTER_CHECK (mta_run (mta, 1000));
+	}
+
+	close (mta->fd);
+	mta->fd = -1;
+}
+
+static void
+test_round_trip (void)
+{
+	struct rmilter_callbacks cbs = {
+		.envfrom = test_envfrom,
+		.envrcpt = test_envrcpt,
+		.eom = test_eom,
+		.close = test_close
+	};
+	struct test_mta mta;
+	uint32_t protocol;
+
+	mta_init (&mta, &cbs);
+	mta_optneg (&mta, &protocol);
+
+	/* Only the steps with callbacks are requested, all of them need replies */
+	RMILTER_CHECK ((protocol & (SMFIP_NOCONNECT | SMFIP_NOHELO |
+			SMFIP_NOHDRS | SMFIP_NOBODY)) == (SMFIP_NOCONNECT | SMFIP_NOHELO |
+			SMFIP_NOHDRS | SMFIP_NOBODY));
+	RMILTER_CHECK ((protocol & (SMFIP_NOMAIL | SMFIP_NORCPT |
+			SMFIP_NR_MAIL | SMFIP_NR_RCPT)) == 0);
+
+	mta_send_args (&mta, SMFIC_MAIL, "<from@example.com>", "SIZE=100");
+	RMILTER_CHECK (mta_reply (&mta, NULL, NULL, 1000) == SMFIR_CONTINUE);
+	RMILTER_CHECK (st.nmail == 1);
+	RMILTER_CHECK (strcmp (st.from, "<from@example.com>") == 0);
+	RMILTER_CHECK (strcmp (st.param, "SIZE=100") == 0);
+
+	/* Commands sent after the deferred one wait for its verdict */
+	st.defer_rcpt = 1;
+	mta_send_args (&mta, SMFIC_RCPT, "<rcpt1@example.com>", NULL);
+	mta_send_args (&mta, SMFIC_RCPT, "<rcpt2@example.com>", NULL);
+	mta_send (&mta, SMFIC_BODYEOB, NULL, 0);
+	RMILTER_CHECK (mta_reply (&mta, NULL, NULL, 200) == 0);
+	RMILTER_CHECK (st.nrcpt == 1 && st.pending != NULL);
+
+	st.defer_rcpt = 0;
+	rmilter_session_resume (st.pending, RMILTER_REPLY_REJECT);
+	st.pending = NULL;
+	RMILTER_CHECK (mta_reply (&mta, NULL, NULL, 1000) == SMFIR_REJECT);
+	RMILTER_CHECK (mta_reply (&mta, NULL, NULL, 1000) == SMFIR_CONTINUE);
+	RMILTER_CHECK (mta_reply (&mta, NULL, NULL, 1000) == SMFIR_ACCEPT);
+	RMILTER_CHECK (st.nrcpt == 2 && st.neom == 1);
+
+	/* Verdict resumed from the callback itself is sent as usual */
+	st.resume_inline = 1;
+	mta_send_args (&mta, SMFIC_MAIL, "<>", "BODY=8BITMIME");
+	mta_send_args (&mta, SMFIC_RCPT, "<rcpt3@example.com>", NULL);
+	mta_send (&mta, SMFIC_BODYEOB, NULL, 0);
+	RMILTER_CHECK (mta_reply (&mta, NULL, NULL, 1000) == SMFIR_CONTINUE);
+	RMILTER_CHECK (mta_reply (&mta, NULL, NULL, 1000) == SMFIR_TEMPFAIL);
+	RMILTER_CHECK (mta_reply (&mta, NULL, NULL, 1000) == SMFIR_ACCEPT);
+	RMILTER_CHECK (st.nmail == 2 && st.nrcpt == 3 && st.neom == 2);
+
+	mta_quit (&mta);
+	RMILTER_CHECK (st.nclose == 1);
+	mta_free (&mta);
+}
+
+static struct rmilter_callbacks cancel_cbs = {
+	.envfrom = test_envfrom,
+	.eom = test_eom,
+	.abort = test_abort,
+	.close = test_close
+};
+
+/* Starts a message and defers its EOM verdict */
+static void
+mta_defer_eom (struct test_mta *mta)
+{
+	uint32_t protocol;
+
+	mta_optneg (mta, &protocol);
+	st.defer_eom = 1;
+	mta_send_args (mta, SMFIC_MAIL, "<from@example.com>", "SIZE=1");
+	RMILTER_CHECK (mta_reply (mta, NULL, NULL, 1000) == SMFIR_CONTINUE);
+	mta_send (mta, SMFIC_BODYEOB, NULL, 0);
+
+	while (st.pending == NULL) {
+		RMILTER_CHECK (mta_run (mta, 1000));
+	}
+}
+
+static void
+test_cancel_abort (void)
+{
+	struct test_mta mta;
+
+	mta_init (&mta, &cancel_cbs);
+	mta_defer_eom (&mta);
+	st.resume_on_cancel = 1;
+
+	/* Abort is read while the verdict is pending */
+	mta_send (&mta, SMFIC_ABORT, NULL, 0);
+	mta_send_args (&mta, SMFIC_MAIL, "<next@example.com>", "SIZE=2");
+	RMILTER_CHECK (mta_reply (&mta, NULL, NULL, 1000) == SMFIR_CONTINUE);
+	RMILTER_CHECK (st.ncancel == 1 && st.reason == RMILTER_CANCEL_ABORT);
+	RMILTER_CHECK (st.pending == NULL && st.nabort == 1);
+	RMILTER_CHECK (strcmp (st.from, "<next@example.com>") == 0);
+
+	/* Neither the ignored verdict nor the abort got a reply */
+	RMILTER_CHECK (mta_reply (&mta, NULL, NULL, 100) == 0);
+
+	mta_quit (&mta);
+	mta_free (&mta);
+}
+
+static void
+test_cancel_close (void)
+{
+	struct test_mta mta;
+
+	mta_init (&mta, &cancel_cbs);
+	mta_defer_eom (&mta);
+
+	close (mta.fd);
+	mta.fd = -1;
+
+	while (st.nclose == 0) {
+		RMILTER_CHECK (mta_run (&mta, 1000));
+	}
+
+	RMILTER_CHECK (st.ncancel == 1 && st.reason == RMILTER_CANCEL_CLOSE);
+
+	/* Handle outlives the session until it is resumed */
+	RMILTER_CHECK (st.pending != NULL);
+	RMILTER_CHECK (rmilter_pending_session (st.pending) == NULL);
+	rmilter_session_resume (st.pending, RMILTER_REPLY_ACCEPT);
+	st.pending = NULL;
+
+	mta_free (&mta);
+}
+
+static void
+test_cancel_timeout (void)
+{
+	struct test_mta mta;
+
+	mta_init (&mta, &cancel_cbs);
+	rmilter_set_stage_timeout (mta.m, RMILTER_STAGE_EOM, 0.2);
+	mta_defer_eom (&mta);
+
+	/* Stage budget is over, MTA gets tempfail */
+	RMILTER_CHECK (mta_reply (&mta, NULL, NULL, 2000) == SMFIR_TEMPFAIL);
+	RMILTER_CHECK (st.ncancel == 1 && st.reason == RMILTER_CANCEL_TIMEOUT);
+
+	/* Late verdict is ignored and the session goes on */
+	RMILTER_CHECK (st.pending != NULL);
+	rmilter_session_resume (st.pending, RMILTER_REPLY_ACCEPT);
+	st.pending = NULL;
+	st.defer_eom = 0;
+	mta_send_args (&mta, SMFIC_MAIL, "<next@example.com>", "SIZE=2");
+	mta_send (&mta, SMFIC_BODYEOB, NULL, 0);
+	RMILTER_CHECK (mta_reply (&mta, NULL, NULL, 1000) == SMFIR_CONTINUE);
+	RMILTER_CHECK (mta_reply (&mta, NULL, NULL, 1000) == SMFIR_ACCEPT);
+	RMILTER_CHECK (st.ncancel == 1 && st.neom == 2);
+
+	mta_quit (&mta);
+	mta_free (&mta);
+}
+
+int
+main (int argc, char **argv)
+{
+	test_round_trip ();
+	test_cancel_abort ();
+	test_cancel_close ();
+	test_cancel_timeout ();
+
+	return 0;
+}
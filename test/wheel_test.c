@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Timer wheel: timers that are several revolutions ahead fire at their own
+ * tick, not when their slot comes around earlier, long stalls fire every
+ * timer once, callbacks could rearm and cancel timers
+ */
+
+#include <string.h>
+#include "wheel.h"
+#include "test.h"
+
+#define NTIMERS 16
+
+struct test_timer {
+	struct rmilter_wheel_timer t;
+	struct rmilter_wheel *w;
+	gint64 fired;
+	guint nfired;
+	/* Rearm period in ticks, 0 for one-shot timers */
+	gint64 period;
+	/* Timer to cancel from the callback */
+	struct test_timer *victim;
+};
+
+/* Simulated time, it is kept ahead of the real one used by the wheel */
+static gint64 base, now;
+
+static void
+test_timer_cb (void *ud)
+{
+	struct test_timer *tt = ud;
+
+	tt->fired = now;
+	tt->nfired ++;
+
+	if (tt->period > 0) {
+		rmilter_wheel_arm (tt->w, &tt->t,
+				now + tt->period * RMILTER_WHEEL_TICK_US);
+	}
+
+	if (tt->victim != NULL) {
+		rmilter_wheel_cancel (tt->w, &tt->victim->t);
+	}
+}
+
+static void
+test_timer_init (struct test_timer *tt, struct rmilter_wheel *w)
+{
+	memset (tt, 0, sizeof (*tt));
+	tt->w = w;
+	rmilter_wheel_timer_init (&tt->t, test_timer_cb, tt);
+}
+
+static void
+reset_time (void)
+{
+	base = (g_get_monotonic_time () / RMILTER_WHEEL_TICK_US + 100) *
+			RMILTER_WHEEL_TICK_US;
+	now = base;
+}
+
+static void
+test_revolutions (void)
+{
+	static const gint64 ticks[NTIMERS] = {
+		1, 2, 511, 512, 513, 700, 1023, 1024, 1025, 1536, 2047, 2048,
+		2049, 5 * RMILTER_WHEEL_SLOTS, 5 * RMILTER_WHEEL_SLOTS + 1, 3000
+	};
+	struct rmilter_wheel w;
+	struct test_timer tt[NTIMERS];
+	gint64 tick;
+	guint i;
+
+	rmilter_wheel_init (&w);
+	reset_time ();
+
+	for (i = 0; i < NTIMERS; i ++) {
+		test_timer_init (&tt[i], &w);
+		rmilter_wheel_arm (&w, &tt[i].t,
+				base + ticks[i] * RMILTER_WHEEL_TICK_US);
+		RMILTER_CHECK (rmilter_wheel_timer_armed (&tt[i].t));
+	}
+
+	RMILTER_CHECK (w.count == NTIMERS);
+	rmilter_wheel_expire (&w, base);
+
+	for (tick = 1; tick <= ticks[NTIMERS - 1]; tick ++) {
+		now = base + tick * RMILTER_WHEEL_TICK_US;
+		rmilter_wheel_expire (&w, now);
+
+		for (i = 0; i < NTIMERS; i ++) {
+			if (ticks[i] <= tick) {
+				RMILTER_CHECK (tt[i].nfired == 1);
+				RMILTER_CHECK (tt[i].fired ==
+						base + ticks[i] * RMILTER_WHEEL_TICK_US);
+				RMILTER_CHECK (!rmilter_wheel_timer_armed (&tt[i].t));
+			}
+			else {
+				RMILTER_CHECK (tt[i].nfired == 0);
+			}
+		}
+	}
+
+	RMILTER_CHECK (w.count == 0);
+}
+
+static void
+test_rounding (void)
+{
+	struct rmilter_wheel w;
+	struct test_timer tt, guard;
+
+	rmilter_wheel_init (&w);
+	reset_time ();
+	test_timer_init (&tt, &w);
+
+	/* Non-empty wheel keeps the last processed tick */
+	test_timer_init (&guard, &w);
+	rmilter_wheel_arm (&w, &guard.t, base + 1000 * RMILTER_WHEEL_TICK_US);
+
+	/* Time between ticks is rounded up, timer never fires early */
+	rmilter_wheel_arm (&w, &tt.t, base + RMILTER_WHEEL_TICK_US * 3 / 2);
+	now = base + RMILTER_WHEEL_TICK_US;
+	rmilter_wheel_expire (&w, now + RMILTER_WHEEL_TICK_US - 1);
+	RMILTER_CHECK (tt.nfired == 0);
+	now = base + RMILTER_WHEEL_TICK_US * 2;
+	rmilter_wheel_expire (&w, now);
+	RMILTER_CHECK (tt.nfired == 1);
+
+	/* Timer in the past fires on the next tick */
+	rmilter_wheel_arm (&w, &tt.t, base);
+	rmilter_wheel_expire (&w, now);
+	RMILTER_CHECK (tt.nfired == 1);
+	now += RMILTER_WHEEL_TICK_US;
+	rmilter_wheel_expire (&w, now);
+	RMILTER_CHECK (tt.nfired == 2);
+	RMILTER_CHECK (guard.nfired == 0);
+	rmilter_wheel_cancel (&w, &guard.t);
+	RMILTER_CHECK (w.count == 0);
+}
+
+static void
+test_stall (void)
+{
+	struct rmilter_wheel w;
+	struct test_timer tt[NTIMERS];
+	guint i;
+
+	rmilter_wheel_init (&w);
+	reset_time ();
+
+	for (i = 0; i < NTIMERS; i ++) {
+		test_timer_init (&tt[i], &w);
+		rmilter_wheel_arm (&w, &tt[i].t,
+				base + (i * 397 + 1) * RMILTER_WHEEL_TICK_US);
+	}
+
+	/* All timers expired long ago, each of them fires once */
+	rmilter_wheel_expire (&w, base);
+	now = base + 20 * RMILTER_WHEEL_SLOTS * RMILTER_WHEEL_TICK_US;
+	rmilter_wheel_expire (&w, now);
+
+	for (i = 0; i < NTIMERS; i ++) {
+		RMILTER_CHECK (tt[i].nfired == 1);
+	}
+
+	RMILTER_CHECK (w.count == 0);
+}
+
+static void
+test_callbacks (void)
+{
+	struct rmilter_wheel w;
+	struct test_timer periodic, killer, victim, other;
+	gint64 tick;
+
+	rmilter_wheel_init (&w);
+	reset_time ();
+	test_timer_init (&periodic, &w);
+	test_timer_init (&killer, &w);
+	test_timer_init (&victim, &w);
+	test_timer_init (&other, &w);
+
+	/* Period over a revolution is rearmed to the same slot */
+	periodic.period = RMILTER_WHEEL_SLOTS;
+	rmilter_wheel_arm (&w, &periodic.t, base + RMILTER_WHEEL_SLOTS *
+			RMILTER_WHEEL_TICK_US);
+
+	/* Killer and victim expire on the same tick, victim must not fire */
+	killer.victim = &victim;
+	rmilter_wheel_arm (&w, &killer.t, base + 10 * RMILTER_WHEEL_TICK_US);
+	rmilter_wheel_arm (&w, &victim.t, base + 10 * RMILTER_WHEEL_TICK_US);
+	rmilter_wheel_arm (&w, &other.t, base + 20 * RMILTER_WHEEL_TICK_US);
+
+	/* Rearming moves the timer */
+	rmilter_wheel_arm (&w, &other.t, base + 30 * RMILTER_WHEEL_TICK_US);
+	RMILTER_CHECK (w.count == 4);
+
+	rmilter_wheel_expire (&w, base);
+
+	for (tick = 1; tick <= 3 * RMILTER_WHEEL_SLOTS; tick ++) {
+		now = base + tick * RMILTER_WHEEL_TICK_US;
+		rmilter_wheel_expire (&w, now);
+		RMILTER_CHECK (periodic.nfired == tick / RMILTER_WHEEL_SLOTS);
+	}
+
+	RMILTER_CHECK (killer.nfired == 1);
+	RMILTER_CHECK (victim.nfired == 0);
+	RMILTER_CHECK (other.nfired == 1);
+	RMILTER_CHECK (other.fired == base + 30 * RMILTER_WHEEL_TICK_US);
+	RMILTER_CHECK (w.count == 1);
+
+	rmilter_wheel_cancel (&w, &periodic.t);
+	rmilter_wheel_cancel (&w, &periodic.t);
+	RMILTER_CHECK (w.count == 0);
+}
+
+int
+main (int argc, char **argv)
+{
+	test_revolutions ();
+	test_rounding ();
+	test_stall ();
+	test_callbacks ();
+
+	return 0;
+}